@@ -0,0 +1,321 @@
+/*******************************************************************************
+ CommandBusConfig.h
+
+ Compile-time configuration for the command bus library. Each setting can be
+ overridden by defining it before this header is included (e.g., with a -D
+ compiler flag or in a header included ahead of the library).
+*******************************************************************************/
+#ifndef _CommandBusConfig_h_
+#define _CommandBusConfig_h_
+
+
+//****************************************************************************
+// Command queue
+//****************************************************************************
+
+// Number of command slots in the listener's receive queue (must be a power of 2)
+#ifndef COMMANDBUS_QUEUE_SIZE
+#define COMMANDBUS_QUEUE_SIZE   4
+#endif
+
+// Number of command slots reserved for high priority commands (must be a
+// power of 2). These are kept apart from the normal queue so that a flood of
+// normal commands can never crowd out a high priority command.
+#ifndef COMMANDBUS_PRIORITY_QUEUE_SIZE
+#define COMMANDBUS_PRIORITY_QUEUE_SIZE 2
+#endif
+
+// Default work budget for each call to CommandListener::Poll(): the most
+// commands it handles, and the most time it spends on them in microseconds
+// (0 for no limit). Commands left over wait for the next Poll().
+#ifndef COMMANDBUS_POLL_MAX_COMMANDS
+#define COMMANDBUS_POLL_MAX_COMMANDS 0
+#endif
+
+#ifndef COMMANDBUS_POLL_MAX_MICROS
+#define COMMANDBUS_POLL_MAX_MICROS 0
+#endif
+
+// Size of each command slot, in bytes (the largest command that can be received)
+#ifndef COMMANDBUS_COMMAND_SIZE
+#define COMMANDBUS_COMMAND_SIZE 32
+#endif
+
+
+//****************************************************************************
+// Responses
+//****************************************************************************
+
+// Size of a response buffer, in bytes (the largest response that can be sent)
+#ifndef COMMANDBUS_RESPONSE_SIZE
+#define COMMANDBUS_RESPONSE_SIZE 32
+#endif
+
+// Number of response buffers (at least 2, so a new response can be built
+// while the previous one is being sent)
+#ifndef COMMANDBUS_RESPONSE_SLOTS
+#define COMMANDBUS_RESPONSE_SLOTS 2
+#endif
+
+// Number of pre-built responses that can be cached for idempotent commands,
+// which are then answered directly from the receive interrupt handler
+// (0 disables the cache)
+#ifndef COMMANDBUS_RESPONSE_CACHE_SIZE
+#define COMMANDBUS_RESPONSE_CACHE_SIZE 2
+#endif
+
+// Largest response that can be cached, in bytes
+#ifndef COMMANDBUS_CACHED_RESPONSE_SIZE
+#define COMMANDBUS_CACHED_RESPONSE_SIZE 8
+#endif
+
+// Largest number of bytes that can be sent for a single response request
+// (the size of the Wire library's transmit buffer). Longer responses are sent
+// across several requests.
+#ifndef COMMANDBUS_TX_WINDOW
+#define COMMANDBUS_TX_WINDOW 32
+#endif
+
+// Largest number of bytes sent for the first request of a response. Most
+// responses fit (the default holds a CMD_RESPONSE_DEFERRED or NOTREADY
+// response and its CRC byte), so the master only reads this much of each
+// response first, and reads the rest of a longer one TX_WINDOW bytes at a
+// time. The master and the slave devices must agree on it.
+#ifndef COMMANDBUS_TX_FIRST_WINDOW
+#define COMMANDBUS_TX_FIRST_WINDOW 6
+#endif
+
+// Number of deferred responses that can be outstanding at once (must be a power of 2)
+#ifndef COMMANDBUS_DEFERRED_SIZE
+#define COMMANDBUS_DEFERRED_SIZE 4
+#endif
+
+// Set to 1 to run the handlers of commands marked inline-safe (see 
+// COMMAND_HANDLER_INLINE) directly in the receive interrupt handler, so their
+// response is ready when the master reads it in the same transaction. This
+// costs a command buffer and a response buffer. When 0, inline-safe commands
+// are queued for Poll() like any other command.
+#ifndef COMMANDBUS_INLINE_HANDLERS
+#define COMMANDBUS_INLINE_HANDLERS 0
+#endif
+
+// Set to 1 to accept pipelined commands (CMD_TAGGED), which are completed in
+// any order and collected with CMD_COLLECT. Each pipelined command in flight
+// holds a deferred response slot until it is collected.
+#ifndef COMMANDBUS_PIPELINE
+#define COMMANDBUS_PIPELINE 0
+#endif
+
+// Number of command codes whose deferred handling times are learned, to give
+// the master a hint of when to query for a deferred response (0 disables
+// the timing hints)
+#ifndef COMMANDBUS_TIMING_CODES
+#define COMMANDBUS_TIMING_CODES 4
+#endif
+
+// Number of blocks in the response pool, which holds responses (immediate or
+// deferred) that are too big for a response buffer (0 disables the pool)
+#ifndef COMMANDBUS_POOL_BLOCKS
+#define COMMANDBUS_POOL_BLOCKS 0
+#endif
+
+// Size of each response pool block, in bytes (the largest pooled response)
+#ifndef COMMANDBUS_POOL_BLOCK_SIZE
+#define COMMANDBUS_POOL_BLOCK_SIZE 64
+#endif
+
+// Largest response that can be sent or received, in bytes. A CommandClient
+// talking to slave devices that use the response pool needs this to be at
+// least as big as their pool blocks.
+#ifndef COMMANDBUS_MAX_RESPONSE_SIZE
+#if COMMANDBUS_POOL_BLOCKS > 0 && COMMANDBUS_POOL_BLOCK_SIZE > COMMANDBUS_RESPONSE_SIZE
+#define COMMANDBUS_MAX_RESPONSE_SIZE COMMANDBUS_POOL_BLOCK_SIZE
+#else
+#define COMMANDBUS_MAX_RESPONSE_SIZE COMMANDBUS_RESPONSE_SIZE
+#endif
+#endif
+
+
+//****************************************************************************
+// Framing
+//****************************************************************************
+
+// Set to 1 to follow every command and response frame with a CRC-8 byte
+// (see CommandCRC.h). Corrupted commands are rejected with a
+// CMD_RESPONSE_CORRUPT response before they are queued. Both ends of the
+// bus must be built with the same setting.
+#ifndef COMMANDBUS_CRC
+#define COMMANDBUS_CRC 0
+#endif
+
+#if COMMANDBUS_CRC
+#define COMMANDBUS_CRC_SIZE 1
+#else
+#define COMMANDBUS_CRC_SIZE 0
+#endif
+
+
+// Set to 1 for credit-based flow control. The listener answers CMD_QUERY_STATUS
+// with the room it has left, and CommandClient keeps a count of how many more
+// commands each slave device can take, only sending when there is room (and
+// querying again when the count runs out). Both ends of the bus must be built
+// with the same setting.
+#ifndef COMMANDBUS_FLOW_CONTROL
+#define COMMANDBUS_FLOW_CONTROL 0
+#endif
+
+
+//****************************************************************************
+// Instrumentation
+//****************************************************************************
+
+// Set to 1 to have CommandListener keep performance statistics, which can be
+// read over the bus with the CMD_QUERY_STATS command. When 0 (the default)
+// the statistics compile to nothing.
+#ifndef COMMANDBUS_STATS
+#define COMMANDBUS_STATS 0
+#endif
+
+#if COMMANDBUS_STATS
+#define COMMANDBUS_STAT(statement) statement
+#else
+#define COMMANDBUS_STAT(statement)
+#endif
+
+// Number of frames kept in the listener's bus trace ring, which can be read
+// over the bus with the CMD_QUERY_TRACE command (must be a power of 2 no
+// larger than 128). Each record costs a timestamp and 3 bytes of RAM, and 
+// recording one only takes a few cycles with interrupts disabled, so the
+// trace can be left on in production. 0 (the default) compiles it out.
+#ifndef COMMANDBUS_TRACE_SIZE
+#define COMMANDBUS_TRACE_SIZE 0
+#endif
+
+#if COMMANDBUS_TRACE_SIZE > 0
+#define COMMANDBUS_RECORD(statement) statement
+#else
+#define COMMANDBUS_RECORD(statement)
+#endif
+
+// Number of command codes whose handler latency histograms are kept, which
+// can be read over the bus with the CMD_QUERY_HISTOGRAM command. The first
+// command codes handled get the histograms. Each one costs 1 + 2 bytes per 
+// bucket of RAM (0, the default, disables the histograms).
+#ifndef COMMANDBUS_HISTOGRAM_CODES
+#define COMMANDBUS_HISTOGRAM_CODES 0
+#endif
+
+// Number of buckets in each histogram. Bucket n counts handler times from
+// 2^n up to 2^(n+1) microseconds, and the last bucket counts everything
+// longer, so 16 buckets go up to about 33 ms.
+#ifndef COMMANDBUS_HISTOGRAM_BUCKETS
+#define COMMANDBUS_HISTOGRAM_BUCKETS 16
+#endif
+
+
+//****************************************************************************
+// Push mode
+//****************************************************************************
+
+// Set to 1 to let CommandListener push CMD_NOTIFY messages (ready deferred
+// responses and telemetry) to the master's address (see
+// CommandListener::EnablePush()), so the master doesn't have to poll for them
+#ifndef COMMANDBUS_PUSH
+#define COMMANDBUS_PUSH 0
+#endif
+
+// Default shortest time between notifications, in microseconds
+#ifndef COMMANDBUS_PUSH_INTERVAL
+#define COMMANDBUS_PUSH_INTERVAL 10000
+#endif
+
+// Largest telemetry data that can be pushed, in bytes
+#ifndef COMMANDBUS_TELEMETRY_SIZE
+#define COMMANDBUS_TELEMETRY_SIZE 16
+#endif
+
+
+//****************************************************************************
+// Transports
+//****************************************************************************
+
+// Set to 1 to compile in the frame level entry points of CommandListener
+// (AcquireReceiveFrame() etc.), for transports whose peripheral moves whole
+// frames by DMA. With CRC framing enabled this costs a transmit frame buffer.
+#ifndef COMMANDBUS_DMA
+#define COMMANDBUS_DMA 0
+#endif
+
+// A gap between bytes longer than this (in microseconds) abandons a partly
+// received transaction on a SerialCommandTransport
+#ifndef COMMANDBUS_SERIAL_FRAME_TIMEOUT
+#define COMMANDBUS_SERIAL_FRAME_TIMEOUT 2000
+#endif
+
+
+//****************************************************************************
+// Command client (master side)
+//****************************************************************************
+
+// Number of requests a CommandClient can have outstanding at once
+#ifndef COMMANDBUS_CLIENT_REQUESTS
+#define COMMANDBUS_CLIENT_REQUESTS 8
+#endif
+
+// Default time to wait after sending a command before reading its response, in microseconds
+#ifndef COMMANDBUS_CLIENT_RESPONSE_DELAY
+#define COMMANDBUS_CLIENT_RESPONSE_DELAY 1000
+#endif
+
+// Default time between CMD_QUERY_RESPONSE polls for a deferred response, in microseconds
+#ifndef COMMANDBUS_CLIENT_QUERY_INTERVAL
+#define COMMANDBUS_CLIENT_QUERY_INTERVAL 5000
+#endif
+
+// Default time a request may remain outstanding before it fails, in microseconds
+#ifndef COMMANDBUS_CLIENT_TIMEOUT
+#define COMMANDBUS_CLIENT_TIMEOUT 500000
+#endif
+
+
+//****************************************************************************
+// Platform hooks
+//****************************************************************************
+
+// The microsecond clock used for all of the library's timing. Replacing it
+// lets a simulation or benchmark build run the library on simulated time.
+#ifndef COMMANDBUS_MICROS
+#define COMMANDBUS_MICROS() micros()
+#endif
+
+
+//****************************************************************************
+/// Interrupt-safe critical section.
+///
+/// Code between COMMANDBUS_ATOMIC_BEGIN and COMMANDBUS_ATOMIC_END runs with
+/// interrupts disabled, and the interrupt state is restored afterwards, so it
+/// can be used from an interrupt handler as well as from the main loop.
+//****************************************************************************
+#ifndef COMMANDBUS_ATOMIC_BEGIN
+#if defined(__AVR__)
+#define COMMANDBUS_ATOMIC_BEGIN { uint8_t _commandBusSREG = SREG; cli();
+#define COMMANDBUS_ATOMIC_END   SREG = _commandBusSREG; }
+#elif defined(__arm__)
+#define COMMANDBUS_ATOMIC_BEGIN { uint32_t _commandBusPRIMASK = __get_PRIMASK(); __disable_irq();
+#define COMMANDBUS_ATOMIC_END   __set_PRIMASK(_commandBusPRIMASK); }
+#else
+#define COMMANDBUS_ATOMIC_BEGIN { noInterrupts();
+#define COMMANDBUS_ATOMIC_END   interrupts(); }
+#endif
+#endif
+
+
+//****************************************************************************
+/// Compiler memory barrier.
+///
+/// Keeps the compiler from moving buffer reads/writes across the update of
+/// an index that is shared between an interrupt handler and the main loop.
+//****************************************************************************
+#define COMMANDBUS_BARRIER()    __asm__ __volatile__("" ::: "memory")
+
+#endif
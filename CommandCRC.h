@@ -0,0 +1,43 @@
+/*******************************************************************************
+ CommandCRC.h
+
+ CRC-8 used to protect command and response frames on the bus.
+*******************************************************************************/
+#ifndef _CommandCRC_h_
+#define _CommandCRC_h_
+
+#include <Arduino.h>
+#include "CommandBusConfig.h"
+
+
+//****************************************************************************
+/// CRC-8 with the SMBus PEC polynomial (x^8 + x^2 + x + 1) and an initial
+/// value of 0, computed a byte at a time from a 256 byte lookup table in
+/// PROGMEM so that it can be updated as each byte arrives in an interrupt
+/// handler.
+///
+/// When COMMANDBUS_CRC is enabled, every command and response frame is
+/// followed by one CRC byte computed over the frame's Length bytes. Running
+/// the CRC over a frame and its CRC byte gives 0 when the frame is intact.
+///
+/// The CRC covers the frame only, not the I2C address byte, so it is not an
+/// SMBus PEC even though it uses the same polynomial. The frames are the
+/// same on every transport (SPI has no address byte), a slave device can't 
+/// tell a general call write from one addressed to it, and a long response
+/// is read over several transactions with a single CRC byte at the end.
+//****************************************************************************
+extern const byte CRC8_Table[256] PROGMEM;
+
+inline byte CRC8_Update(const byte crc, const byte data)
+{
+    return pgm_read_byte(&CRC8_Table[crc ^ data]);
+}
+
+inline byte CRC8(const byte* pData, byte length, byte crc=0)
+{
+    while (length-- > 0) crc = CRC8_Update(crc, *pData++);
+
+    return crc;
+}
+
+#endif
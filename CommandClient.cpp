@@ -0,0 +1,637 @@
+/*******************************************************************************
+ CommandClient.cpp
+
+ Implementation file for the I2C command client (master side) class.
+*******************************************************************************/
+#define DEBUG 0
+
+#include <Arduino.h>
+#include <RTL_Debug.h>
+#include "CommandClient.h"
+
+
+DEFINE_CLASSNAME(CommandClient);
+
+
+// Response that requests complete with when they time out
+static const CommandResponse responseError = CommandResponse(CMD_RESPONSE_ERROR);
+
+#if COMMANDBUS_CRC
+// Stands in for a response that failed its CRC check. This is told apart
+// from a CMD_RESPONSE_CORRUPT response sent by the slave device (for a 
+// corrupted command) by its address.
+static const CommandResponse responseCorrupt = CommandResponse(CMD_RESPONSE_CORRUPT);
+#endif
+
+
+//****************************************************************************
+// Queues a command to be sent to a slave device
+//****************************************************************************
+bool CommandClient::SendCommand(byte slaveAddress, const CommandMessage* pCommand, CommandResponseHandler handler, void* pContext)
+{
+    return QueueRequest(slaveAddress, pCommand, handler, pContext) != NULL;
+}
+
+
+#if COMMANDBUS_PIPELINE
+//****************************************************************************
+// Queues a command to be sent to a slave device wrapped in a CommandTagged
+// envelope, with the next tag
+//****************************************************************************
+bool CommandClient::SendPipelinedCommand(byte slaveAddress, const CommandMessage* pCommand, CommandResponseHandler handler, void* pContext)
+{
+    if (handler == NULL || pCommand == NULL || pCommand->Length < sizeof(CommandMessage) || pCommand->Length > sizeof(CommandTagged::Command)) return false;
+
+    // Tags are never 0
+    byte tag = (_lastTag == 0xFF) ? 1 : _lastTag + 1;
+    auto command = CommandTagged(tag, pCommand);
+    auto pRequest = QueueRequest(slaveAddress, &command, handler, pContext);
+
+    if (pRequest == NULL) return false;
+
+    pRequest->ResponseID = tag;
+    _lastTag = tag;
+
+    return true;
+}
+#endif
+
+
+//****************************************************************************
+// Takes a free request slot for a command.
+// Returns NULL if all request slots are in use or the command is too big.
+//****************************************************************************
+CommandClient::Request* CommandClient::QueueRequest(byte slaveAddress, const CommandMessage* pCommand, CommandResponseHandler handler, void* pContext)
+{
+    if (pCommand == NULL || pCommand->Length < sizeof(CommandMessage) || pCommand->Length > COMMAND_SIZE) return NULL;
+
+    for (auto& request : _requests)
+    {
+        if (request.State != REQUEST_FREE) continue;
+
+        auto now = COMMANDBUS_MICROS();
+
+        request.SlaveAddress = slaveAddress;
+        request.ResponseID   = 0;
+        request.StartTime    = now;
+        request.DueTime      = now;
+        request.Handler      = handler;
+        request.pContext     = pContext;
+        memcpy(request.Command, (const byte*)pCommand, pCommand->Length);
+        request.State = REQUEST_QUEUED;
+
+        return &request;
+    }
+
+    return NULL;
+}
+
+
+bool CommandClient::IsIdle() const
+{
+    return PendingCount() == 0;
+}
+
+
+bool CommandClient::IsBusy(byte slaveAddress) const
+{
+    for (auto& request : _requests)
+    {
+        if (request.State != REQUEST_FREE && request.SlaveAddress == slaveAddress) return true;
+    }
+
+    return false;
+}
+
+
+byte CommandClient::PendingCount() const
+{
+    byte count = 0;
+
+    for (auto& request : _requests)
+    {
+        if (request.State != REQUEST_FREE) count++;
+    }
+
+    return count;
+}
+
+
+//****************************************************************************
+// EventSource Poll method override to move the outstanding requests along
+//****************************************************************************
+void CommandClient::Poll()
+{
+    TRACE(Logger(_classname_, __func__, this) << endl);
+
+    if (_notifyPending) ProcessNotify(COMMANDBUS_MICROS());
+
+    for (auto& request : _requests)
+    {
+        PollRequest(request, COMMANDBUS_MICROS());
+    }
+
+    EventSource::Poll();
+}
+
+
+void CommandClient::PollRequest(Request& request, unsigned long now)
+{
+    if (request.State == REQUEST_FREE) return;
+
+    if ((long)(now - request.DueTime) < 0) return;
+
+    if (now - request.StartTime > _timeout)
+    {
+        CompleteRequest(request, &responseError);
+        return;
+    }
+
+    auto pCommand = (const CommandMessage*)request.Command;
+
+    switch (request.State)
+    {
+        case REQUEST_QUEUED:
+        {
+            if (IsOnBus(request.SlaveAddress)) return;
+
+            // Requests to the same slave device are sent in the order they were queued
+            for (auto& other : _requests)
+            {
+                if (other.State == REQUEST_QUEUED && other.SlaveAddress == request.SlaveAddress &&
+                    (long)(other.StartTime - request.StartTime) < 0) return;
+            }
+
+#if COMMANDBUS_FLOW_CONTROL
+            if (request.SlaveAddress != I2C_GENERAL_CALL_ADDRESS && !TakeCredit(request.SlaveAddress, pCommand->CommandCode == CMD_TAGGED, now))
+            {
+                request.DueTime = now + _responseDelay;
+                return;
+            }
+#endif
+
+            if (!WriteCommand(request.SlaveAddress, pCommand))
+            {
+                request.DueTime = now + _responseDelay;
+                return;
+            }
+
+            if (request.Handler == NULL)
+            {
+                request.State = REQUEST_FREE;
+                return;
+            }
+
+            // A pipelined command has no response of its own to read, so the
+            // next command can be sent to the slave device straight away
+            request.State   = (pCommand->CommandCode == CMD_TAGGED) ? REQUEST_PIPELINED : REQUEST_SENT;
+            request.DueTime = now + _responseDelay;
+        }
+        break;
+
+#if COMMANDBUS_PIPELINE
+        case REQUEST_PIPELINED:
+        {
+            if (IsOnBus(request.SlaveAddress)) return;
+
+            auto collect = CommandMessage(CMD_COLLECT);
+
+            if (!WriteCommand(request.SlaveAddress, &collect))
+            {
+                request.DueTime = now + _queryInterval;
+                return;
+            }
+
+            request.State   = REQUEST_COLLECTING;
+            request.DueTime = now + _responseDelay;
+        }
+        break;
+
+        case REQUEST_COLLECTING:
+        {
+            auto pResponse = ReadResponse(request.SlaveAddress);
+
+            if (pResponse == NULL || pResponse->ResponseCode == CMD_RESPONSE_NOTREADY)
+            {
+                request.DueTime = now + _responseDelay;
+                return;
+            }
+
+            switch (pResponse->ResponseCode)
+            {
+                case CMD_RESPONSE_OK:
+                    if (pResponse->Length >= ((const CommandResponseCollect*)pResponse)->HeaderLength())
+                    {
+                        ProcessCollect(request, (const CommandResponseCollect*)pResponse, now);
+                        return;
+                    }
+
+                    CompleteRequest(request, &responseError);
+                break;
+
+                // CMD_COLLECT can be sent again, but a corrupted collection
+                // can't be read again, so its requests will time out
+                case CMD_RESPONSE_BUSY:
+                case CMD_RESPONSE_CORRUPT:
+                    request.State   = REQUEST_PIPELINED;
+                    request.DueTime = now + _responseDelay;
+                break;
+
+                // The slave device doesn't support pipelining
+                default:
+                    CompleteRequest(request, pResponse);
+                break;
+            }
+        }
+        break;
+#endif
+
+        case REQUEST_DEFERRED:
+        {
+            if (IsOnBus(request.SlaveAddress)) return;
+
+            auto query = CommandQueryResponseReady(request.ResponseID, pCommand->CommandCode);
+
+            if (!WriteCommand(request.SlaveAddress, &query))
+            {
+                request.DueTime = now + _queryInterval;
+                return;
+            }
+
+            request.State   = REQUEST_QUERIED;
+            request.DueTime = now + _responseDelay;
+        }
+        break;
+
+        case REQUEST_SENT:
+        case REQUEST_QUERIED:
+        {
+            auto pResponse = ReadResponse(request.SlaveAddress);
+
+            if (pResponse == NULL)
+            {
+                request.DueTime = now + _responseDelay;
+                return;
+            }
+
+            switch (pResponse->ResponseCode)
+            {
+                // The slave device's timing hints (if any) say when to query
+                // for a deferred response, so it is usually only queried once
+                case CMD_RESPONSE_NOTREADY:
+                    // A freshly sent command may not have been handled yet,
+                    // but a deferred one just isn't done yet
+                    if (request.State == REQUEST_SENT)
+                    {
+                        request.DueTime = now + _responseDelay;
+                    }
+                    else
+                    {
+                        uint16_t retryAfterMs = (pResponse->Length >= sizeof(CommandResponseNotReady)) ? ((const CommandResponseNotReady*)pResponse)->RetryAfterMs.Get() : 0;
+
+                        request.State   = REQUEST_DEFERRED;
+                        request.DueTime = now + ((retryAfterMs > 0) ? retryAfterMs * 1000UL : _queryInterval);
+                    }
+                break;
+
+                case CMD_RESPONSE_DEFERRED:
+                {
+                    uint16_t readyInMs = (pResponse->Length >= sizeof(CommandResponseDeferred)) ? ((const CommandResponseDeferred*)pResponse)->ReadyInMs.Get() : 0;
+
+                    request.ResponseID = pResponse->ResponseID;
+                    request.State      = REQUEST_DEFERRED;
+                    request.DueTime    = now + ((readyInMs > 0) ? readyInMs * 1000UL : _queryInterval);
+                }
+                break;
+
+                case CMD_RESPONSE_BUSY:
+#if COMMANDBUS_FLOW_CONTROL
+                    // The credits were out of date, so query them again
+                    DropCredits(request.SlaveAddress);
+#endif
+                    request.State   = (request.State == REQUEST_SENT) ? REQUEST_QUEUED : REQUEST_DEFERRED;
+                    request.DueTime = now + _responseDelay;
+                break;
+
+                // The slave device got a corrupted command (or query), so it
+                // was never handled and is sent again right away. A response
+                // corrupted on the way back can't be read again, and the
+                // command has been handled, so it must not be sent again;
+                // the request completes with CMD_RESPONSE_CORRUPT.
+                case CMD_RESPONSE_CORRUPT:
+                    if (IsCorruptedResponse(pResponse))
+                    {
+                        CompleteRequest(request, pResponse);
+                    }
+                    else
+                    {
+                        request.State   = (request.State == REQUEST_SENT) ? REQUEST_QUEUED : REQUEST_DEFERRED;
+                        request.DueTime = now;
+                    }
+                break;
+
+                default:
+                    CompleteRequest(request, pResponse);
+                break;
+            }
+        }
+        break;
+
+        default:
+        break;
+    }
+}
+
+
+//****************************************************************************
+// Called when a message is received on the master's own I2C address, to take
+// in a CMD_NOTIFY message pushed by a slave device. The message is held until
+// Poll() handles it; one that arrives before then is dropped.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandClient::OnNotifyReceived(Stream& stream, int messageLength)
+{
+    byte count = 0;
+
+    while (stream.available())
+    {
+        byte data = stream.read();
+
+        if (!_notifyPending && count < sizeof(_notifyBuffer)) _notifyBuffer[count++] = data;
+    }
+
+    if (_notifyPending || count < sizeof(CommandMessage)) return;
+
+    auto pNotify = (const CommandNotify*)_notifyBuffer;
+
+    if (pNotify->CommandCode != CMD_NOTIFY || pNotify->Length < pNotify->HeaderLength() || pNotify->Length + CRC_SIZE != count ||
+        pNotify->ReadyCount > pNotify->Length - pNotify->HeaderLength()) return;
+
+#if COMMANDBUS_CRC
+    if (CRC8(_notifyBuffer, count) != 0) return;
+#endif
+
+    _notifyPending = true;
+}
+
+
+//****************************************************************************
+// Handles a pushed notification: deferred requests the slave device reports
+// as ready are queried right away, then the notification handler is called.
+//****************************************************************************
+void CommandClient::ProcessNotify(unsigned long now)
+{
+    auto pNotify = (const CommandNotify*)_notifyBuffer;
+
+    for (byte i = 0; i < pNotify->ReadyCount; i++)
+    {
+        for (auto& request : _requests)
+        {
+            if (request.State == REQUEST_DEFERRED && request.SlaveAddress == pNotify->SourceAddress && 
+                request.ResponseID == pNotify->ReadyResponseIDs()[i]) request.DueTime = now;
+        }
+    }
+
+    if (_notifyHandler != NULL) _notifyHandler(*this, pNotify, _pNotifyContext);
+
+    _notifyPending = false;
+}
+
+
+#if COMMANDBUS_PIPELINE
+//****************************************************************************
+// Completes the pipelined requests whose responses were collected from a
+// slave device. Nothing is sent to the slave device while a collection is
+// outstanding, so once it reports that nothing is left in flight, a pipelined
+// request that wasn't collected was never accepted and is sent again.
+// Otherwise the rest are collected after the next query interval.
+//****************************************************************************
+void CommandClient::ProcessCollect(const Request& collector, const CommandResponseCollect* pCollect, unsigned long now)
+{
+    byte slaveAddress = collector.SlaveAddress;
+    byte inFlight = pCollect->InFlight;
+    byte available = pCollect->Length - pCollect->HeaderLength();
+    byte offset = 0;
+
+    for (byte i = 0; i < pCollect->Count && offset + sizeof(CommandResponse) <= available; i++)
+    {
+        auto pResponse = (const CommandResponse*)(pCollect->Responses + offset);
+
+        if (pResponse->Length < sizeof(CommandResponse) || pResponse->Length > available - offset) break;
+
+        for (auto& request : _requests)
+        {
+            if ((request.State == REQUEST_PIPELINED || request.State == REQUEST_COLLECTING) && request.SlaveAddress == slaveAddress &&
+                request.ResponseID == pResponse->ResponseID)
+            {
+                CompleteRequest(request, pResponse);
+                break;
+            }
+        }
+
+        offset += pResponse->Length;
+    }
+
+    for (auto& request : _requests)
+    {
+        if ((request.State != REQUEST_PIPELINED && request.State != REQUEST_COLLECTING) || request.SlaveAddress != slaveAddress) continue;
+
+        request.State   = (inFlight == 0) ? REQUEST_QUEUED : REQUEST_PIPELINED;
+        request.DueTime = (inFlight == 0) ? now : now + _queryInterval;
+    }
+}
+#endif
+
+
+#if COMMANDBUS_FLOW_CONTROL
+//****************************************************************************
+// Takes a credit for sending a command to a slave device (and a deferred
+// response credit too, for a pipelined command). When the credits run out
+// the slave device is queried for how much room it has now, but no more
+// often than once per response delay, to give it time to catch up.
+// Returns false if the slave device has no room for the command.
+//****************************************************************************
+bool CommandClient::TakeCredit(byte slaveAddress, bool deferred, unsigned long now)
+{
+    auto& credits = FindCredits(slaveAddress);
+
+    if (credits.Commands == 0 || (deferred && credits.Deferred == 0))
+    {
+        if (credits.Known && now - credits.QueryTime < _responseDelay) return false;
+
+        if (!QueryStatus(credits, now)) return false;
+
+        if (credits.Commands == 0 || (deferred && credits.Deferred == 0)) return false;
+    }
+
+    credits.Commands--;
+
+    if (deferred) credits.Deferred--;
+
+    return true;
+}
+
+
+//****************************************************************************
+// Returns the credits of a slave device. A slave device that isn't in the
+// list takes the place of the one queried longest ago, with no credits.
+//****************************************************************************
+CommandClient::SlaveCredits& CommandClient::FindCredits(byte slaveAddress)
+{
+    SlaveCredits* pOldest = &_credits[0];
+
+    for (auto& credits : _credits)
+    {
+        if (credits.Known && credits.SlaveAddress == slaveAddress) return credits;
+
+        if (!credits.Known || (pOldest->Known && (long)(credits.QueryTime - pOldest->QueryTime) < 0)) pOldest = &credits;
+    }
+
+    *pOldest = SlaveCredits();
+    pOldest->SlaveAddress = slaveAddress;
+
+    return *pOldest;
+}
+
+
+//****************************************************************************
+// Refreshes the credits of a slave device with CMD_QUERY_STATUS, which the
+// slave device answers at once, so its response is read straight away.
+// Returns false if the slave device couldn't be queried.
+//****************************************************************************
+bool CommandClient::QueryStatus(SlaveCredits& credits, unsigned long now)
+{
+    auto query = CommandMessage(CMD_QUERY_STATUS);
+
+    credits.Known     = true;
+    credits.QueryTime = now;
+    credits.Commands  = 0;
+    credits.Deferred  = 0;
+
+    if (!WriteCommand(credits.SlaveAddress, &query)) return false;
+
+    auto pResponse = (const CommandResponseStatus*)ReadResponse(credits.SlaveAddress);
+
+    if (pResponse == NULL || pResponse->ResponseCode != CMD_RESPONSE_OK || pResponse->Length < sizeof(CommandResponseStatus)) return false;
+
+    credits.Commands = pResponse->FreeCommandSlots;
+    credits.Deferred = pResponse->FreeDeferredSlots;
+
+    return true;
+}
+
+
+//****************************************************************************
+// Forgets the credits of a slave device, so it is queried again before the
+// next command is sent to it
+//****************************************************************************
+void CommandClient::DropCredits(byte slaveAddress)
+{
+    for (auto& credits : _credits)
+    {
+        if (credits.Known && credits.SlaveAddress == slaveAddress) credits.Commands = 0;
+    }
+}
+#endif
+
+
+//****************************************************************************
+// Returns true if a request to the slave device is waiting for its response
+// to be read, in which case nothing else may be sent to the slave device.
+//****************************************************************************
+bool CommandClient::IsOnBus(byte slaveAddress) const
+{
+    for (auto& request : _requests)
+    {
+        if ((request.State == REQUEST_SENT || request.State == REQUEST_QUERIED || request.State == REQUEST_COLLECTING) && 
+            request.SlaveAddress == slaveAddress) return true;
+    }
+
+    return false;
+}
+
+
+bool CommandClient::WriteCommand(byte slaveAddress, const CommandMessage* pCommand)
+{
+    _twi.beginTransmission(slaveAddress);
+    _twi.write((const byte*)pCommand, pCommand->Length);
+#if COMMANDBUS_CRC
+    _twi.write(CRC8((const byte*)pCommand, pCommand->Length));
+#endif
+
+    return _twi.endTransmission() == 0;
+}
+
+
+//****************************************************************************
+// Reads a response from a slave device. The first read gets TX_FIRST_WINDOW
+// bytes, which holds most responses, and the rest of a longer response is
+// read TX_WINDOW bytes at a time, matching the way 
+// CommandListener::SendResponse() sends it.
+// Returns NULL if the response could not be read, or a CMD_RESPONSE_CORRUPT
+// response (see IsCorruptedResponse()) if it failed its CRC check.
+//****************************************************************************
+const CommandResponse* CommandClient::ReadResponse(byte slaveAddress)
+{
+    byte window   = (TX_FIRST_WINDOW < sizeof(_responseBuffer)) ? TX_FIRST_WINDOW : sizeof(_responseBuffer);
+    byte received = 0;
+
+    if (_twi.requestFrom(slaveAddress, window) != window) return NULL;
+
+    while (received < window && _twi.available()) _responseBuffer[received++] = _twi.read();
+
+    // The frame is the response followed by its CRC byte (if enabled)
+    byte length = _responseBuffer[0];
+    byte frameLength = length + CRC_SIZE;
+
+    if (received < sizeof(CommandResponse) || length < sizeof(CommandResponse) || length > RESPONSE_SIZE) return NULL;
+
+    while (received < frameLength)
+    {
+        byte count = frameLength - received;
+
+        if (count > TX_WINDOW) count = TX_WINDOW;
+
+        if (_twi.requestFrom(slaveAddress, count) != count) return NULL;
+
+        while (received < frameLength && _twi.available()) _responseBuffer[received++] = _twi.read();
+    }
+
+#if COMMANDBUS_CRC
+    if (CRC8(_responseBuffer, frameLength) != 0) return &responseCorrupt;
+#endif
+
+    return (const CommandResponse*)_responseBuffer;
+}
+
+
+//****************************************************************************
+// Returns true if a response returned by ReadResponse() failed its CRC check
+// on the way from the slave device (rather than being a CMD_RESPONSE_CORRUPT
+// response from the slave device)
+//****************************************************************************
+bool CommandClient::IsCorruptedResponse(const CommandResponse* pResponse)
+{
+#if COMMANDBUS_CRC
+    return pResponse == &responseCorrupt;
+#else
+    return false;
+#endif
+}
+
+
+//****************************************************************************
+// Frees the request and passes its final response to the request's handler.
+// The request is freed first so the handler can queue a new request.
+//****************************************************************************
+void CommandClient::CompleteRequest(Request& request, const CommandResponse* pResponse)
+{
+    auto handler  = request.Handler;
+    auto pContext = request.pContext;
+    auto slaveAddress = request.SlaveAddress;
+
+    request.State = REQUEST_FREE;
+
+    if (handler != NULL) handler(*this, slaveAddress, pResponse, pContext);
+}
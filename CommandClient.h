@@ -0,0 +1,218 @@
+/*******************************************************************************
+ Header file for the CommandClient class.
+*******************************************************************************/
+#ifndef _CommandClient_h_
+#define _CommandClient_h_
+
+#include <Wire.h>
+#include <RTL_StdLib.h>
+#include <RTL_TaskScheduler.h>
+#include "CommandProtocol.h"
+#include "CommandBusConfig.h"
+#include "CommandCRC.h"
+
+
+class CommandClient;
+
+
+//****************************************************************************
+/// Called when a request completes. pResponse is the final response from the
+/// slave device (never CMD_RESPONSE_DEFERRED or CMD_RESPONSE_NOTREADY; a
+/// request that times out or fails on the bus completes with a
+/// CMD_RESPONSE_ERROR response, and one whose response was corrupted on the
+/// way back completes with CMD_RESPONSE_CORRUPT, since the command was
+/// handled but its response is lost). The response is only valid for the
+/// duration of the call.
+//****************************************************************************
+typedef void (*CommandResponseHandler)(CommandClient& client, byte slaveAddress, const CommandResponse* pResponse, void* pContext);
+
+
+//****************************************************************************
+/// Called for each CMD_NOTIFY message pushed to the master by a slave device
+/// in push mode, after any deferred requests it reports as ready have been
+/// moved along. The notification is only valid for the duration of the call.
+//****************************************************************************
+typedef void (*CommandNotifyHandler)(CommandClient& client, const CommandNotify* pNotify, void* pContext);
+
+
+//****************************************************************************
+/// The master side of the command bus.
+///
+/// A CommandClient keeps several requests outstanding at once, to the same or
+/// to different slave devices, and moves each of them along from its Poll()
+/// method without ever blocking in a delay. A request is sent when its slave
+/// device is free, its response is read once the slave has had time to
+/// process it, and CMD_RESPONSE_DEFERRED responses are followed up with
+/// CMD_QUERY_RESPONSE automatically until the real response is ready. While a
+/// request to a slave is deferred, further requests can be sent to it.
+///
+/// The client is an EventSource, so it can be added to the task scheduler to
+/// have Poll() called on every pass of the main loop.
+///
+/// Slave devices in push mode write CMD_NOTIFY messages to the master's own
+/// address. Pass them to OnNotifyReceived() (from the Wire library's receive
+/// callback) and a deferred request is queried as soon as its slave reports
+/// it ready, so the query interval can be made long to cut polling traffic.
+///
+/// When pipelining is enabled (COMMANDBUS_PIPELINE), SendPipelinedCommand()
+/// sends commands tagged, without waiting to read each response, so several
+/// commands can be in flight to a slave device at once and complete in any
+/// order. Their responses are collected together with CMD_COLLECT.
+///
+/// With flow control (COMMANDBUS_FLOW_CONTROL), the client keeps a count of
+/// the free command slots (and, for pipelined commands, deferred response
+/// slots) on each slave device, taken from CMD_QUERY_STATUS, and holds a
+/// command back until there is room for it rather than have it bounced with
+/// CMD_RESPONSE_BUSY.
+//****************************************************************************
+class CommandClient : public EventSource
+{
+    DECLARE_CLASSNAME;
+
+    public: static const byte MAX_REQUESTS = COMMANDBUS_CLIENT_REQUESTS;
+
+    public: static const byte COMMAND_SIZE = COMMANDBUS_COMMAND_SIZE;
+
+    public: static const byte RESPONSE_SIZE = COMMANDBUS_MAX_RESPONSE_SIZE;
+
+    public: static const byte TX_WINDOW = COMMANDBUS_TX_WINDOW;
+
+    public: static const byte TX_FIRST_WINDOW = COMMANDBUS_TX_FIRST_WINDOW;
+
+    public: static const byte CRC_SIZE = COMMANDBUS_CRC_SIZE;
+
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: CommandClient(TwoWire& twi=Wire) :
+        _twi(twi),
+        _responseDelay(COMMANDBUS_CLIENT_RESPONSE_DELAY),
+        _queryInterval(COMMANDBUS_CLIENT_QUERY_INTERVAL),
+        _timeout(COMMANDBUS_CLIENT_TIMEOUT)
+    {
+    };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void Poll();
+
+    /// Queues a command for a slave device. If handler is NULL then no response
+    /// is expected and the request completes as soon as the command is sent.
+    /// Returns false if all request slots are in use or the command is too big.
+    public: bool SendCommand(byte slaveAddress, const CommandMessage* pCommand, CommandResponseHandler handler=NULL, void* pContext=NULL);
+
+    /// Broadcasts a command to all slave devices using the general call
+    /// address. No response is read (broadcast commands don't have one).
+    public: bool BroadcastCommand(const CommandMessage* pCommand) { return SendCommand(I2C_GENERAL_CALL_ADDRESS, pCommand); };
+
+#if COMMANDBUS_PIPELINE
+    /// Queues a command to be sent to a slave device as a pipelined (tagged)
+    /// command. A handler is required, since the response has to be collected.
+    /// Returns false if all request slots are in use or the command is too big.
+    public: bool SendPipelinedCommand(byte slaveAddress, const CommandMessage* pCommand, CommandResponseHandler handler, void* pContext=NULL);
+#endif
+
+    public: bool IsIdle() const;
+    public: bool IsBusy(byte slaveAddress) const;
+    public: byte PendingCount() const;
+
+    public: void SetResponseDelay(unsigned long microseconds) { _responseDelay = microseconds; };
+    public: void SetQueryInterval(unsigned long microseconds) { _queryInterval = microseconds; };
+    public: void SetTimeout(unsigned long microseconds) { _timeout = microseconds; };
+    public: void SetNotifyHandler(CommandNotifyHandler handler, void* pContext=NULL) { _notifyHandler = handler; _pNotifyContext = pContext; };
+    public: void OnNotifyReceived(Stream& stream, int messageLength);
+
+    /***************************************************************************
+    Internal implementation
+    ***************************************************************************/
+    private: enum RequestState : byte
+    {
+        REQUEST_FREE,           // Slot not in use
+        REQUEST_QUEUED,         // Waiting for the slave device to be free
+        REQUEST_SENT,           // Command sent, waiting to read the response
+        REQUEST_DEFERRED,       // Response deferred, waiting to query for it
+        REQUEST_QUERIED,        // CMD_QUERY_RESPONSE sent, waiting to read the response
+        REQUEST_PIPELINED,      // Tagged command sent, waiting to collect the response
+        REQUEST_COLLECTING      // CMD_COLLECT sent, waiting to read the collected responses
+    };
+
+    private: struct Request
+    {
+        RequestState State;
+        byte SlaveAddress;
+        byte ResponseID;                // ResponseID of a deferred response (or the tag of a pipelined command)
+        unsigned long DueTime;          // When the request can next be moved along (micros)
+        unsigned long StartTime;        // When the request was queued (micros)
+        CommandResponseHandler Handler;
+        void* pContext;
+        byte Command[COMMAND_SIZE];
+
+        Request() : State(REQUEST_FREE) { };
+    };
+
+    private: Request* QueueRequest(byte slaveAddress, const CommandMessage* pCommand, CommandResponseHandler handler, void* pContext);
+    private: void PollRequest(Request& request, unsigned long now);
+#if COMMANDBUS_PIPELINE
+    private: void ProcessCollect(const Request& collector, const CommandResponseCollect* pCollect, unsigned long now);
+#endif
+#if COMMANDBUS_FLOW_CONTROL
+    private: struct SlaveCredits
+    {
+        byte SlaveAddress;
+        bool Known;                     // True once the slave device has been queried
+        byte Commands;                  // Commands the slave device has room for
+        byte Deferred;                  // Deferred responses the slave device has room for
+        unsigned long QueryTime;        // When the slave device was last queried (micros)
+
+        SlaveCredits() : SlaveAddress(I2C_GENERAL_CALL_ADDRESS), Known(false), Commands(0), Deferred(0), QueryTime(0) { };
+    };
+
+    private: bool TakeCredit(byte slaveAddress, bool deferred, unsigned long now);
+    private: SlaveCredits& FindCredits(byte slaveAddress);
+    private: bool QueryStatus(SlaveCredits& credits, unsigned long now);
+    private: void DropCredits(byte slaveAddress);
+#endif
+    private: bool IsOnBus(byte slaveAddress) const;
+    private: bool WriteCommand(byte slaveAddress, const CommandMessage* pCommand);
+    private: const CommandResponse* ReadResponse(byte slaveAddress);
+    private: static bool IsCorruptedResponse(const CommandResponse* pResponse);
+    private: void CompleteRequest(Request& request, const CommandResponse* pResponse);
+    private: void ProcessNotify(unsigned long now);
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: TwoWire& _twi;
+
+    private: unsigned long _responseDelay;
+
+    private: unsigned long _queryInterval;
+
+    private: unsigned long _timeout;
+
+    private: Request _requests[MAX_REQUESTS];
+
+    private: byte _responseBuffer[RESPONSE_SIZE + CRC_SIZE];
+
+    // The last notification received, until Poll() handles it
+    private: byte _notifyBuffer[sizeof(CommandNotify) + CRC_SIZE];
+
+    private: volatile bool _notifyPending = false;
+
+    private: CommandNotifyHandler _notifyHandler = NULL;
+
+    private: void* _pNotifyContext = NULL;
+
+#if COMMANDBUS_PIPELINE
+    private: byte _lastTag = 0;         // The tag given to the last pipelined command
+#endif
+
+#if COMMANDBUS_FLOW_CONTROL
+    // The credits of the slave devices most recently sent commands
+    private: SlaveCredits _credits[MAX_REQUESTS];
+#endif
+};
+
+#endif
@@ -1,7 +1,7 @@
 /*******************************************************************************
  CommandListener.cpp
 
- Implementation file for the I2C command listener base class.
+ Implementation file for the command listener base class.
 *******************************************************************************/
 #define DEBUG 0
 
@@ -12,10 +12,58 @@
 
 DEFINE_CLASSNAME(CommandListener);
 
+
+// Canned responses that can be handed out directly from an interrupt handler
+static const CommandResponse responseNotReady = CommandResponse(CMD_RESPONSE_NOTREADY);
+static const CommandResponse responseBusy     = CommandResponse(CMD_RESPONSE_BUSY);
+static const CommandResponse responseError    = CommandResponse(CMD_RESPONSE_ERROR);
+#if COMMANDBUS_CRC
+static const CommandResponse responseCorrupt  = CommandResponse(CMD_RESPONSE_CORRUPT);
+#endif
+
+
+// Dispatch table for the built-in commands (must be sorted by command code)
+const CommandHandlerEntry CommandListener::_builtinCommandTable[] PROGMEM =
+{
+    { CMD_QUERY_ID,        &CommandListener::HandleQueryID,        0                   },
+    { CMD_RESET_DEVICE,    &CommandListener::HandleResetDevice,    0                   },
+    { CMD_ECHO,            &CommandListener::HandleEcho,           COMMAND_FLAG_INLINE },
+    { CMD_BATCH,           &CommandListener::HandleBatch,          0                   },
+#if COMMANDBUS_STATS
+    { CMD_QUERY_STATS,     &CommandListener::HandleQueryStats,     0                   },
+#endif
+#if COMMANDBUS_PIPELINE
+    { CMD_TAGGED,          &CommandListener::HandleTagged,         0                   },
+    { CMD_COLLECT,         &CommandListener::HandleCollect,        0                   },
+#endif
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+    { CMD_QUERY_HISTOGRAM, &CommandListener::HandleQueryHistogram, 0                   },
+    { CMD_RESET_HISTOGRAM, &CommandListener::HandleResetHistogram, 0                   },
+#endif
+#if COMMANDBUS_TRACE_SIZE > 0
+    { CMD_QUERY_TRACE,     &CommandListener::HandleQueryTrace,     0                   },
+#endif
+};
+
+
 void CommandListener::Begin()
 {
-    CommandPending  = false;
-    ResponsePending = false;
+    _commandQueue.Clear();
+    _priorityQueue.Clear();
+    _readySlot   = NO_RESPONSE_SLOT;
+    _sendingSlot = NO_RESPONSE_SLOT;
+    WithdrawPooledResponse();
+
+    // The device ID never changes, so the built-in CMD_QUERY_ID is answered
+    // from the cache (the cache is checked ahead of the dispatch tables, so
+    // not if the subclass handles CMD_QUERY_ID itself)
+    if (FindCommandEntry(_pCommandTable, _commandTableSize, CMD_QUERY_ID) == NULL)
+    {
+        auto responseQueryID = CommandResponseQueryID(_myDeviceID);
+
+        CacheResponse(CMD_QUERY_ID, &responseQueryID);
+    }
+
     OnBegin();
 }
 
@@ -25,18 +73,188 @@ void CommandListener::Begin()
 //****************************************************************************
 void CommandListener::Poll()
 {
-    TRACE(Logger(_classname_, __func__, this) << endl);
+#if COMMANDBUS_PUSH
+    ProcessPush();
+#endif
 
-    if (CommandPending)
+    if (_eventDriven)
     {
-        OnCommand((const CommandMessage*)CommandBuffer);
-        CommandPending = false;
+        if (!_wakePending) return;
+
+        // Cleared before the commands are handled, so a command that arrives
+        // meanwhile sets it again
+        _wakePending = false;
     }
+
+    TRACE(Logger(_classname_, __func__, this) << endl);
+
+    // Commands left over when the budget runs out need another Poll()
+    if (ProcessCommands()) _wakePending = true;
     
     EventSource::Poll();
 }
 
 
+//****************************************************************************
+// Switches the listener to (or from) event driven mode. In event driven mode,
+// Poll() returns at once without doing any work unless a command has been
+// queued since it last ran, and the receive interrupt handler calls the wake
+// handler (if any) each time it queues a command. This lets the application
+// sleep until a command arrives, e.g.:
+//
+//     noInterrupts();
+//     if (!listener.IsWakePending()) { sleep_enable(); interrupts(); sleep_cpu(); sleep_disable(); }
+//     interrupts();
+//
+// NOTE: The wake handler is called from an interrupt handler, so it should 
+//       do as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::SetEventDriven(bool eventDriven, CommandWakeHandler wakeHandler)
+{
+    _wakeHandler = wakeHandler;
+    _wakePending = IsCommandPending();
+    _eventDriven = eventDriven;
+}
+
+
+//****************************************************************************
+// Handles queued commands, within the work budget set by SetPollBudget().
+// At least one command is handled on each call (if any are queued), so the
+// queue always drains.
+// Returns true if commands are still queued, so the caller (or scheduler) 
+// knows to come back sooner.
+//****************************************************************************
+bool CommandListener::ProcessCommands()
+{
+    unsigned long startTime = (_pollMaxMicros > 0) ? COMMANDBUS_MICROS() : 0;
+    byte handled = 0;
+
+    for (;;)
+    {
+        // The high priority lane is checked before every command, so a high
+        // priority command that arrives mid-burst is handled next
+        bool priority = !_priorityQueue.IsEmpty();
+        const byte* pCommand = priority ? _priorityQueue.Front() : _commandQueue.Front();
+
+        if (pCommand == NULL) break;
+
+        COMMANDBUS_STAT(_dispatchReceiveTime = priority ? _receiveTimes[COMMAND_QUEUE_SIZE + _priorityQueue.IndexOf(pCommand)] : _receiveTimes[_commandQueue.IndexOf(pCommand)]);
+        COMMANDBUS_STAT(_dispatching = true);
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+        unsigned long handlerStartTime = COMMANDBUS_MICROS();
+#endif
+        DispatchCommand((const CommandMessage*)pCommand);
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+        RecordHandlerTime(((const CommandMessage*)pCommand)->CommandCode, COMMANDBUS_MICROS() - handlerStartTime);
+#endif
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_HANDLED, ((const CommandMessage*)pCommand)->CommandCode, ((const CommandMessage*)pCommand)->Length));
+        COMMANDBUS_STAT(_dispatching = false);
+
+        if (priority)
+            _priorityQueue.Pop();
+        else
+            _commandQueue.Pop();
+
+        handled++;
+
+        if (_pollMaxCommands > 0 && handled >= _pollMaxCommands) break;
+        if (_pollMaxMicros > 0 && COMMANDBUS_MICROS() - startTime >= _pollMaxMicros) break;
+    }
+
+    return IsCommandPending();
+}
+
+
+#if COMMANDBUS_PUSH
+//****************************************************************************
+// Enables push mode. Once the master's address is known (from a 
+// CMD_MASTER_ADDR command), Poll() writes a CMD_NOTIFY message to it as a
+// bus master whenever a deferred response becomes ready or the telemetry
+// changes (or, if onChangeOnly is false, with the telemetry every interval),
+// but no more often than once per interval (in microseconds). The master
+// then only needs to query for responses it has been told are ready.
+// sourceAddress is this device's own I2C address, which identifies it in the
+// notifications. The master must be listening on its own address as a slave.
+//****************************************************************************
+void CommandListener::EnablePush(TwoWire& twi, byte sourceAddress, unsigned long interval, bool onChangeOnly)
+{
+    _pushSourceAddress = sourceAddress;
+    _pushInterval      = interval;
+    _pushOnChangeOnly  = onChangeOnly;
+    _pPushTwi          = &twi;
+}
+
+
+//****************************************************************************
+// Sets the telemetry data to push to the master with the next notification.
+// In on change mode the data is only pushed if it differs from the last data
+// posted.
+//****************************************************************************
+void CommandListener::PostTelemetry(const void* pData, byte length)
+{
+    if (length > TELEMETRY_SIZE) length = TELEMETRY_SIZE;
+
+    if (length == _telemetryLength && memcmp(_telemetry, pData, length) == 0) return;
+
+    memcpy(_telemetry, pData, length);
+    _telemetryLength  = length;
+    _telemetryChanged = true;
+}
+
+
+//****************************************************************************
+// Pushes a notification to the master if anything has changed since the last
+// one and the push interval has passed. Everything that changed is coalesced
+// into the one notification.
+//****************************************************************************
+void CommandListener::ProcessPush()
+{
+    if (!IsPushActive()) return;
+
+    auto now = COMMANDBUS_MICROS();
+
+    if (now - _lastPushTime < _pushInterval) return;
+
+    auto notify = CommandNotify(_pushSourceAddress);
+
+    for (auto& responseItem : _deferredResponseList)
+    {
+#if COMMANDBUS_PIPELINE
+        // Pipelined commands are collected with CMD_COLLECT instead
+        if (responseItem.Tag != 0) continue;
+#endif
+
+        if (responseItem.State == ITEM_READY && !responseItem.Notified && !notify.AddReady(responseItem.ResponseID)) break;
+    }
+
+    bool pushTelemetry = _telemetryLength > 0 && (_telemetryChanged || !_pushOnChangeOnly) &&
+                         notify.SetTelemetry(_telemetry, _telemetryLength);
+
+    if (notify.ReadyCount == 0 && !pushTelemetry) return;
+
+    _lastPushTime = now;
+
+    _pPushTwi->beginTransmission(_masterAddress);
+    _pPushTwi->write((const byte*)&notify, notify.Length);
+#if COMMANDBUS_CRC
+    _pPushTwi->write(CRC8((const byte*)&notify, notify.Length));
+#endif
+
+    // If the master didn't take the notification it is sent again next time
+    if (_pPushTwi->endTransmission() != 0) return;
+
+    for (byte i = 0; i < notify.ReadyCount; i++)
+    {
+        auto& responseItem = _deferredResponseList[notify.Data[i] & DEFERRED_INDEX_MASK];
+
+        if (responseItem.ResponseID == notify.Data[i]) responseItem.Notified = true;
+    }
+
+    if (pushTelemetry) _telemetryChanged = false;
+}
+#endif
+
+
 //****************************************************************************
 // IEventListener interface
 //****************************************************************************
@@ -44,9 +262,9 @@ void CommandListener::OnEvent(const Event* pEvent)
 {
     switch(pEvent->EventID) 
     {
-        // case ResponseEvent:
-            // PostDeferredResponse((CommandResponse*)pEvent->Data.Pointer);
-        // break;
+        case ResponseEvent:
+            PostDeferredResponse((CommandResponse*)pEvent->Data.Pointer);
+        break;
 
         default:
         break;
@@ -54,195 +272,1766 @@ void CommandListener::OnEvent(const Event* pEvent)
 }
 
 
+//****************************************************************************
+// Dispatches a command to its handler in the subclass's dispatch table, or
+// else to the OnCommand() method. The built-in commands are handled by the
+// default OnCommand(), so a subclass that overrides OnCommand() still sees
+// them first, as it did before there were dispatch tables.
+//****************************************************************************
+void CommandListener::DispatchCommand(const CommandMessage* pCommand)
+{
+    TRACE(Logger(_classname_, __func__, this) << ToHex((byte*)pCommand, pCommand->Length) << endl);
+
+    auto handler = FindCommandHandler(_pCommandTable, _commandTableSize, pCommand->CommandCode);
+
+    if (handler != NULL)
+        handler(*this, pCommand);
+    else
+        OnCommand(pCommand);
+}
+
+
+//****************************************************************************
+// Binary searches a (sorted) PROGMEM dispatch table for a command's handler.
+// Returns NULL if the command is not in the table.
+//****************************************************************************
+CommandHandler CommandListener::FindCommandHandler(const CommandHandlerEntry* pTable, byte tableSize, byte commandCode)
+{
+    auto pEntry = FindCommandEntry(pTable, tableSize, commandCode);
+
+    return (pEntry != NULL) ? (CommandHandler)pgm_read_ptr(&pEntry->Handler) : NULL;
+}
+
+
+//****************************************************************************
+// Binary searches a (sorted) PROGMEM dispatch table for a command's entry.
+// Returns NULL if the command is not in the table.
+//****************************************************************************
+const CommandHandlerEntry* CommandListener::FindCommandEntry(const CommandHandlerEntry* pTable, byte tableSize, byte commandCode)
+{
+    int low  = 0;
+    int high = tableSize;
+
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        byte code = pgm_read_byte(&pTable[mid].CommandCode);
+
+        if (code == commandCode) return &pTable[mid];
+
+        if (code < commandCode)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return NULL;
+}
+
+
+//****************************************************************************
+// Returns the handler for a command if it is marked inline-safe, or NULL if
+// the command should be queued for Poll(). The tables are searched in the
+// same order as DispatchCommand(), so an entry in the subclass's table that
+// isn't inline-safe overrides an inline-safe built-in entry.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+CommandHandler CommandListener::FindInlineHandler(byte commandCode) const
+{
+#if COMMANDBUS_INLINE_HANDLERS
+    auto pEntry = FindCommandEntry(_pCommandTable, _commandTableSize, commandCode);
+
+    if (pEntry == NULL) pEntry = FindCommandEntry(_builtinCommandTable, COMMAND_TABLE_SIZE(_builtinCommandTable), commandCode);
+
+    if (pEntry != NULL && (pgm_read_byte(&pEntry->Flags) & COMMAND_FLAG_INLINE) != 0) return (CommandHandler)pgm_read_ptr(&pEntry->Handler);
+#endif
+
+    return NULL;
+}
+
+
+//****************************************************************************
+// Runs an inline-safe command's handler from the receive interrupt handler.
+// Its response is built in the inline response buffer and sent as the
+// immediate response, so the master can read it in the same transaction.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::DispatchInlineCommand(CommandHandler handler, const CommandMessage* pCommand)
+{
+#if COMMANDBUS_INLINE_HANDLERS
+    _inlineDispatching = true;
+    handler(*this, pCommand);
+    _inlineDispatching = false;
+#endif
+}
+
+
+//****************************************************************************
+// Called for commands that are not in the subclass's dispatch table. 
+// Subclasses that don't use a dispatch table can override this to handle 
+// their commands, and pass the rest on to DefaultCommandHandler() for the 
+// built-in commands.
+//****************************************************************************
 void CommandListener::OnCommand(const CommandMessage* pCommand)
 {
     DefaultCommandHandler(pCommand);
 }
 
 
+//****************************************************************************
+// Handles the built-in commands, and responds to any other command with
+// CMD_RESPONSE_UNKNOWN.
+//****************************************************************************
 void CommandListener::DefaultCommandHandler(const CommandMessage* pCommand)
 {
-    switch(pCommand->CommandCode)
+    auto handler = FindCommandHandler(_builtinCommandTable, COMMAND_TABLE_SIZE(_builtinCommandTable), pCommand->CommandCode);
+
+    if (handler != NULL)
     {
-        case CMD_QUERY_ID:
-        {
-            auto response = CommandResponseQueryID(_myDeviceID); 
-            
-            PostResponse(&response);
-        }
-        break;
+        handler(*this, pCommand);
+        return;
+    }
+
+    BeginResponse<CommandResponse>(CMD_RESPONSE_UNKNOWN);
+    CommitResponse();
+}
+
+
+void CommandListener::HandleQueryID(CommandListener& listener, const CommandMessage* pCommand)
+{
+    listener.BeginResponse<CommandResponseQueryID>(listener._myDeviceID); 
+    listener.CommitResponse();
+}
+
+
+void CommandListener::HandleEcho(CommandListener& listener, const CommandMessage* pCommand)
+{
+    auto& command = *(const CommandEcho*)pCommand;
+
+    // Only the bytes actually sent are echoed (the data may not be terminated)
+    byte length = (command.Length > command.HeaderLength()) ? command.Length - command.HeaderLength() : 0;
+
+    listener.BeginResponse<CommandResponseEcho>(command.EchoData, length);
+    listener.CommitResponse();
+}
+
 
-        // case CMD_QUERY_RESPONSE:
-        // {
-            // HandleQueryResponseReady((CommandQueryResponseReady&)*pCommand);
-        // }
-        // break;
+//****************************************************************************
+// Handles a CMD_RESET_DEVICE command by discarding any pending and deferred
+// responses, then calling OnResetDevice() for the subclass to reset itself.
+// This command is usually broadcast to all slave devices, so there is no 
+// response.
+//****************************************************************************
+void CommandListener::HandleResetDevice(CommandListener& listener, const CommandMessage* pCommand)
+{
+    listener._readySlot = NO_RESPONSE_SLOT;
+    listener.WithdrawPooledResponse();
+
+    // The receive interrupt handler can hand a slot's response to the master
+    // at any moment, so each slot is checked and freed with interrupts disabled
+    for (byte i = 0; i < DEFERRED_RESPONSE_LIST_SIZE; i++)
+    {
+        COMMANDBUS_ATOMIC_BEGIN
+        if (i != listener._sendingDeferredIndex && i != listener._immediateDeferredIndex) listener.FreeDeferredResponse(i);
+        COMMANDBUS_ATOMIC_END
     }
+
+    listener.OnResetDevice();
 }
 
 
-// //****************************************************************************
-// // Called when a command request is received on the I2C interface
-// // NOTE: This method is called from an interrupt handler, so it should do
-// //       as little as possible and get out as quickly as possible.
-// //****************************************************************************
-// void CommandListener::OnCommandReceived(const CommandMessage* pCommand)
-// {
-    // // If there is already a command pending then send the BUSY response for 
-    // // this command (if the command expects a response).
-    // // TODO: consider changing to queue the incoming commands
-    // if (CommandPending)
-    // {
-        // auto responseBusy = CommandResponse(CMD_RESPONSE_BUSY);
+#if COMMANDBUS_STATS
+//****************************************************************************
+// Handles a CMD_QUERY_STATS command by reporting the listener's statistics.
+// The counters are updated by the interrupt handlers, so they are copied
+// with interrupts disabled to take a consistent snapshot.
+//****************************************************************************
+void CommandListener::HandleQueryStats(CommandListener& listener, const CommandMessage* pCommand)
+{
+    Statistics stats;
+
+    COMMANDBUS_ATOMIC_BEGIN
+    stats = listener._stats;
+    COMMANDBUS_ATOMIC_END
+
+    auto pResponse = listener.BeginResponse<CommandResponseStats>();
 
-        // if (IsResponseExpected(pCommand)) PostResponse(&responseBusy);
-        // return;
-    // }
-    
-    // CommandPending = true;
-    // memcpy(CommandBuffer, (byte*)pCommand, pCommand->Length);
-// }
+    pResponse->CommandsReceived = stats.CommandsReceived;
+    pResponse->CommandsDropped  = stats.CommandsDropped;
+    pResponse->BusyResponses    = stats.BusyResponses;
+    pResponse->MaxLatency       = stats.MaxLatency;
+    pResponse->AverageLatency   = (stats.LatencyCount > 0) ? stats.LatencyTotal / stats.LatencyCount : 0;
+    pResponse->MaxIsrTime       = stats.MaxIsrTime;
+    pResponse->PeakQueueDepth   = stats.PeakQueueDepth;
+
+    listener.CommitResponse();
+}
+
+
+void CommandListener::Statistics::RecordLatency(uint32_t latency)
+{
+    if (latency > MaxLatency) MaxLatency = latency;
+
+    // Halve the running totals rather than let them overflow, which keeps
+    // the average meaningful over long uptimes
+    if (LatencyCount == 0xFFFF || LatencyTotal > 0xFFFFFFFFUL - latency)
+    {
+        LatencyTotal /= 2;
+        LatencyCount /= 2;
+    }
+
+    LatencyTotal += latency;
+    LatencyCount++;
+}
+
+
+CommandListener::IsrTimer::~IsrTimer()
+{
+    unsigned long elapsed = COMMANDBUS_MICROS() - StartTime;
+
+    if (elapsed > Stats.MaxIsrTime) Stats.MaxIsrTime = (elapsed > 0xFFFF) ? 0xFFFF : elapsed;
+}
+#endif
+
+
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+//****************************************************************************
+// Counts the time a command's handler took to run (in microseconds) in the
+// log2 bucket of its command code's histogram. A command code is given a
+// histogram the first time it is handled, while there are any left. For a
+// deferred command this is only the time to defer it.
+//****************************************************************************
+void CommandListener::RecordHandlerTime(byte commandCode, unsigned long elapsed)
+{
+    byte index = 0;
 
+    while (index < _histogramCount && _histograms[index].CommandCode != commandCode) index++;
 
-// //****************************************************************************
-// // Called when a command request is received on the I2C interface
-// // NOTE: This method is called from an interrupt handler, so it should do
-// //       as little as possible and get out as quickly as possible.
-// //****************************************************************************
-// void CommandListener::OnCommandReceived(TwoWire& twi, int messageLength)
-// {
-    // // If there is already a command pending then flush the incoming message 
-    // // TODO: consider changing to queue the incoming commands
-    // if (CommandPending)
-    // {
-        // // flush I2C receive buffer
-        // while (twi.available()) twi.read();
+    if (index >= _histogramCount)
+    {
+        if (_histogramCount >= HISTOGRAM_CODE_COUNT) return;
+
+        _histogramCount++;
+        _histograms[index].CommandCode = commandCode;
+        memset(_histograms[index].Counts, 0, sizeof(_histograms[index].Counts));
+    }
+
+    byte bucket = 0;
 
-        // return;
-    // }
+    while (elapsed > 1 && bucket < HISTOGRAM_BUCKET_COUNT - 1)
+    {
+        elapsed >>= 1;
+        bucket++;
+    }
 
-    // CommandPending = true;
+    auto& count = _histograms[index].Counts[bucket];
 
-    // if (I2C_Read(twi, (byte*)CommandBuffer, messageLength) == 0) CommandPending = false;
-// }
+    if (count < 0xFFFF) count++;
+}
 
 
 //****************************************************************************
-// Send an I2C response
-// NIOTE: This method is called from an interrupt handler so keep it short and simple!
+// Handles a CMD_QUERY_HISTOGRAM command by sending one page of the handler
+// latency histograms. Each command code's histogram is split over
+// HISTOGRAM_PAGES_PER_CODE pages, in the order the command codes were first
+// handled.
 //****************************************************************************
-void CommandListener::SendResponse(TwoWire& twi)
+void CommandListener::HandleQueryHistogram(CommandListener& listener, const CommandMessage* pCommand)
 {
-    volatile auto response = CommandResponse(CMD_RESPONSE_UNKNOWN);
+    byte page = (pCommand->Length >= sizeof(CommandQueryHistogram)) ? ((const CommandQueryHistogram*)pCommand)->Page : 0;
+    auto pResponse = listener.BeginResponse<CommandResponseHistogram>(page, listener._histogramCount * HISTOGRAM_PAGES_PER_CODE);
+
+    if (page < pResponse->PageCount)
+    {
+        auto& histogram = listener._histograms[page / HISTOGRAM_PAGES_PER_CODE];
+        byte bucket = (page % HISTOGRAM_PAGES_PER_CODE) * HISTOGRAM_PAGE_SIZE;
+
+        pResponse->CommandCode = histogram.CommandCode;
+        pResponse->FirstBucket = bucket;
+
+        while (bucket < HISTOGRAM_BUCKET_COUNT && pResponse->Add(histogram.Counts[bucket])) bucket++;
+    }
 
-    twi.write((byte*)&response, sizeof(response));
+    listener.CommitResponse();
 }
 
 
 //****************************************************************************
-// Called when a response is requested on the I2C interface
+// Handles a CMD_RESET_HISTOGRAM command by clearing the handler latency
+// histograms, so the command codes are given histograms afresh
+//****************************************************************************
+void CommandListener::HandleResetHistogram(CommandListener& listener, const CommandMessage* pCommand)
+{
+    listener._histogramCount = 0;
+
+    listener.BeginResponse<CommandResponse>(CMD_RESPONSE_OK);
+    listener.CommitResponse();
+}
+#endif
+
+
+#if COMMANDBUS_TRACE_SIZE > 0
+//****************************************************************************
+// Records a frame in the trace ring, overwriting the oldest record once the
+// ring is full
 // NOTE: This method is called from an interrupt handler, so it should do
 //       as little as possible and get out as quickly as possible.
 //****************************************************************************
-const CommandResponse* CommandListener::GetResponse()
+void CommandListener::RecordTrace(byte event, byte code, byte length)
+{
+    unsigned long now = COMMANDBUS_MICROS();
+
+    COMMANDBUS_ATOMIC_BEGIN
+    auto& record = _trace[_traceHead & TRACE_MASK];
+
+    record.Time   = now;
+    record.Event  = event;
+    record.Code   = code;
+    record.Length = length;
+
+    if ((_traceHead & TRACE_MASK) == TRACE_MASK) _traceWrapped = true;
+
+    _traceHead++;
+    COMMANDBUS_ATOMIC_END
+}
+
+
+//****************************************************************************
+// Handles a CMD_QUERY_TRACE command by sending the trace records from the
+// requested sequence number on (or from the oldest record still held, if
+// that one has been overwritten). Each record is copied with interrupts
+// disabled, so it can't be overwritten part of the way through.
+//****************************************************************************
+void CommandListener::HandleQueryTrace(CommandListener& listener, const CommandMessage* pCommand)
 {
-    static auto responseNotReady = CommandResponse(CMD_RESPONSE_NOTREADY);
-    auto pResponse = (CommandResponse*)&responseNotReady;   
+    uint16_t sequence = (pCommand->Length >= sizeof(CommandQueryTrace)) ? ((const CommandQueryTrace*)pCommand)->Sequence.Get() : 0;
+    uint16_t head;
+    uint16_t held;
+
+    COMMANDBUS_ATOMIC_BEGIN
+    head = listener._traceHead;
+    held = listener._traceWrapped ? TRACE_SIZE : head;
+    COMMANDBUS_ATOMIC_END
 
-    if (ResponsePending) 
-    { 
-        ResponsePending = false;
-        pResponse = (CommandResponse*)ResponseBuffer;
+    if ((uint16_t)(head - sequence) > held) sequence = head - held;
+
+    auto pResponse = listener.BeginResponse<CommandResponseTrace>(sequence, head);
+
+    for (; sequence != head; sequence++)
+    {
+        TraceRecord record;
+
+        COMMANDBUS_ATOMIC_BEGIN
+        record = listener._trace[sequence & TRACE_MASK];
+        COMMANDBUS_ATOMIC_END
+
+        if (!pResponse->Add(record.Time, record.Event, record.Code, record.Length)) break;
     }
-    
-    return pResponse;
+
+    listener.CommitResponse();
 }
+#endif
 
 
-// void CommandListener::HandleCommand(const CommandMessage* pCommand)
-// {
-    // TRACE(Logger(_classname_, __func__, this) << ToHex((byte*)pCommand, pCommand->Length) << endl);
+//****************************************************************************
+// Handles a CMD_BATCH command by dispatching each of the batched commands in
+// turn, collecting their response codes into a single CommandResponseBatch.
+// The commands that the receive interrupt handler answers immediately never
+// reach a handler, so CMD_MASTER_ADDR is handled here, and the queries that 
+// are only useful for their response data are given CMD_RESPONSE_ERROR.
+//****************************************************************************
+void CommandListener::HandleBatch(CommandListener& listener, const CommandMessage* pCommand)
+{
+    auto response = CommandResponseBatch();
+    byte captureBuffer[RESPONSE_SIZE];
+    auto pCapturedResponse = (CommandResponse*)captureBuffer;
+    auto pBatch = (const byte*)pCommand;
+    byte offset = sizeof(CommandMessage);
 
-    // switch(pCommand->CommandCode)
-    // {
-        // case CMD_QUERY_ID:
-        // {
-            // auto response = CommandResponseQueryID(_myDeviceID); 
-            
-            // PostResponse(&response);
-        // }
-        // break;
+    while (offset < pCommand->Length)
+    {
+        auto pBatchedCommand = (const CommandMessage*)(pBatch + offset);
+        byte length = pBatchedCommand->Length;
 
-        // case CMD_QUERY_RESPONSE:
-        // {
-            // HandleQueryResponseReady((CommandQueryResponseReady&)*pCommand);
-        // }
-        // break;
-    
-        // default:
-            // OnCommand(pCommand);
-        // break;
-    // }
-// }
-
-
-// void CommandListener::HandleQueryResponseReady(const CommandQueryResponseReady& command)
-// {
-    // auto responseID = command.ResponseID;
-
-    // for (auto i = 0; i < DEFERRED_RESPONSE_LIST_SIZE; i++)
-    // {
-        // auto responseItem = _deferredResponseList[i];
-        
-        // if (responseItem.InUse)
-        // {
-            // auto pResponse = responseItem.pResponse;
-        
-            // if (pResponse->ResponseID == responseID)
-            // {
-                // PostResponse(pResponse);
-                // responseItem.InUse = false;
-                // break;
-            // }
-        // }
-    // }
-// }
+        // Batches can't be nested, and pipelined commands can't be batched
+        if (length < sizeof(CommandMessage) || length > pCommand->Length - offset || 
+            pBatchedCommand->CommandCode == CMD_BATCH || pBatchedCommand->CommandCode == CMD_TAGGED)
+        {
+            response.Add(CMD_RESPONSE_ERROR);
+            break;
+        }
 
+        pCapturedResponse->ResponseCode = CMD_RESPONSE_OK;
 
-void CommandListener::PostResponse(CommandResponse* pResponse)
+        switch (pBatchedCommand->CommandCode)
+        {
+            case CMD_MASTER_ADDR:
+                if (length >= sizeof(CommandMasterAddress))
+                    listener._masterAddress = ((const CommandMasterAddress*)pBatchedCommand)->MasterAddress;
+                else
+                    pCapturedResponse->ResponseCode = CMD_RESPONSE_ERROR;
+            break;
+
+            case CMD_QUERY_RESPONSE:
+#if COMMANDBUS_FLOW_CONTROL
+            case CMD_QUERY_STATUS:
+#endif
+                pCapturedResponse->ResponseCode = CMD_RESPONSE_ERROR;
+            break;
+
+            default:
+                listener._pCaptureBuffer = captureBuffer;
+                listener.DispatchCommand(pBatchedCommand);
+                listener._pCaptureBuffer = NULL;
+            break;
+        }
+
+        if (!response.Add(pCapturedResponse->ResponseCode)) break;
+
+        offset += length;
+    }
+
+    listener.PostResponse(&response);
+}
+
+
+#if COMMANDBUS_PIPELINE
+//****************************************************************************
+// Handles a CMD_TAGGED command by dispatching the command it carries with the
+// response captured into a deferred response slot, keyed by the master's tag,
+// until it is collected with CMD_COLLECT. If the handler defers its response
+// then the slot stays pending until the worker posts it. Nothing is posted for
+// the tagged command itself; if there is no free slot it is dropped, and the
+// master learns that from the CMD_COLLECT response.
+//****************************************************************************
+void CommandListener::HandleTagged(CommandListener& listener, const CommandMessage* pCommand)
 {
-    if (pResponse != NULL)
+    auto& command = *(const CommandTagged*)pCommand;
+    auto pTaggedCommand = command.GetCommand();
+    bool valid = command.Length >= command.HeaderLength() + sizeof(CommandMessage) && pTaggedCommand->Length >= sizeof(CommandMessage) &&
+                 pTaggedCommand->Length <= command.Length - command.HeaderLength();
+
+    if (command.Length < command.HeaderLength() || command.Tag == 0) return;
+
+    auto index = listener.AllocateDeferredResponse(valid ? pTaggedCommand->CommandCode : CMD_TAGGED);
+
+    if (index == NO_DEFERRED_INDEX)
+    {
+        // The interrupt handlers count drops too
+        COMMANDBUS_STAT(COMMANDBUS_ATOMIC_BEGIN listener._stats.CommandsDropped++; COMMANDBUS_ATOMIC_END);
+        return;
+    }
+
+    auto& responseItem = listener._deferredResponseList[index];
+
+    responseItem.Tag = command.Tag;
+
+    // Pipelined commands can't be nested, and the other commands that carry
+    // commands would steal the capture buffer
+    if (!valid || pTaggedCommand->CommandCode == CMD_TAGGED || pTaggedCommand->CommandCode == CMD_COLLECT || pTaggedCommand->CommandCode == CMD_BATCH)
+    {
+        listener.CompleteDeferredResponse(index, CMD_RESPONSE_ERROR);
+        return;
+    }
+
+    // A handler that posts no response completes with CMD_RESPONSE_OK
+    new (responseItem.Response) CommandResponse(CMD_RESPONSE_OK, responseItem.ResponseID);
+
+    listener._pCaptureBuffer = responseItem.Response;
+    listener._taggedIndex    = index;
+    listener._taggedDeferred = false;
+    listener.DispatchCommand(pTaggedCommand);
+    listener._pCaptureBuffer = NULL;
+    listener._taggedIndex    = NO_DEFERRED_INDEX;
+
+    if (!listener._taggedDeferred)
     {
-        noInterrupts();
-        memcpy(ResponseBuffer, (byte*)pResponse, pResponse->Length);
-        ResponsePending = true;
-        interrupts();
-        
-        // Serial << "PostResponse:";
-        // for (auto i = 0; i < pResponse->Length; i++)
-        //     Serial <<  " " << _HEX(ResponseBuffer[i]);
-        // Serial << endl;
+        COMMANDBUS_BARRIER();
+        responseItem.State = ITEM_READY;
     }
 }
 
 
-// void CommandListener::PostDeferredResponse(CommandResponse* pResponse)
-// {
-    // if (pResponse == NULL) return;
+//****************************************************************************
+// Handles a CMD_COLLECT command by moving as many of the ready responses to
+// pipelined commands as fit into a single CommandResponseCollect, and freeing
+// their slots. CMD_COLLECT is queued behind the commands sent ahead of it, so
+// by the time it is handled every one of them has either been given a slot or
+// dropped.
+//****************************************************************************
+void CommandListener::HandleCollect(CommandListener& listener, const CommandMessage* pCommand)
+{
+    auto pCollect = listener.BeginResponse<CommandResponseCollect>();
 
-    // for (auto i = 0; i < DEFERRED_RESPONSE_LIST_SIZE; i++)
-    // {
-        // auto responseItem = _deferredResponseList[i];
-        
-        // if (!responseItem.InUse)
-        // {
-            // noInterrupts();
-            // responseItem.InUse = true;
-            // responseItem.pResponse = pResponse;
-            // interrupts();
-            // break;
-        // }
-    // }
-// }
+    // The receive interrupt handler can hand a slot's response to the master
+    // (or free it) at any moment, so each slot is checked, collected and freed
+    // with interrupts disabled
+    for (byte i = 0; i < DEFERRED_RESPONSE_LIST_SIZE; i++)
+    {
+        auto& responseItem = listener._deferredResponseList[i];
 
+        COMMANDBUS_ATOMIC_BEGIN
+        if (responseItem.Tag != 0 && responseItem.State != ITEM_FREE)
+        {
+            bool collected = false;
 
+            if (responseItem.State == ITEM_READY && i != listener._sendingDeferredIndex && i != listener._immediateDeferredIndex)
+            {
+                auto pResponse = responseItem.GetResponse();
+
+                // A response that could never fit is replaced with an error
+                if (pResponse->Length > sizeof(pCollect->Responses)) pResponse = &responseError;
+
+                collected = pCollect->Add(pResponse, responseItem.Tag);
+
+                if (collected) listener.FreeDeferredResponse(i);
+            }
+
+            if (!collected) pCollect->InFlight++;
+        }
+        COMMANDBUS_ATOMIC_END
+    }
+
+    listener.CommitResponse();
+}
+#endif
+
+
+//****************************************************************************
+// Enables (or disables) reception of commands broadcast to the I2C general 
+// call address, such as CMD_RESET_DEVICE and CMD_MASTER_ADDR, so the master
+// can configure every slave device on the bus in a single transaction.
+// Call this after the Wire library has been started.
+// NOTE: The Wire library can only do this on AVR targets. On other targets
+//       general call must be enabled in the I2C peripheral directly.
+//****************************************************************************
+void CommandListener::EnableGeneralCall(bool enable)
+{
+#if defined(TWAR) && defined(TWGCE)
+    if (enable)
+        TWAR |= _BV(TWGCE);
+    else
+        TWAR &= ~_BV(TWGCE);
+#endif
+}
+
+
+//****************************************************************************
+// Called when a command request is received on the I2C interface
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::OnCommandReceived(const CommandMessage* pCommand)
+{
+    COMMANDBUS_STAT(IsrTimer timer(_stats));
+
+    // A new command means the master is done reading the previous response
+    ReleaseResponse();
+    DiscardImmediateResponse();
+
+    COMMANDBUS_STAT(_stats.CommandsReceived++);
+
+    if (pCommand->Length < sizeof(CommandMessage))
+    {
+        COMMANDBUS_STAT(_stats.CommandsDropped++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_DROPPED, CMD_NONE, pCommand->Length));
+        return;
+    }
+
+#if COMMANDBUS_CRC
+    // The command is followed by its CRC byte
+    if (CRC8((const byte*)pCommand, pCommand->Length + CRC_SIZE) != 0)
+    {
+        _pImmediateResponse = &responseCorrupt;
+        COMMANDBUS_STAT(_stats.CommandsDropped++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_CORRUPT, pCommand->CommandCode, pCommand->Length));
+        return;
+    }
+#endif
+
+    if (HandleImmediateCommand(pCommand))
+    {
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_IMMEDIATE, pCommand->CommandCode, pCommand->Length));
+        return;
+    }
+
+    auto inlineHandler = FindInlineHandler(pCommand->CommandCode);
+
+    if (inlineHandler != NULL && pCommand->Length <= COMMAND_SIZE)
+    {
+        DispatchInlineCommand(inlineHandler, pCommand);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_IMMEDIATE, pCommand->CommandCode, pCommand->Length));
+        return;
+    }
+
+    byte* pSlot = ReserveCommandSlot(pCommand->CommandCode);
+
+    if (pSlot == NULL || pCommand->Length > COMMAND_SIZE)
+    {
+        RejectCommand(pCommand);
+        return;
+    }
+
+    memcpy(pSlot, (byte*)pCommand, pCommand->Length);
+    QueueCommand(pCommand->CommandCode);
+    COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_QUEUED, pCommand->CommandCode, pCommand->Length));
+}
+
+
+//****************************************************************************
+// Called when a command request is received on a stream based transport 
+// (e.g., the I2C interface), with the whole message waiting to be read.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::OnCommandReceived(Stream& stream, int messageLength)
+{
+    COMMANDBUS_STAT(IsrTimer timer(_stats));
+
+    BeginCommandFrame();
+
+    while (stream.available()) ReceiveCommandByte(stream.read());
+
+    EndCommandFrame();
+}
+
+
+//****************************************************************************
+// Starts receiving a command frame. Transports that receive a byte at a time
+// call BeginCommandFrame(), then ReceiveCommandByte() for each byte of the
+// frame, then EndCommandFrame() once the frame is complete.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::BeginCommandFrame()
+{
+    // A new command means the master is done reading the previous response
+    ReleaseResponse();
+    DiscardImmediateResponse();
+
+    COMMANDBUS_STAT(_stats.CommandsReceived++);
+
+    memset(_rxHeader, 0, sizeof(_rxHeader));
+    _pRxSlot     = NULL;
+    _pRxBuffer   = _rxHeader;
+    _rxCapacity  = sizeof(_rxHeader);
+    _rxCount     = 0;
+#if COMMANDBUS_CRC
+    _rxCRC       = 0;
+#endif
+#if COMMANDBUS_INLINE_HANDLERS
+    _pRxInlineHandler = NULL;
+#endif
+}
+
+
+//****************************************************************************
+// Receives the next byte of a command frame.
+// The message header is read into a header buffer until the command code is
+// known, and the rest of the message then goes straight into a free slot 
+// in the command queue for the command's priority (or the inline command
+// buffer, for an inline-safe command). If that queue is full then just
+// enough of the message is kept to see if it can be answered immediately,
+// and the rest of it is discarded.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::ReceiveCommandByte(byte data)
+{
+    if (_rxCount < _rxCapacity) _pRxBuffer[_rxCount] = data;
+    if (_rxCount < 0xFF) _rxCount++;
+#if COMMANDBUS_CRC
+    _rxCRC = CRC8_Update(_rxCRC, data);
+#endif
+
+    if (_rxCount == sizeof(CommandMessage))
+    {
+#if COMMANDBUS_INLINE_HANDLERS
+        _pRxInlineHandler = FindInlineHandler(data);
+
+        _pRxSlot = (_pRxInlineHandler != NULL) ? _inlineCommand : ReserveCommandSlot(data);
+#else
+        _pRxSlot = ReserveCommandSlot(data);
+#endif
+
+        if (_pRxSlot != NULL)
+        {
+            memcpy(_pRxSlot, _rxHeader, _rxCount);
+            _pRxBuffer  = _pRxSlot;
+            _rxCapacity = COMMAND_SLOT_SIZE;
+        }
+    }
+}
+
+
+//****************************************************************************
+// Finishes receiving a command frame, and then handles, queues or rejects
+// the command.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::EndCommandFrame()
+{
+    // The command's Length says how much of the message is the command, and
+    // can't claim more bytes than were received
+    auto pCommand = (const CommandMessage*)_pRxBuffer;
+    byte count = _rxCount;
+
+    if (count < sizeof(CommandMessage) || pCommand->Length < sizeof(CommandMessage) || 
+        pCommand->Length + CRC_SIZE > count || (_pRxSlot != NULL && count > _rxCapacity))
+    {
+        COMMANDBUS_STAT(_stats.CommandsDropped++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_DROPPED, (count >= sizeof(CommandMessage)) ? pCommand->CommandCode : CMD_NONE, count));
+        return;
+    }
+
+#if COMMANDBUS_CRC
+    // A corrupted frame is rejected at once so the master can resend it
+    if (_rxCRC != 0 || pCommand->Length + CRC_SIZE != count)
+    {
+        _pImmediateResponse = &responseCorrupt;
+        COMMANDBUS_STAT(_stats.CommandsDropped++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_CORRUPT, pCommand->CommandCode, pCommand->Length));
+        return;
+    }
+#endif
+
+    if (HandleImmediateCommand(pCommand))
+    {
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_IMMEDIATE, pCommand->CommandCode, pCommand->Length));
+        return;
+    }
+
+#if COMMANDBUS_INLINE_HANDLERS
+    if (_pRxInlineHandler != NULL)
+    {
+        DispatchInlineCommand(_pRxInlineHandler, pCommand);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_IMMEDIATE, pCommand->CommandCode, pCommand->Length));
+        return;
+    }
+#endif
+
+    if (_pRxSlot == NULL)
+    {
+        RejectCommand(pCommand);
+        return;
+    }
+
+    QueueCommand(pCommand->CommandCode);
+    COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_QUEUED, pCommand->CommandCode, pCommand->Length));
+}
+
+
+#if COMMANDBUS_DMA
+//****************************************************************************
+// Frame level entry points, for transports whose peripheral receives and
+// sends whole frames by DMA, so the listener is only involved once per frame
+// rather than once per byte:
+//
+//     Receive:  Point the peripheral's receive DMA at the buffer returned by
+//               AcquireReceiveFrame(), and when the frame is complete (e.g.,
+//               on the STOP condition) call CommitReceiveFrame() with the
+//               number of bytes received. Then acquire the next buffer.
+//
+//     Transmit: When the master reads, point the transmit DMA at the frame
+//               returned by AcquireTransmitFrame(), and when it is done call
+//               ReleaseTransmitFrame(). As with SendResponse(), the first
+//               read of a response gets at most TX_FIRST_WINDOW bytes and
+//               each later read at most TX_WINDOW bytes, so a long response
+//               takes an acquire and release for each read.
+//
+// The frames are the same as on any other transport (the command or response
+// followed by its CRC byte, if enabled).
+//****************************************************************************
+
+//****************************************************************************
+// Returns the buffer the next command frame should be received into, and how
+// many bytes it can hold. This is a free slot in the command queue, so the
+// command is received in place. If the queue is full it is a slot in the
+// priority queue instead (moved to the other lane once the command code is
+// known), and if both are full it is a frame buffer of the same size, from
+// which the command is answered immediately, queued if a slot has come free
+// by the time it is committed, or else rejected.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+byte* CommandListener::AcquireReceiveFrame(byte& capacity)
+{
+    _pRxSlot = _commandQueue.Reserve();
+    _rxPriorityLane = false;
+
+    if (_pRxSlot == NULL)
+    {
+        _pRxSlot = _priorityQueue.Reserve();
+        _rxPriorityLane = true;
+    }
+
+    _pRxBuffer  = (_pRxSlot != NULL) ? _pRxSlot : _rxFrame;
+    _rxCapacity = COMMAND_SLOT_SIZE;
+#if COMMANDBUS_INLINE_HANDLERS
+    _pRxInlineHandler = NULL;
+#endif
+
+    capacity = _rxCapacity;
+
+    return _pRxBuffer;
+}
+
+
+//****************************************************************************
+// Called when a command frame of length bytes has been received into the
+// buffer returned by AcquireReceiveFrame(), to handle, queue or reject it. A
+// frame longer than the buffer (which the DMA cut short) is dropped.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::CommitReceiveFrame(byte length)
+{
+    COMMANDBUS_STAT(IsrTimer timer(_stats));
+
+    // A new command means the master is done reading the previous response
+    ReleaseResponse();
+    DiscardImmediateResponse();
+
+    COMMANDBUS_STAT(_stats.CommandsReceived++);
+
+    if (length > _rxCapacity)
+    {
+        COMMANDBUS_STAT(_stats.CommandsDropped++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_DROPPED, ((const CommandMessage*)_pRxBuffer)->CommandCode, length));
+        return;
+    }
+
+    _rxCount = length;
+#if COMMANDBUS_CRC
+    _rxCRC = CRC8(_pRxBuffer, length);
+#endif
+
+    if (length >= sizeof(CommandMessage))
+    {
+        byte commandCode = ((const CommandMessage*)_pRxBuffer)->CommandCode;
+
+#if COMMANDBUS_INLINE_HANDLERS
+        _pRxInlineHandler = FindInlineHandler(commandCode);
+#endif
+
+        // Move the command to the other lane if it was received into the 
+        // wrong one, or into a slot if it was received while both were full
+        if (_pRxSlot == NULL || IsPriorityCommand(commandCode) != _rxPriorityLane)
+        {
+            byte* pSlot = ReserveCommandSlot(commandCode);
+
+            if (pSlot != NULL)
+            {
+                memcpy(pSlot, _pRxBuffer, length);
+                _pRxBuffer = pSlot;
+            }
+
+            _pRxSlot = pSlot;
+        }
+    }
+
+    EndCommandFrame();
+}
+
+
+//****************************************************************************
+// Returns the next part of the pending response frame (or 
+// CMD_RESPONSE_NOTREADY if there isn't one) for the transmit DMA to send, and
+// its length in bytes. The frame stays valid until ReleaseTransmitFrame() is
+// called.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+const byte* CommandListener::AcquireTransmitFrame(byte& length)
+{
+    byte responseLength;
+
+    if (_pSendResponse == NULL)
+    {
+        _pSendResponse = (const byte*)GetResponse();
+        _sendCursor = 0;
+        responseLength = ((const CommandResponse*)_pSendResponse)->Length;
+
+#if COMMANDBUS_CRC
+        memcpy(_txFrame, _pSendResponse, responseLength);
+        _txFrame[responseLength] = CRC8(_pSendResponse, responseLength);
+#endif
+    }
+    else
+    {
+        responseLength = ((const CommandResponse*)_pSendResponse)->Length;
+    }
+
+    byte window = (_sendCursor == 0) ? TX_FIRST_WINDOW : TX_WINDOW;
+
+    _txCount = responseLength + CRC_SIZE - _sendCursor;
+
+    if (_txCount > window) _txCount = window;
+
+    length = _txCount;
+
+#if COMMANDBUS_CRC
+    return _txFrame + _sendCursor;
+#else
+    return _pSendResponse + _sendCursor;
+#endif
+}
+
+
+//****************************************************************************
+// Called when the transmit DMA has sent the frame returned by 
+// AcquireTransmitFrame(). The response is released once all of it is sent.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::ReleaseTransmitFrame()
+{
+    if (_pSendResponse == NULL) return;
+
+    _sendCursor += _txCount;
+    _txCount = 0;
+
+    if (_sendCursor >= ((const CommandResponse*)_pSendResponse)->Length + CRC_SIZE) ReleaseResponse();
+}
+#endif
+
+
+//****************************************************************************
+// Sets whether a command is high priority. High priority commands are queued
+// in their own lane, which is always handled first. CMD_RESET_DEVICE is high
+// priority by default.
+//****************************************************************************
+void CommandListener::SetCommandPriority(byte commandCode, bool highPriority)
+{
+    if (highPriority)
+        _priorityCommands[commandCode >> 3] |= (1 << (commandCode & 7));
+    else
+        _priorityCommands[commandCode >> 3] &= ~(1 << (commandCode & 7));
+}
+
+
+//****************************************************************************
+// Returns a free slot in the command queue for the command's priority, or
+// NULL if that queue is full
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+byte* CommandListener::ReserveCommandSlot(byte commandCode)
+{
+    return IsPriorityCommand(commandCode) ? _priorityQueue.Reserve() : _commandQueue.Reserve();
+}
+
+
+//****************************************************************************
+// Publishes the command written to the slot returned by ReserveCommandSlot()
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::QueueCommand(byte commandCode)
+{
+    if (IsPriorityCommand(commandCode))
+    {
+        COMMANDBUS_STAT(_receiveTimes[COMMAND_QUEUE_SIZE + _priorityQueue.IndexOf(_priorityQueue.Reserve())] = COMMANDBUS_MICROS());
+        _priorityQueue.Commit();
+    }
+    else
+    {
+        COMMANDBUS_STAT(_receiveTimes[_commandQueue.IndexOf(_commandQueue.Reserve())] = COMMANDBUS_MICROS());
+        _commandQueue.Commit();
+    }
+
+    COMMANDBUS_STAT(byte depth = _commandQueue.Count() + _priorityQueue.Count());
+    COMMANDBUS_STAT(if (depth > _stats.PeakQueueDepth) _stats.PeakQueueDepth = depth);
+
+    _wakePending = true;
+
+    if (_eventDriven && _wakeHandler != NULL) _wakeHandler(*this);
+}
+
+
+//****************************************************************************
+// Called for a command that can't be queued. If the command expects a
+// response then the BUSY response is sent for it, otherwise it is dropped.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::RejectCommand(const CommandMessage* pCommand)
+{
+    if (IsResponseExpected(pCommand))
+    {
+        _pImmediateResponse = &responseBusy;
+        COMMANDBUS_STAT(_stats.BusyResponses++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_BUSY, pCommand->CommandCode, pCommand->Length));
+    }
+    else
+    {
+        COMMANDBUS_STAT(_stats.CommandsDropped++);
+        COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_RX | TRACE_DROPPED, pCommand->CommandCode, pCommand->Length));
+    }
+}
+
+
+//****************************************************************************
+// Handles the commands that are answered directly from the receive interrupt
+// handler rather than being queued for Poll().
+// Returns true if the command was handled.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+bool CommandListener::HandleImmediateCommand(const CommandMessage* pCommand)
+{
+    switch(pCommand->CommandCode)
+    {
+        case CMD_QUERY_RESPONSE:
+            HandleQueryResponseReady(*(const CommandQueryResponseReady*)pCommand);
+            return true;
+
+        // Usually broadcast to all slave devices, so there is no response
+        case CMD_MASTER_ADDR:
+            if (pCommand->Length >= sizeof(CommandMasterAddress)) _masterAddress = ((const CommandMasterAddress*)pCommand)->MasterAddress;
+            return true;
+
+#if COMMANDBUS_FLOW_CONTROL
+        // Answered at once (it never takes a slot), so the master can check
+        // for room even when the queue is full
+        case CMD_QUERY_STATUS:
+            HandleQueryStatus();
+            return true;
+#endif
+
+        default:
+        break;
+    }
+
+#if COMMANDBUS_RESPONSE_CACHE_SIZE > 0
+    auto count = _cachedResponseCount;
+
+    for (byte i = 0; i < count; i++)
+    {
+        if (_responseCache[i].CommandCode == pCommand->CommandCode)
+        {
+            _pImmediateResponse = (const CommandResponse*)_responseCache[i].Response;
+            return true;
+        }
+    }
+#endif
+
+    return false;
+}
+
+
+//****************************************************************************
+// Answers a CMD_QUERY_RESPONSE command in constant time by using the
+// ResponseID to index directly into the deferred response list
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::HandleQueryResponseReady(const CommandQueryResponseReady& command)
+{
+    auto responseID = command.ResponseID;
+    auto index = responseID & DEFERRED_INDEX_MASK;
+    auto& responseItem = _deferredResponseList[index];
+    auto state = responseItem.State;
+
+    if (state == ITEM_FREE || responseItem.ResponseID != responseID ||
+        (command.OriginalCommand != CMD_NONE && command.OriginalCommand != responseItem.CommandCode))
+    {
+        _pImmediateResponse = &responseError;
+    }
+    else if (state == ITEM_PENDING)
+    {
+#if COMMANDBUS_TIMING_CODES > 0
+        // Suggest waiting out the rest of the estimate, or a quarter of the
+        // estimate again once it has run out. The elapsed time is taken in
+        // units of 1024us rather than divided down to milliseconds, since a
+        // 32-bit division is too slow for an interrupt handler; the hint is
+        // at most a couple of percent long.
+        unsigned long elapsed = (COMMANDBUS_MICROS() - responseItem.DeferTime) >> 10;
+        uint16_t elapsedMs = (elapsed < 0xFFFF) ? elapsed : 0xFFFF;
+        uint16_t retryAfterMs = (responseItem.ReadyInMs > elapsedMs) ? responseItem.ReadyInMs - elapsedMs : (responseItem.ReadyInMs + 3) / 4;
+
+        _notReadyResponse = CommandResponseNotReady(responseID, retryAfterMs);
+        _pImmediateResponse = &_notReadyResponse;
+#else
+        _pImmediateResponse = &responseNotReady;
+#endif
+    }
+    else
+    {
+        _pImmediateResponse = responseItem.GetResponse();
+        _immediateDeferredIndex = index;
+    }
+}
+
+
+#if COMMANDBUS_FLOW_CONTROL
+//****************************************************************************
+// Answers a CMD_QUERY_STATUS command with the room left in the command queues
+// and the deferred response list
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::HandleQueryStatus()
+{
+    byte freeDeferredSlots = 0;
+
+    for (auto& responseItem : _deferredResponseList)
+    {
+        if (responseItem.State == ITEM_FREE) freeDeferredSlots++;
+    }
+
+    _statusResponse = CommandResponseStatus(COMMAND_QUEUE_SIZE - _commandQueue.Count(), PRIORITY_QUEUE_SIZE - _priorityQueue.Count(), freeDeferredSlots);
+    _pImmediateResponse = &_statusResponse;
+}
+#endif
+
+
+//****************************************************************************
+// Sends the next part of the pending response on a stream based transport
+// (e.g., the I2C interface), in reply to a request for the response: at most
+// TX_FIRST_WINDOW bytes for the first request of a response, and at most 
+// TX_WINDOW bytes for each request after that.
+// NOTE: This method is called from an interrupt handler so keep it short and simple!
+//****************************************************************************
+void CommandListener::SendResponse(Stream& stream)
+{
+    COMMANDBUS_STAT(IsrTimer timer(_stats));
+
+    byte buffer[TX_WINDOW];
+    byte count = ReadResponseFrame(buffer, (_pSendResponse == NULL) ? TX_FIRST_WINDOW : TX_WINDOW);
+
+    stream.write(buffer, count);
+}
+
+
+//****************************************************************************
+// Copies the next part (up to maxCount bytes) of the pending response frame
+// (or CMD_RESPONSE_NOTREADY if there isn't one) to a buffer, and returns the
+// number of bytes copied. The frame is the response followed by its CRC byte
+// (if enabled). A response longer than maxCount bytes is read over successive
+// calls; the master uses the Length byte at the start of the response to 
+// know how many more bytes to read.
+// NOTE: This method is called from an interrupt handler so keep it short and simple!
+//****************************************************************************
+byte CommandListener::ReadResponseFrame(byte* pBuffer, byte maxCount)
+{
+    if (_pSendResponse == NULL)
+    {
+        _pSendResponse = (const byte*)GetResponse();
+        _sendCursor = 0;
+        _sendCRC = 0;
+    }
+
+    byte length = ((const CommandResponse*)_pSendResponse)->Length;
+    byte frameLength = length + CRC_SIZE;
+    byte count  = frameLength - _sendCursor;
+
+    if (count > maxCount) count = maxCount;
+
+    byte dataCount = (_sendCursor + count > length) ? length - _sendCursor : count;
+
+    memcpy(pBuffer, _pSendResponse + _sendCursor, dataCount);
+
+#if COMMANDBUS_CRC
+    _sendCRC = CRC8(_pSendResponse + _sendCursor, dataCount, _sendCRC);
+
+    if (dataCount < count) pBuffer[dataCount] = _sendCRC;
+#endif
+
+    _sendCursor += count;
+
+    if (_sendCursor >= frameLength) ReleaseResponse();
+
+    return count;
+}
+
+
+//****************************************************************************
+// Called when a response is requested on the I2C interface
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+const CommandResponse* CommandListener::GetResponse()
+{
+    auto pResponse = TakeResponse();
+
+    COMMANDBUS_RECORD(RecordTrace(TRACE_DIRECTION_TX | ((pResponse->ResponseCode == CMD_RESPONSE_NOTREADY) ? TRACE_NOTREADY : TRACE_RESPONSE), 
+                                  pResponse->ResponseCode, pResponse->Length));
+
+    return pResponse;
+}
+
+
+//****************************************************************************
+// Takes the response to send next: the immediate response, else the pending
+// pooled or slot response, else CMD_RESPONSE_NOTREADY
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+const CommandResponse* CommandListener::TakeResponse()
+{
+    // The previous response has been sent, so its buffer is free for reuse
+    ReleaseResponse();
+
+    auto pResponse = _pImmediateResponse;
+
+    if (pResponse != NULL)
+    {
+        _pImmediateResponse = NULL;
+        _sendingDeferredIndex = _immediateDeferredIndex;
+        _immediateDeferredIndex = NO_DEFERRED_INDEX;
+
+        return pResponse;
+    }
+
+#if COMMANDBUS_POOL_BLOCKS > 0
+    auto pPooledResponse = _pReadyPooledResponse;
+
+    if (pPooledResponse != NULL)
+    {
+        _pReadyPooledResponse   = NULL;
+        _pSendingPooledResponse = pPooledResponse;
+
+        return (const CommandResponse*)pPooledResponse;
+    }
+#endif
+
+    auto readySlot = _readySlot;
+
+    if (readySlot == NO_RESPONSE_SLOT) return &responseNotReady;
+
+    _sendingSlot = readySlot;
+    _readySlot   = NO_RESPONSE_SLOT;
+
+    return (const CommandResponse*)_responseSlots[readySlot];
+}
+
+
+//****************************************************************************
+// Releases the buffer of the response that was being sent, so it can be
+// reused. A deferred response is released once it has been sent.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::ReleaseResponse()
+{
+    _pSendResponse = NULL;
+    _sendingSlot = NO_RESPONSE_SLOT;
+
+#if COMMANDBUS_POOL_BLOCKS > 0
+    _responsePool.Free(_pSendingPooledResponse);
+    _pSendingPooledResponse = NULL;
+#endif
+
+    if (_sendingDeferredIndex != NO_DEFERRED_INDEX)
+    {
+        FreeDeferredResponse(_sendingDeferredIndex);
+        _sendingDeferredIndex = NO_DEFERRED_INDEX;
+    }
+}
+
+
+//****************************************************************************
+// Drops an immediate response that the master didn't read before sending its
+// next command, so it can't be taken for the next command's response. A 
+// deferred response that was to be sent stays ready in its slot, and can 
+// still be collected with CMD_QUERY_RESPONSE.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::DiscardImmediateResponse()
+{
+    _pImmediateResponse = NULL;
+    _immediateDeferredIndex = NO_DEFERRED_INDEX;
+}
+
+
+//****************************************************************************
+// Posts a response that was built outside the response buffer. Handlers that
+// build their response with BeginResponse() avoid this copy. A response that
+// is too big for a response buffer is copied to a block from the response
+// pool instead (or CMD_RESPONSE_BUSY is posted if the pool is exhausted).
+//****************************************************************************
+void CommandListener::PostResponse(CommandResponse* pResponse)
+{
+    if (pResponse == NULL) return;
+
+    if (pResponse->Length <= RESPONSE_SIZE)
+    {
+        memcpy(AcquireResponseBuffer(), (byte*)pResponse, pResponse->Length);
+        CommitResponse();
+    }
+#if COMMANDBUS_POOL_BLOCKS > 0
+    else if (pResponse->Length <= POOL_BLOCK_SIZE)
+    {
+        auto pBuffer = AcquirePooledResponseBuffer();
+
+        if (pBuffer == NULL) return;
+
+        memcpy(pBuffer, (byte*)pResponse, pResponse->Length);
+        CommitPooledResponse((CommandResponse*)pBuffer);
+    }
+#endif
+}
+
+
+//****************************************************************************
+// Takes a back slot for writing a new response. Any response that is still
+// pending is withdrawn first (it is being replaced), which also guarantees 
+// the interrupt handler can't start sending from a slot while it is being
+// written. The slot the interrupt handler is sending from is never chosen.
+//****************************************************************************
+byte* CommandListener::AcquireResponseBuffer()
+{
+#if COMMANDBUS_INLINE_HANDLERS
+    if (_inlineDispatching) return _inlineResponse;
+#endif
+
+    if (_pCaptureBuffer != NULL) return _pCaptureBuffer;
+
+    _readySlot = NO_RESPONSE_SLOT;
+    WithdrawPooledResponse();
+    COMMANDBUS_BARRIER();
+
+    auto sendingSlot = _sendingSlot;
+    auto slot = _backSlot;
+
+    do
+    {
+        if (++slot >= RESPONSE_SLOT_COUNT) slot = 0;
+    }
+    while (slot == sendingSlot);
+
+    _backSlot = slot;
+
+    return _responseSlots[slot];
+}
+
+
+//****************************************************************************
+// Publishes the response built in the back slot. This is a single index
+// store, so there is no need to disable interrupts.
+//****************************************************************************
+void CommandListener::CommitResponse()
+{
+#if COMMANDBUS_INLINE_HANDLERS
+    if (_inlineDispatching)
+    {
+        _pImmediateResponse = (const CommandResponse*)_inlineResponse;
+        return;
+    }
+#endif
+
+    if (_pCaptureBuffer != NULL) return;
+
+    COMMANDBUS_BARRIER();
+    _readySlot = _backSlot;
+
+#if COMMANDBUS_STATS
+    // The interrupt handlers count busy responses too, so the increment
+    // can't be interrupted part of the way through
+    if (((const CommandResponse*)_responseSlots[_backSlot])->ResponseCode == CMD_RESPONSE_BUSY)
+    {
+        COMMANDBUS_ATOMIC_BEGIN
+        _stats.BusyResponses++;
+        COMMANDBUS_ATOMIC_END
+    }
+
+    if (_dispatching) _stats.RecordLatency(COMMANDBUS_MICROS() - _dispatchReceiveTime);
+#endif
+}
+
+
+//****************************************************************************
+// Takes a block from the response pool for writing a new response. If the
+// pool is exhausted (or disabled) then CMD_RESPONSE_BUSY is posted instead
+// and NULL is returned.
+//****************************************************************************
+byte* CommandListener::AcquirePooledResponseBuffer()
+{
+#if COMMANDBUS_POOL_BLOCKS > 0
+    auto pBuffer = _responsePool.Allocate();
+
+    if (pBuffer != NULL) return pBuffer;
+#endif
+
+    BeginResponse<CommandResponse>(CMD_RESPONSE_BUSY);
+    CommitResponse();
+
+    return NULL;
+}
+
+
+//****************************************************************************
+// Publishes a response built in a block from the response pool, replacing
+// any response that is still pending. The block is freed once the response
+// has been sent. When responses are being captured, as much of the response
+// as fits is copied to the capture buffer and the block is freed at once.
+// Inline-safe handlers can't send pooled responses, so for them the
+// CMD_RESPONSE_ERROR response is sent instead.
+//****************************************************************************
+void CommandListener::CommitPooledResponse(CommandResponse* pResponse)
+{
+#if COMMANDBUS_POOL_BLOCKS > 0
+    if (pResponse == NULL) return;
+
+#if COMMANDBUS_INLINE_HANDLERS
+    if (_inlineDispatching)
+    {
+        // Too big for the inline response buffer
+        _responsePool.Free(pResponse);
+        _pImmediateResponse = &responseError;
+        return;
+    }
+#endif
+
+    if (_pCaptureBuffer != NULL)
+    {
+        memcpy(_pCaptureBuffer, (byte*)pResponse, (pResponse->Length < RESPONSE_SIZE) ? pResponse->Length : RESPONSE_SIZE);
+        _responsePool.Free(pResponse);
+        return;
+    }
+
+    _readySlot = NO_RESPONSE_SLOT;
+    COMMANDBUS_BARRIER();
+
+    byte* pPrevious;
+
+    COMMANDBUS_ATOMIC_BEGIN
+    pPrevious = _pReadyPooledResponse;
+    _pReadyPooledResponse = (byte*)pResponse;
+    COMMANDBUS_ATOMIC_END
+
+    _responsePool.Free(pPrevious);
+
+    COMMANDBUS_STAT(if (_dispatching) _stats.RecordLatency(COMMANDBUS_MICROS() - _dispatchReceiveTime));
+#endif
+}
+
+
+//****************************************************************************
+// Withdraws the pooled response that is pending (if any) and frees its block.
+// The interrupt handler can take the response at any moment, so the pointer
+// is swapped out with interrupts disabled.
+//****************************************************************************
+void CommandListener::WithdrawPooledResponse()
+{
+#if COMMANDBUS_POOL_BLOCKS > 0
+    byte* pResponse;
+
+    COMMANDBUS_ATOMIC_BEGIN
+    pResponse = _pReadyPooledResponse;
+    _pReadyPooledResponse = NULL;
+    COMMANDBUS_ATOMIC_END
+
+    _responsePool.Free(pResponse);
+#endif
+}
+
+
+//****************************************************************************
+// Caches a pre-built response for an idempotent command whose response never
+// changes. From then on the command is answered directly from the receive
+// interrupt handler in the same transaction, and never reaches Poll(). 
+// Cached responses can't be replaced or removed.
+// Returns false if the cache is full, the command is already cached, or the
+// response is too big (in which case the command is handled as usual).
+//****************************************************************************
+bool CommandListener::CacheResponse(byte commandCode, const CommandResponse* pResponse)
+{
+#if COMMANDBUS_RESPONSE_CACHE_SIZE > 0
+    byte count = _cachedResponseCount;
+
+    if (pResponse == NULL || pResponse->Length > CACHED_RESPONSE_SIZE || count >= RESPONSE_CACHE_SIZE) return false;
+
+    for (byte i = 0; i < count; i++)
+    {
+        if (_responseCache[i].CommandCode == commandCode) return false;
+    }
+
+    _responseCache[count].CommandCode = commandCode;
+    memcpy(_responseCache[count].Response, (const byte*)pResponse, pResponse->Length);
+    COMMANDBUS_BARRIER();
+    _cachedResponseCount = count + 1;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+//****************************************************************************
+// Defers the response to a long running command. This allocates a slot in the
+// deferred response list and posts a CMD_RESPONSE_DEFERRED response carrying the
+// ResponseID the master uses to query for the response later.
+// Returns the ResponseID, which must be set in the response eventually passed 
+// to PostDeferredResponse(), or 0 if there was no free slot (in which case the
+// CMD_RESPONSE_BUSY response is posted instead). A batched command can't be
+// deferred, since the master only gets its response code, so for it 0 is
+// returned and CMD_RESPONSE_ERROR is posted.
+//****************************************************************************
+byte CommandListener::DeferResponse(const CommandMessage* pCommand)
+{
+#if COMMANDBUS_PIPELINE
+    // A pipelined command's response is deferred in the slot it already has,
+    // and the master learns it is ready from CMD_COLLECT
+    if (_taggedIndex != NO_DEFERRED_INDEX)
+    {
+        auto& responseItem = _deferredResponseList[_taggedIndex];
+
+        responseItem.CommandCode = pCommand->CommandCode;
+        _taggedDeferred = true;
+
+        return responseItem.ResponseID;
+    }
+#endif
+
+    // Otherwise responses are only captured for a batch
+    if (_pCaptureBuffer != NULL)
+    {
+        BeginResponse<CommandResponse>(CMD_RESPONSE_ERROR);
+        CommitResponse();
+
+        return 0;
+    }
+
+    auto index = AllocateDeferredResponse(pCommand->CommandCode);
+
+    if (index == NO_DEFERRED_INDEX)
+    {
+        BeginResponse<CommandResponse>(CMD_RESPONSE_BUSY);
+        CommitResponse();
+
+        return 0;
+    }
+
+    auto& responseItem = _deferredResponseList[index];
+
+#if COMMANDBUS_TIMING_CODES > 0
+    BeginResponse<CommandResponseDeferred>(responseItem.ResponseID, responseItem.ReadyInMs);
+#else
+    BeginResponse<CommandResponseDeferred>(responseItem.ResponseID);
+#endif
+    CommitResponse();
+
+    return responseItem.ResponseID;
+}
+
+
+//****************************************************************************
+// Allocates a slot in the deferred response list for a command, and gives it
+// a new ResponseID. The slot is left pending.
+// Returns the index of the slot, or NO_DEFERRED_INDEX if there was no free slot.
+//****************************************************************************
+byte CommandListener::AllocateDeferredResponse(byte commandCode)
+{
+    for (byte i = 0; i < DEFERRED_RESPONSE_LIST_SIZE; i++)
+    {
+        auto index = (_nextDeferredIndex + i) & DEFERRED_INDEX_MASK;
+        auto& responseItem = _deferredResponseList[index];
+
+        if (responseItem.State != ITEM_FREE) continue;
+
+        // Bump the generation count (skipping generation 0 so a ResponseID
+        // is never 0)
+        byte responseID = responseItem.ResponseID + DEFERRED_RESPONSE_LIST_SIZE;
+
+        if (responseID < DEFERRED_RESPONSE_LIST_SIZE) responseID += DEFERRED_RESPONSE_LIST_SIZE;
+
+        responseItem.ResponseID  = responseID;
+        responseItem.CommandCode = commandCode;
+#if COMMANDBUS_PUSH
+        responseItem.Notified    = false;
+#endif
+#if COMMANDBUS_PIPELINE
+        responseItem.Tag         = 0;
+#endif
+#if COMMANDBUS_TIMING_CODES > 0
+        responseItem.DeferTime   = COMMANDBUS_MICROS();
+        responseItem.ReadyInMs   = EstimateReadyInMs(commandCode);
+#endif
+        COMMANDBUS_BARRIER();
+        responseItem.State = ITEM_PENDING;
+
+        _nextDeferredIndex = index + 1;
+
+        return index;
+    }
+
+    return NO_DEFERRED_INDEX;
+}
+
+
+//****************************************************************************
+// Posts the completed response for a command that was deferred with
+// DeferResponse(). The ResponseID of the response identifies the deferred 
+// command it completes.
+// Returns false if the ResponseID is unknown (or stale) or the response is 
+// too big.
+//****************************************************************************
+bool CommandListener::PostDeferredResponse(CommandResponse* pResponse)
+{
+    if (pResponse == NULL || pResponse->Length > MAX_RESPONSE_SIZE) return false;
+
+    auto index = pResponse->ResponseID & DEFERRED_INDEX_MASK;
+    auto& responseItem = _deferredResponseList[index];
+
+    if (responseItem.State != ITEM_PENDING || responseItem.ResponseID != pResponse->ResponseID) return false;
+
+    byte* pBuffer = responseItem.Response;
+
+#if COMMANDBUS_POOL_BLOCKS > 0
+    // A response too big for the slot goes in a block from the response pool
+    if (pResponse->Length > RESPONSE_SIZE || (byte*)pResponse == responseItem.pPooledResponse)
+    {
+        if (responseItem.pPooledResponse == NULL) responseItem.pPooledResponse = _responsePool.Allocate();
+
+        if (responseItem.pPooledResponse == NULL)
+        {
+            CompleteDeferredResponse(index, CMD_RESPONSE_BUSY);
+            return false;
+        }
+
+        pBuffer = responseItem.pPooledResponse;
+    }
+    else
+    {
+        _responsePool.Free(responseItem.pPooledResponse);
+        responseItem.pPooledResponse = NULL;
+    }
+#else
+    if (pResponse->Length > RESPONSE_SIZE) return false;
+#endif
+
+    // A response built with BeginDeferredResponse() is already in place
+    if ((byte*)pResponse != pBuffer) memcpy(pBuffer, (byte*)pResponse, pResponse->Length);
+
+    COMMANDBUS_BARRIER();
+    responseItem.State = ITEM_READY;
+
+#if COMMANDBUS_TIMING_CODES > 0
+    RecordCompletionTime(responseItem.CommandCode, COMMANDBUS_MICROS() - responseItem.DeferTime);
+#endif
+
+    return true;
+}
+
+
+#if COMMANDBUS_TIMING_CODES > 0
+//****************************************************************************
+// Returns the learned handling time of a deferred command, in milliseconds
+// (0 if the command code hasn't been timed yet)
+//****************************************************************************
+uint16_t CommandListener::EstimateReadyInMs(byte commandCode) const
+{
+    for (byte i = 0; i < _commandTimingCount; i++)
+    {
+        if (_commandTimings[i].CommandCode == commandCode) return _commandTimings[i].EstimateMs;
+    }
+
+    return 0;
+}
+
+
+//****************************************************************************
+// Folds the time a deferred command took to complete (in microseconds) into
+// the running average for its command code. The average moves a quarter of
+// the way to each new time, so it follows changes without jumping on one
+// slow completion. When the list is full the oldest entry is replaced.
+//****************************************************************************
+void CommandListener::RecordCompletionTime(byte commandCode, unsigned long elapsed)
+{
+    // Rounded up, so a fast command is still given a non-zero hint
+    elapsed = (elapsed + 999) / 1000;
+
+    long elapsedMs = (elapsed < 0xFFFF) ? elapsed : 0xFFFF;
+
+    for (byte i = 0; i < _commandTimingCount; i++)
+    {
+        auto& timing = _commandTimings[i];
+
+        if (timing.CommandCode == commandCode)
+        {
+            timing.EstimateMs = (uint16_t)(timing.EstimateMs + (elapsedMs - (long)timing.EstimateMs) / 4);
+            return;
+        }
+    }
+
+    byte index = _nextCommandTiming;
+
+    if (_commandTimingCount < TIMING_CODE_COUNT)
+        index = _commandTimingCount++;
+    else
+        _nextCommandTiming = (index + 1 < TIMING_CODE_COUNT) ? index + 1 : 0;
+
+    _commandTimings[index].CommandCode = commandCode;
+    _commandTimings[index].EstimateMs  = (uint16_t)elapsedMs;
+}
+#endif
+
+
+//****************************************************************************
+// Returns a buffer of at least size bytes for the deferred response with a
+// ResponseID: the slot's own buffer, or a block from the response pool if
+// the response is too big for it. Returns NULL if the ResponseID is unknown
+// (or stale) or the response is already posted, or if the pool is exhausted
+// (in which case the command completes with CMD_RESPONSE_BUSY).
+// The slot stays pending, so the master sees CMD_RESPONSE_NOTREADY until
+// the response is posted.
+//****************************************************************************
+byte* CommandListener::AcquireDeferredResponseBuffer(byte responseID, byte size)
+{
+    auto index = responseID & DEFERRED_INDEX_MASK;
+    auto& responseItem = _deferredResponseList[index];
+
+    if (responseItem.State != ITEM_PENDING || responseItem.ResponseID != responseID) return NULL;
+
+    if (size <= RESPONSE_SIZE) return responseItem.Response;
+
+#if COMMANDBUS_POOL_BLOCKS > 0
+    if (responseItem.pPooledResponse == NULL) responseItem.pPooledResponse = _responsePool.Allocate();
+
+    if (responseItem.pPooledResponse != NULL) return responseItem.pPooledResponse;
+#endif
+
+    CompleteDeferredResponse(index, CMD_RESPONSE_BUSY);
+
+    return NULL;
+}
+
+
+//****************************************************************************
+// Completes a deferred command with a response that has no data, such as
+// CMD_RESPONSE_BUSY for when there is no room for its real response, so the
+// master isn't left waiting for it.
+//****************************************************************************
+void CommandListener::CompleteDeferredResponse(byte index, byte responseCode)
+{
+    auto& responseItem = _deferredResponseList[index];
+
+    new (responseItem.Response) CommandResponse(responseCode, responseItem.ResponseID);
+    COMMANDBUS_BARRIER();
+    responseItem.State = ITEM_READY;
+}
+
+
+//****************************************************************************
+// Frees a deferred response slot, along with its response pool block (if any)
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void CommandListener::FreeDeferredResponse(byte index)
+{
+    auto& responseItem = _deferredResponseList[index];
+
+#if COMMANDBUS_POOL_BLOCKS > 0
+    _responsePool.Free(responseItem.pPooledResponse);
+    responseItem.pPooledResponse = NULL;
+#endif
+
+    responseItem.State = ITEM_FREE;
+}
@@ -4,81 +4,654 @@
 #ifndef _CommandListener_h_
 #define _CommandListener_h_
 
+#if defined(__AVR__)
+#include <new.h>
+#else
+#include <new>
+#endif
 #include <Wire.h>
 #include <RTL_StdLib.h>
 #include <RTL_I2C.h>
 //#include <RTL_EventFramework.h>
 #include <RTL_TaskScheduler.h>
 #include "CommandProtocol.h"
+#include "CommandQueue.h"
+#include "CommandPool.h"
+#include "CommandCRC.h"
+
+
+class CommandListener;
+
+
+//****************************************************************************
+/// A command handler function. Handlers are plain functions (rather than
+/// virtual or member functions) so that they can be stored in a PROGMEM table.
+//****************************************************************************
+typedef void (*CommandHandler)(CommandListener& listener, const CommandMessage* pCommand);
+
+
+//****************************************************************************
+/// An entry in a command dispatch table, mapping a command code to the
+/// handler for that command.
+///
+/// A dispatch table is an array of these entries, stored in PROGMEM and 
+/// sorted by CommandCode in ascending order (it is binary searched). Entries
+/// are normally declared with the COMMAND_HANDLER macro, which binds a member
+/// function of a CommandListener subclass with no run-time overhead:
+///
+///     const CommandHandlerEntry MyListener::CommandTable[] PROGMEM =
+///     {
+///         COMMAND_HANDLER(CMD_MOTOR_MOVE, MyListener, HandleMotorMove),
+///         COMMAND_HANDLER(CMD_MOTOR_STOP, MyListener, HandleMotorStop),
+///     };
+///
+/// and the table is passed to the CommandListener constructor.
+///
+/// Fast handlers that only build a small response (e.g., register reads) can
+/// be declared with COMMAND_HANDLER_INLINE instead. When COMMANDBUS_INLINE_HANDLERS
+/// is enabled these run directly in the receive interrupt handler, so the
+/// master can read their response in the same transaction. An inline-safe
+/// handler must be short, must only respond with BeginResponse() or 
+/// PostResponse(), and must not defer its response or touch any state that 
+/// the main loop uses without protection.
+//****************************************************************************
+struct CommandHandlerEntry
+{
+    byte CommandCode;
+    CommandHandler Handler;
+    byte Flags;                 // COMMAND_FLAG_* values
+};
+
+#define COMMAND_FLAG_INLINE     0x01    // Handler is safe to run in the receive interrupt handler
+
+#define COMMAND_HANDLER(commandCode, T, method) { commandCode, &CommandListener::InvokeHandler<T, &T::method>, 0 }
+
+#define COMMAND_HANDLER_INLINE(commandCode, T, method) { commandCode, &CommandListener::InvokeHandler<T, &T::method>, COMMAND_FLAG_INLINE }
+
+#define COMMAND_TABLE_SIZE(table) ((byte)(sizeof(table) / sizeof(table[0])))
+
+
+//****************************************************************************
+/// Called from the receive interrupt handler when a command is queued while
+/// the listener is event driven (see CommandListener::SetEventDriven()).
+//****************************************************************************
+typedef void (*CommandWakeHandler)(CommandListener& listener);
 
 
 class CommandListener : public EventSource, public IEventListener
 {
     DECLARE_CLASSNAME;
 
-    //public:  static const EVENT_ID ResponseEvent = (EventSourceID::Task | EventCode::Response);
+    /// Event raised by a worker task to complete a deferred response. The
+    /// event's Data.Pointer is the completed CommandResponse, with its
+    /// ResponseID set to the ID returned by DeferResponse().
+    public:  static const EVENT_ID ResponseEvent = (EventSourceID::Task | EventCode::Response);
+
+    private: static const byte DEFERRED_RESPONSE_LIST_SIZE = COMMANDBUS_DEFERRED_SIZE;
+
+    public: static const byte COMMAND_QUEUE_SIZE = COMMANDBUS_QUEUE_SIZE;
+
+    public: static const byte PRIORITY_QUEUE_SIZE = COMMANDBUS_PRIORITY_QUEUE_SIZE;
+
+    public: static const byte COMMAND_SIZE = COMMANDBUS_COMMAND_SIZE;
+
+    public: static const byte RESPONSE_SIZE = COMMANDBUS_RESPONSE_SIZE;
+
+    public: static const byte RESPONSE_SLOT_COUNT = COMMANDBUS_RESPONSE_SLOTS;
+
+    public: static const byte TX_WINDOW = COMMANDBUS_TX_WINDOW;
+
+    public: static const byte TX_FIRST_WINDOW = COMMANDBUS_TX_FIRST_WINDOW;
+
+    public: static const byte CRC_SIZE = COMMANDBUS_CRC_SIZE;
 
-    //private: static const int DEFERRED_RESPONSE_LIST_SIZE = 5;
+    // A command is received in place, so its slot holds the whole frame (the
+    // command and its CRC byte)
+    private: static const byte COMMAND_SLOT_SIZE = COMMAND_SIZE + CRC_SIZE;
 
-    public: byte CommandBuffer[32];
+    public: static const byte RESPONSE_CACHE_SIZE = COMMANDBUS_RESPONSE_CACHE_SIZE;
 
-    public: byte ResponseBuffer[32];
+    public: static const byte CACHED_RESPONSE_SIZE = COMMANDBUS_CACHED_RESPONSE_SIZE;
 
-    public: bool CommandPending;
+    public: static const byte POOL_BLOCK_COUNT = COMMANDBUS_POOL_BLOCKS;
 
-    public: bool ResponsePending;
+    public: static const byte POOL_BLOCK_SIZE = COMMANDBUS_POOL_BLOCK_SIZE;
+
+    public: static const byte MAX_RESPONSE_SIZE = COMMANDBUS_MAX_RESPONSE_SIZE;
+
+    public: static const byte TIMING_CODE_COUNT = COMMANDBUS_TIMING_CODES;
+
+    public: static const byte HISTOGRAM_CODE_COUNT = COMMANDBUS_HISTOGRAM_CODES;
+
+    public: static const byte HISTOGRAM_BUCKET_COUNT = COMMANDBUS_HISTOGRAM_BUCKETS;
+
+    public: static const byte TRACE_SIZE = COMMANDBUS_TRACE_SIZE;
 
 
     /***************************************************************************
     Constructors / Destructors
     ***************************************************************************/
-    protected: CommandListener(byte deviceID=0) : _myDeviceID(deviceID) 
+    protected: CommandListener(byte deviceID=0, const CommandHandlerEntry* pCommandTable=NULL, byte commandTableSize=0) : 
+        _myDeviceID(deviceID), 
+        _masterAddress(I2C_GENERAL_CALL_ADDRESS),
+        _pCommandTable(pCommandTable),
+        _commandTableSize(commandTableSize),
+        _backSlot(0),
+        _readySlot(NO_RESPONSE_SLOT),
+        _sendingSlot(NO_RESPONSE_SLOT),
+        _pCaptureBuffer(NULL),
+        _nextDeferredIndex(0), 
+        _pImmediateResponse(NULL), 
+        _immediateDeferredIndex(NO_DEFERRED_INDEX),
+        _sendingDeferredIndex(NO_DEFERRED_INDEX),
+        _pSendResponse(NULL),
+        _sendCursor(0),
+        _sendCRC(0)
     {
+        static_assert(RESPONSE_SLOT_COUNT >= 2, "COMMANDBUS_RESPONSE_SLOTS must be at least 2");
+        static_assert(MAX_RESPONSE_SIZE + CRC_SIZE <= 0xFF, "COMMANDBUS_MAX_RESPONSE_SIZE is too big for a response frame");
+        static_assert(TX_FIRST_WINDOW >= sizeof(CommandResponse) + CRC_SIZE && TX_FIRST_WINDOW <= TX_WINDOW, "COMMANDBUS_TX_FIRST_WINDOW must hold a CommandResponse and fit in COMMANDBUS_TX_WINDOW");
+        static_assert((DEFERRED_RESPONSE_LIST_SIZE & DEFERRED_INDEX_MASK) == 0 && DEFERRED_RESPONSE_LIST_SIZE <= 128, "COMMANDBUS_DEFERRED_SIZE must be a power of 2 no larger than 128");
+#if COMMANDBUS_TRACE_SIZE > 0
+        static_assert((TRACE_SIZE & (TRACE_SIZE - 1)) == 0 && TRACE_SIZE <= 128, "COMMANDBUS_TRACE_SIZE must be a power of 2 no larger than 128");
+#endif
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+        static_assert(HISTOGRAM_BUCKET_COUNT >= 1 && HISTOGRAM_BUCKET_COUNT <= 32, "COMMANDBUS_HISTOGRAM_BUCKETS must be from 1 to 32");
+        static_assert(HISTOGRAM_CODE_COUNT * HISTOGRAM_PAGES_PER_CODE <= 0xFF, "COMMANDBUS_HISTOGRAM_CODES is too big for the histogram pages");
+#endif
+
+        for (byte i = 0; i < DEFERRED_RESPONSE_LIST_SIZE; i++) _deferredResponseList[i].ResponseID = i;
+
+        memset(_priorityCommands, 0, sizeof(_priorityCommands));
+        SetCommandPriority(CMD_RESET_DEVICE);
     };
 
     /***************************************************************************
     Public implementation
     ***************************************************************************/
     public: void Poll();
+    public: bool ProcessCommands();
+    public: void SetPollBudget(byte maxCommands, unsigned long maxMicros) { _pollMaxCommands = maxCommands; _pollMaxMicros = maxMicros; };
+    public: void SetEventDriven(bool eventDriven, CommandWakeHandler wakeHandler=NULL);
+    public: bool IsWakePending() const { return _wakePending; };
     public: void Begin();
     public: void OnEvent(const Event* pEvent);
-    // public: void OnCommandReceived(const CommandMessage* pCommand);
-    // public: void OnCommandReceived(TwoWire& twi, int messageLength);
+    public: void OnCommandReceived(const CommandMessage* pCommand);
+    public: void OnCommandReceived(Stream& stream, int messageLength);
+    public: void BeginCommandFrame();
+    public: void ReceiveCommandByte(byte data);
+    public: void EndCommandFrame();
+    public: bool IsCommandPending() const { return !_priorityQueue.IsEmpty() || !_commandQueue.IsEmpty(); };
+    public: void SetCommandPriority(byte commandCode, bool highPriority=true);
+    public: bool IsPriorityCommand(byte commandCode) const { return (_priorityCommands[commandCode >> 3] & (1 << (commandCode & 7))) != 0; };
+    public: bool IsResponsePending() const { return _readySlot != NO_RESPONSE_SLOT || _pImmediateResponse != NULL; };
     public: const CommandResponse* GetResponse();
+    public: void EnableGeneralCall(bool enable=true);
+    public: byte GetMasterAddress() const { return _masterAddress; };
+#if COMMANDBUS_PUSH
+    public: void EnablePush(TwoWire& twi, byte sourceAddress, unsigned long interval=COMMANDBUS_PUSH_INTERVAL, bool onChangeOnly=true);
+    public: void DisablePush() { _pPushTwi = NULL; };
+    public: bool IsPushActive() const { return _pPushTwi != NULL && _masterAddress != I2C_GENERAL_CALL_ADDRESS; };
+#endif
+
+    public: virtual void SendResponse(Stream& stream);
 
-    public: virtual void SendResponse(TwoWire& twi);
+    /// The I2C transport's entry point, which was SendResponse()'s only form
+    /// before the transports were split out. It is kept (and still virtual) so
+    /// that existing overrides keep being called.
+    public: virtual void SendResponse(TwoWire& twi) { SendResponse((Stream&)twi); };
+    public: byte ReadResponseFrame(byte* pBuffer, byte maxCount);
+#if COMMANDBUS_DMA
+    public: byte* AcquireReceiveFrame(byte& capacity);
+    public: void CommitReceiveFrame(byte length);
+    public: const byte* AcquireTransmitFrame(byte& length);
+    public: void ReleaseTransmitFrame();
+#endif
+
+    /// Constructs the completed response for a deferred command directly in
+    /// its deferred response slot, for a worker task to fill in and then pass
+    /// back in a ResponseEvent (which then needs no copy). A response that is
+    /// too big for the slot is given a block from the response pool. Returns
+    /// NULL if the ResponseID is unknown or stale, or if the pool is
+    /// exhausted (in which case the command completes with CMD_RESPONSE_BUSY).
+    public: template <class T, class... Args> T* BeginDeferredResponse(byte responseID, const Args&... args)
+    {
+        static_assert(sizeof(T) <= MAX_RESPONSE_SIZE, "Response type is too big for a response buffer");
+
+        auto pBuffer = AcquireDeferredResponseBuffer(responseID, sizeof(T));
+
+        if (pBuffer == NULL) return NULL;
+
+        auto pResponse = new (pBuffer) T(args...);
+
+        pResponse->ResponseID = responseID;
+
+        return pResponse;
+    };
+
+    /// Adapts a CommandListener subclass member function to a CommandHandler
+    /// (see COMMAND_HANDLER).
+    public: template <class T, void (T::*METHOD)(const CommandMessage*)> 
+            static void InvokeHandler(CommandListener& listener, const CommandMessage* pCommand)
+    {
+        (static_cast<T&>(listener).*METHOD)(pCommand);
+    };
 
     /***************************************************************************
     Shared implementation
     ***************************************************************************/
     protected: virtual void OnBegin() { };
+    protected: virtual void OnResetDevice() { };
     protected: virtual void OnCommand(const CommandMessage* pCommand);
     protected: virtual bool IsResponseExpected(const CommandMessage* pCommand) { return false; };
     
     protected: void DefaultCommandHandler(const CommandMessage* pCommand);
     protected: void PostResponse(CommandResponse* pResponse);
-    //protected: void PostDeferredResponse(CommandResponse* pResponse);
+    protected: void CommitResponse();
+
+    /// Constructs a response of type T directly in a free response buffer, so
+    /// the handler can fill it in without building a copy on the stack. The
+    /// response is not visible to the master until CommitResponse() is called.
+    protected: template <class T, class... Args> T* BeginResponse(const Args&... args)
+    {
+        static_assert(sizeof(T) <= RESPONSE_SIZE, "Response type is too big for a response buffer");
+
+        return new (AcquireResponseBuffer()) T(args...);
+    };
+
+    /// Constructs a response of type T in a block from the response pool, for
+    /// responses too big for a response buffer. The response is not visible to
+    /// the master until CommitPooledResponse() is called. Returns NULL if the
+    /// pool is exhausted, in which case CMD_RESPONSE_BUSY is posted instead.
+    protected: template <class T, class... Args> T* BeginPooledResponse(const Args&... args)
+    {
+        static_assert(sizeof(T) <= MAX_RESPONSE_SIZE, "Response type is too big for a response pool block");
+
+        auto pBuffer = AcquirePooledResponseBuffer();
+
+        return (pBuffer != NULL) ? new (pBuffer) T(args...) : NULL;
+    };
+    protected: void CommitPooledResponse(CommandResponse* pResponse);
+    protected: bool CacheResponse(byte commandCode, const CommandResponse* pResponse);
+#if COMMANDBUS_PUSH
+    protected: void PostTelemetry(const void* pData, byte length);
+#endif
+    protected: byte DeferResponse(const CommandMessage* pCommand);
+    protected: bool PostDeferredResponse(CommandResponse* pResponse);
 
     /***************************************************************************
     Internal implementation
     ***************************************************************************/
-    //private: void HandleCommand(const CommandMessage* pCommand);
-    //private: void HandleQueryResponseReady(const CommandQueryResponseReady& command);
+    private: void DispatchCommand(const CommandMessage* pCommand);
+#if COMMANDBUS_PUSH
+    private: void ProcessPush();
+#endif
+    private: const CommandResponse* TakeResponse();
+    private: byte* AcquireResponseBuffer();
+    private: void ReleaseResponse();
+    private: void DiscardImmediateResponse();
+    private: byte* AcquireDeferredResponseBuffer(byte responseID, byte size);
+    private: byte* AcquirePooledResponseBuffer();
+    private: void WithdrawPooledResponse();
+    private: void FreeDeferredResponse(byte index);
+    private: byte AllocateDeferredResponse(byte commandCode);
+    private: void CompleteDeferredResponse(byte index, byte responseCode);
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+    private: void RecordHandlerTime(byte commandCode, unsigned long elapsed);
+#endif
+#if COMMANDBUS_TRACE_SIZE > 0
+    private: void RecordTrace(byte event, byte code, byte length);
+#endif
+#if COMMANDBUS_TIMING_CODES > 0
+    private: uint16_t EstimateReadyInMs(byte commandCode) const;
+    private: void RecordCompletionTime(byte commandCode, unsigned long elapsed);
+#endif
+    private: static CommandHandler FindCommandHandler(const CommandHandlerEntry* pTable, byte tableSize, byte commandCode);
+    private: static const CommandHandlerEntry* FindCommandEntry(const CommandHandlerEntry* pTable, byte tableSize, byte commandCode);
+    private: CommandHandler FindInlineHandler(byte commandCode) const;
+    private: void DispatchInlineCommand(CommandHandler handler, const CommandMessage* pCommand);
+    private: bool HandleImmediateCommand(const CommandMessage* pCommand);
+    private: void HandleQueryResponseReady(const CommandQueryResponseReady& command);
+#if COMMANDBUS_FLOW_CONTROL
+    private: void HandleQueryStatus();
+#endif
+
+    private: static void HandleQueryID(CommandListener& listener, const CommandMessage* pCommand);
+    private: static void HandleEcho(CommandListener& listener, const CommandMessage* pCommand);
+    private: static void HandleBatch(CommandListener& listener, const CommandMessage* pCommand);
+    private: static void HandleResetDevice(CommandListener& listener, const CommandMessage* pCommand);
+    private: static void HandleQueryStats(CommandListener& listener, const CommandMessage* pCommand);
+#if COMMANDBUS_TRACE_SIZE > 0
+    private: static void HandleQueryTrace(CommandListener& listener, const CommandMessage* pCommand);
+#endif
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+    private: static void HandleQueryHistogram(CommandListener& listener, const CommandMessage* pCommand);
+    private: static void HandleResetHistogram(CommandListener& listener, const CommandMessage* pCommand);
+#endif
+#if COMMANDBUS_PIPELINE
+    private: static void HandleTagged(CommandListener& listener, const CommandMessage* pCommand);
+    private: static void HandleCollect(CommandListener& listener, const CommandMessage* pCommand);
+#endif
+    private: byte* ReserveCommandSlot(byte commandCode);
+    private: void QueueCommand(byte commandCode);
+    private: void RejectCommand(const CommandMessage* pCommand);
 
     /***************************************************************************
     Internal state
     ***************************************************************************/
     private: byte _myDeviceID;
 
-    // private: struct ResponseItem 
-    // {
-        // bool InUse;
-        // CommandResponse* pResponse;
+    // The command frame being received (see ReceiveCommandByte())
+    private: byte _rxHeader[sizeof(CommandQueryResponseReady) + CRC_SIZE];
+
+    private: byte* _pRxSlot = NULL;
+
+    private: byte* _pRxBuffer = _rxHeader;
+
+    private: byte _rxCapacity = sizeof(_rxHeader);
+
+    private: byte _rxCount = 0;
+
+#if COMMANDBUS_CRC
+    private: byte _rxCRC = 0;
+#endif
+
+#if COMMANDBUS_INLINE_HANDLERS
+    private: CommandHandler _pRxInlineHandler = NULL;
+#endif
+
+#if COMMANDBUS_DMA
+    private: bool _rxPriorityLane = false;      // True if _pRxSlot is in the priority queue
+
+    // Receives a whole frame when both command queues are full, since the DMA
+    // can't stop at the header the way the byte at a time entry points do
+    private: byte _rxFrame[COMMAND_SLOT_SIZE];
+
+#if COMMANDBUS_CRC
+    // A response frame has to be contiguous for DMA, CRC byte and all
+    private: byte _txFrame[MAX_RESPONSE_SIZE + CRC_SIZE];
+#endif
+
+    private: byte _txCount = 0;                 // Length of the part of the response frame acquired for DMA
+#endif
+
+    private: volatile byte _masterAddress;
+
+    private: static const CommandHandlerEntry _builtinCommandTable[];
+
+    private: const CommandHandlerEntry* _pCommandTable;
+
+    private: byte _commandTableSize;
+
+    private: CommandQueue<COMMAND_QUEUE_SIZE, COMMAND_SLOT_SIZE> _commandQueue;
+
+    // High priority commands have their own queue (lane), which Poll() always
+    // drains first. _priorityCommands is a bitmap of the high priority codes.
+    private: CommandQueue<PRIORITY_QUEUE_SIZE, COMMAND_SLOT_SIZE> _priorityQueue;
+
+    private: byte _priorityCommands[256 / 8];
+
+    private: byte _pollMaxCommands = COMMANDBUS_POLL_MAX_COMMANDS;
+
+    private: unsigned long _pollMaxMicros = COMMANDBUS_POLL_MAX_MICROS;
+
+    // In event driven mode Poll() does nothing until the receive interrupt
+    // handler queues a command and sets _wakePending
+    private: bool _eventDriven = false;
+
+    private: volatile bool _wakePending = false;
+
+    private: CommandWakeHandler _wakeHandler = NULL;
+
+#if COMMANDBUS_PUSH
+    public: static const byte TELEMETRY_SIZE = COMMANDBUS_TELEMETRY_SIZE;
+
+    // In push mode Poll() writes CMD_NOTIFY messages to the master's address
+    // as a bus master, at most once per _pushInterval
+    private: TwoWire* _pPushTwi = NULL;
+
+    private: byte _pushSourceAddress = 0;
+
+    private: bool _pushOnChangeOnly = true;
+
+    private: unsigned long _pushInterval = COMMANDBUS_PUSH_INTERVAL;
+
+    private: unsigned long _lastPushTime = 0;
+
+    private: byte _telemetry[TELEMETRY_SIZE];
+
+    private: byte _telemetryLength = 0;
+
+    private: bool _telemetryChanged = false;
+#endif
+
+#if COMMANDBUS_STATS
+    // The counts are updated by the interrupt handlers and (with interrupts
+    // disabled) by the main loop; the latencies only by the main loop
+    public: struct Statistics
+    {
+        uint16_t CommandsReceived;
+        uint16_t CommandsDropped;
+        uint16_t BusyResponses;
+        uint32_t MaxLatency;
+        uint32_t LatencyTotal;
+        uint16_t LatencyCount;
+        uint16_t MaxIsrTime;
+        byte     PeakQueueDepth;
+
+        Statistics() { memset(this, 0, sizeof(*this)); };
+
+        void RecordLatency(uint32_t latency);
+    };
+
+    /// Times an interrupt handler from construction to destruction
+    private: struct IsrTimer
+    {
+        Statistics& Stats;
+        unsigned long StartTime;
+
+        IsrTimer(Statistics& stats) : Stats(stats), StartTime(COMMANDBUS_MICROS()) { };
+        ~IsrTimer();
+    };
+
+    private: Statistics _stats;
+
+    // When each queued command was received (the priority queue's slots follow the normal queue's)
+    private: unsigned long _receiveTimes[COMMAND_QUEUE_SIZE + PRIORITY_QUEUE_SIZE];
+
+    private: unsigned long _dispatchReceiveTime;                // When the command being dispatched was received
+
+    private: bool _dispatching = false;                         // True while a queued command is being dispatched
+#endif
+
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+    // How long each command code's handler takes to run in Poll(), as a
+    // histogram of log2 microsecond buckets
+    private: struct LatencyHistogram
+    {
+        byte CommandCode;
+        uint16_t Counts[HISTOGRAM_BUCKET_COUNT];
+    };
+
+    private: static const byte HISTOGRAM_PAGE_SIZE = sizeof(CommandResponseHistogram::Counts) / sizeof(CommandResponseHistogram::Counts[0]);
+
+    private: static const byte HISTOGRAM_PAGES_PER_CODE = (HISTOGRAM_BUCKET_COUNT + HISTOGRAM_PAGE_SIZE - 1) / HISTOGRAM_PAGE_SIZE;
+
+    private: LatencyHistogram _histograms[HISTOGRAM_CODE_COUNT];
+
+    private: byte _histogramCount = 0;
+#endif
+
+#if COMMANDBUS_TRACE_SIZE > 0
+    // A ring of the most recent frames received and sent (and commands
+    // handled). Records are written by both the interrupt handlers and
+    // Poll(), so each one is written with interrupts disabled.
+    private: struct TraceRecord
+    {
+        unsigned long Time;
+        byte Event;
+        byte Code;
+        byte Length;
+    };
+
+    private: static const byte TRACE_MASK = TRACE_SIZE - 1;
+
+    private: TraceRecord _trace[TRACE_SIZE];
+
+    private: uint16_t _traceHead = 0;               // The sequence number of the next record
+
+    private: bool _traceWrapped = false;            // True once the ring has been filled
+#endif
+
+    // Responses are built by Poll() in the "back" slot while the interrupt
+    // handler sends from the "front" (sending) slot. Committing a response 
+    // publishes the back slot as the ready slot with a single index store,
+    // and the interrupt handler takes the ready slot as its new front slot.
+    private: static const byte NO_RESPONSE_SLOT = 0xFF;
+
+    private: byte _responseSlots[RESPONSE_SLOT_COUNT][RESPONSE_SIZE];
+
+    private: byte _backSlot;                // Slot being written by Poll()
+
+    private: volatile byte _readySlot;      // Slot holding the published response
+
+    private: volatile byte _sendingSlot;    // Slot being read by the interrupt handler
+
+#if COMMANDBUS_POOL_BLOCKS > 0
+    // Storage for responses too big for a response slot. A pooled response is
+    // published through _pReadyPooledResponse (only one of it and _readySlot
+    // is ever set) and its block is freed once it has been sent.
+    private: CommandPool<POOL_BLOCK_COUNT, POOL_BLOCK_SIZE> _responsePool;
+
+    private: byte* volatile _pReadyPooledResponse = NULL;
+
+    private: byte* _pSendingPooledResponse = NULL;
+#endif
+
+#if COMMANDBUS_INLINE_HANDLERS
+    // Inline-safe commands are received into their own buffer (so they can be
+    // handled even when the command queue is full) and respond through
+    // _pImmediateResponse from their own response buffer
+    private: byte _inlineCommand[COMMAND_SLOT_SIZE];
+
+    private: byte _inlineResponse[RESPONSE_SIZE];
+
+    private: bool _inlineDispatching = false;   // True while an inline-safe handler is running
+#endif
+
+    // When set, responses are written to this buffer instead of a response 
+    // slot and are not published (used to collect the responses of commands
+    // that are dispatched on behalf of another command)
+    private: byte* _pCaptureBuffer;
+
+#if COMMANDBUS_RESPONSE_CACHE_SIZE > 0
+    // Pre-built responses to idempotent commands. Entries are never changed
+    // once added, and are published by incrementing _cachedResponseCount, so
+    // the interrupt handler can read them without any locking.
+    private: struct CachedResponse
+    {
+        byte CommandCode;
+        byte Response[CACHED_RESPONSE_SIZE];
+    };
+
+    private: CachedResponse _responseCache[RESPONSE_CACHE_SIZE];
+
+    private: volatile byte _cachedResponseCount = 0;
+#endif
+
+    // The deferred response list is indexed directly by the low bits of the
+    // ResponseID. The remaining high bits hold a generation count that is
+    // bumped each time a slot is reused, so a stale ResponseID never matches.
+    private: static const byte DEFERRED_INDEX_MASK = DEFERRED_RESPONSE_LIST_SIZE - 1;
+
+    private: static const byte NO_DEFERRED_INDEX = 0xFF;
+
+    private: enum ResponseItemState : byte { ITEM_FREE, ITEM_PENDING, ITEM_READY };
+
+    private: struct ResponseItem 
+    {
+        volatile ResponseItemState State;
+        byte ResponseID;                // ResponseID of the current (or last) use of this slot
+        byte CommandCode;               // Command code of the deferred command
+#if COMMANDBUS_TIMING_CODES > 0
+        unsigned long DeferTime;        // When the command was deferred (micros)
+        uint16_t ReadyInMs;             // The estimated handling time given to the master
+#endif
+#if COMMANDBUS_PUSH
+        bool Notified = false;          // True once the master has been told the response is ready
+#endif
+#if COMMANDBUS_PIPELINE
+        byte Tag = 0;                   // The master's tag for a pipelined command (0 if not pipelined)
+#endif
+        byte Response[RESPONSE_SIZE];   // The completed response
+#if COMMANDBUS_POOL_BLOCKS > 0
+        byte* pPooledResponse;          // The completed response, if it is too big for Response
+#endif
       
-        // ResponseItem() : InUse(false), pResponse(NULL) { };
-    // };
+#if COMMANDBUS_POOL_BLOCKS > 0
+        ResponseItem() : State(ITEM_FREE), ResponseID(0), CommandCode(CMD_NONE), pPooledResponse(NULL) { };
+
+        const CommandResponse* GetResponse() const { return (const CommandResponse*)((pPooledResponse != NULL) ? pPooledResponse : Response); };
+#else
+        ResponseItem() : State(ITEM_FREE), ResponseID(0), CommandCode(CMD_NONE) { };
+
+        const CommandResponse* GetResponse() const { return (const CommandResponse*)Response; };
+#endif
+    };
+
+    private: ResponseItem _deferredResponseList[DEFERRED_RESPONSE_LIST_SIZE];
+
+    private: byte _nextDeferredIndex;
+
+#if COMMANDBUS_PIPELINE
+    // A pipelined command is dispatched with its responses captured straight
+    // into its own deferred response slot. If its handler defers the response
+    // then that slot is used for it, rather than allocating another one.
+    private: byte _taggedIndex = NO_DEFERRED_INDEX;    // Slot of the pipelined command being dispatched
+
+    private: bool _taggedDeferred = false;             // True if its handler deferred the response
+#endif
+
+#if COMMANDBUS_TIMING_CODES > 0
+    // The learned handling times of deferred commands (a running average),
+    // for the most recently deferred command codes
+    private: struct CommandTiming
+    {
+        byte CommandCode;
+        uint16_t EstimateMs;
+    };
+
+    private: CommandTiming _commandTimings[TIMING_CODE_COUNT];
+
+    private: byte _commandTimingCount = 0;
+
+    private: byte _nextCommandTiming = 0;           // The entry to replace when the list is full
+
+    // The CMD_RESPONSE_NOTREADY response to a CMD_QUERY_RESPONSE, with its hint
+    private: CommandResponseNotReady _notReadyResponse;
+#endif
+
+#if COMMANDBUS_FLOW_CONTROL
+    // The response to CMD_QUERY_STATUS, built by the receive interrupt handler
+    private: CommandResponseStatus _statusResponse;
+#endif
+
+    // Response set by the receive interrupt handler to answer the command
+    // it was just sent, without waiting for Poll()
+    private: const CommandResponse* volatile _pImmediateResponse;
+
+    // Deferred response slot to release once _pImmediateResponse is sent
+    private: volatile byte _immediateDeferredIndex;
+
+    // Deferred response slot being read by the interrupt handler
+    private: byte _sendingDeferredIndex;
+
+    // The response being streamed by SendResponse(), and how much of it has been sent
+    private: const byte* _pSendResponse;
+
+    private: byte _sendCursor;
 
-    //private: ResponseItem _deferredResponseList[DEFERRED_RESPONSE_LIST_SIZE];
+    private: byte _sendCRC;
 };
 
 #endif
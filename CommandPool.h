@@ -0,0 +1,101 @@
+/*******************************************************************************
+ CommandPool.h
+
+ Defines a fixed-block memory pool for response storage. The pool is sized at
+ compile time and never touches the heap, so long uptimes can't fragment the
+ free memory of small devices.
+*******************************************************************************/
+#ifndef _CommandPool_h_
+#define _CommandPool_h_
+
+#include <Arduino.h>
+#include "CommandBusConfig.h"
+
+
+//****************************************************************************
+/// A pool of COUNT memory blocks, each BLOCK_SIZE bytes long.
+///
+/// Free blocks are kept on a linked list threaded through the first byte of
+/// each free block, so Allocate() and Free() are O(1) and the list costs no
+/// extra memory. Both run in a critical section, so blocks can be allocated
+/// and freed from an interrupt handler as well as from the main loop.
+//****************************************************************************
+template <byte COUNT, byte BLOCK_SIZE> class CommandPool
+{
+    static_assert(COUNT > 0 && COUNT < 0xFF, "CommandPool COUNT must be between 1 and 254");
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: CommandPool() { Clear(); };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: static const byte Capacity = COUNT;
+
+    public: static const byte BlockSize = BLOCK_SIZE;
+
+    public: byte FreeCount() const { return _freeCount; };
+
+    public: bool IsEmpty() const { return _freeCount == 0; };
+
+    /// Returns true if the memory is a block from this pool.
+    public: bool Owns(const void* pBlock) const
+    {
+        return (const byte*)pBlock >= _blocks[0] && (const byte*)pBlock < _blocks[0] + sizeof(_blocks);
+    };
+
+    /// Returns a free block, or NULL if every block is in use.
+    public: byte* Allocate()
+    {
+        byte* pBlock = NULL;
+
+        COMMANDBUS_ATOMIC_BEGIN
+        if (_freeHead != NO_BLOCK)
+        {
+            pBlock = _blocks[_freeHead];
+            _freeHead = pBlock[0];
+            _freeCount--;
+        }
+        COMMANDBUS_ATOMIC_END
+
+        return pBlock;
+    };
+
+    /// Returns a block from Allocate() to the pool. Freeing NULL does nothing.
+    public: void Free(void* pBlock)
+    {
+        if (pBlock == NULL) return;
+
+        byte index = (byte)(((byte*)pBlock - _blocks[0]) / BLOCK_SIZE);
+
+        COMMANDBUS_ATOMIC_BEGIN
+        _blocks[index][0] = _freeHead;
+        _freeHead = index;
+        _freeCount++;
+        COMMANDBUS_ATOMIC_END
+    };
+
+    /// Returns every block to the pool. Only call this when no blocks are in use.
+    public: void Clear()
+    {
+        for (byte i = 0; i < COUNT; i++) _blocks[i][0] = (i + 1 < COUNT) ? i + 1 : NO_BLOCK;
+
+        _freeHead  = 0;
+        _freeCount = COUNT;
+    };
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: static const byte NO_BLOCK = 0xFF;
+
+    private: byte _blocks[COUNT][BLOCK_SIZE];
+
+    private: volatile byte _freeHead;
+
+    private: volatile byte _freeCount;
+};
+
+#endif
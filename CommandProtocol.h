@@ -9,6 +9,73 @@
 #include <inttypes.h>
 
 
+//****************************************************************************
+// Message layout
+//
+// Messages are overlayed on byte buffers and sent over the bus as they are,
+// so every message struct is packed (no padding, alignment of 1) and its 
+// wire size is checked with a static_assert. Multi-byte fields are declared
+// as LittleEndian<T>, which stores the value as bytes in little-endian order
+// and reads and writes it a byte at a time. This gives the same layout on
+// every target, and never does an unaligned multi-byte access (which is
+// slow, or faults, on some ARM cores).
+//****************************************************************************
+#ifndef COMMANDBUS_PACKED
+#define COMMANDBUS_PACKED __attribute__((packed))
+#endif
+
+
+/// Reads count bytes stored in little-endian order (up to 4)
+constexpr uint32_t ReadLittleEndianBytes(const byte* pBytes, const byte count)
+{
+    return (count == 0) ? 0 : ((uint32_t)pBytes[count - 1] << (8 * (count - 1))) | ReadLittleEndianBytes(pBytes, count - 1);
+}
+
+
+/// Reads a value of type T stored in little-endian order
+template <class T> constexpr T ReadLittleEndian(const byte* pBytes)
+{
+    return (T)ReadLittleEndianBytes(pBytes, sizeof(T));
+}
+
+
+/// Stores a value of type T in little-endian order
+template <class T> inline void WriteLittleEndian(byte* pBytes, const T value)
+{
+    for (byte i = 0; i < sizeof(T); i++) pBytes[i] = (byte)((uint32_t)value >> (8 * i));
+}
+
+
+//****************************************************************************
+/// A multi-byte integer message field, stored in little-endian order with an
+/// alignment of 1. It converts to and from T, so it is used like a T field:
+///
+///     pResponse->MaxLatency = latency;
+//****************************************************************************
+template <class T> struct COMMANDBUS_PACKED LittleEndian
+{
+    static_assert(sizeof(T) <= sizeof(uint32_t), "LittleEndian fields can be at most 32 bits");
+
+    byte Bytes[sizeof(T)];
+
+    LittleEndian(const T value=0) { Set(value); };
+
+    T Get() const { return ReadLittleEndian<T>(Bytes); };
+
+    void Set(const T value) { WriteLittleEndian(Bytes, value); };
+
+    operator T() const { return Get(); };
+
+    LittleEndian& operator=(const T value) { Set(value); return *this; };
+};
+
+
+//****************************************************************************
+// The I2C general call (broadcast) address
+//****************************************************************************
+const byte I2C_GENERAL_CALL_ADDRESS = 0x00;
+
+
 //****************************************************************************
 // Common command codes
 //****************************************************************************
@@ -19,6 +86,15 @@ const byte CMD_RESET_DEVICE      = 0x03;    // Commands a slave device to reset
 const byte CMD_MASTER_ADDR       = 0x04;    // Informs a slave device of the master's I2C address - may be broadcast
 const byte CMD_EXECUTE           = 0x05;    // Send command string to master to execute
 const byte CMD_ECHO              = 0x06;    // Commands slave to echo the command data
+const byte CMD_BATCH             = 0x07;    // Carries several commands in a single message
+const byte CMD_QUERY_STATS       = 0x08;    // Queries the performance statistics of a slave device
+const byte CMD_NOTIFY            = 0x09;    // Pushed by a slave device to the master's address (push mode)
+const byte CMD_TAGGED            = 0x0A;    // Carries a pipelined command, tagged by the master
+const byte CMD_COLLECT           = 0x0B;    // Collects the responses of pipelined commands that are ready
+const byte CMD_QUERY_HISTOGRAM   = 0x0C;    // Queries a page of the handler latency histograms of a slave device
+const byte CMD_RESET_HISTOGRAM   = 0x0D;    // Clears the handler latency histograms of a slave device
+const byte CMD_QUERY_STATUS      = 0x0E;    // Queries how much room a slave device has for more commands
+const byte CMD_QUERY_TRACE       = 0x0F;    // Reads part of the bus trace recorded by a slave device
 
 //****************************************************************************
 // Common Notification codes
@@ -26,6 +102,24 @@ const byte CMD_ECHO              = 0x06;    // Commands slave to echo the comman
 const byte NOTIFY_CMD_INVALID    = 0xFE;    // Invalid command sent
 
 
+//****************************************************************************
+// Bus trace events (see CommandTraceRecord): a direction bit ORed with an
+// outcome
+//****************************************************************************
+const byte TRACE_DIRECTION_RX    = 0x00;    // A command received from the master
+const byte TRACE_DIRECTION_TX    = 0x80;    // A response sent to the master
+const byte TRACE_OUTCOME_MASK    = 0x7F;
+
+const byte TRACE_QUEUED          = 0x01;    // Command queued for Poll()
+const byte TRACE_HANDLED         = 0x02;    // Command handled by Poll()
+const byte TRACE_IMMEDIATE       = 0x03;    // Command handled in the receive interrupt handler
+const byte TRACE_BUSY            = 0x04;    // Command rejected with CMD_RESPONSE_BUSY
+const byte TRACE_DROPPED         = 0x05;    // Command discarded without a response
+const byte TRACE_CORRUPT         = 0x06;    // Command failed its CRC check
+const byte TRACE_RESPONSE        = 0x07;    // Response sent
+const byte TRACE_NOTREADY        = 0x08;    // CMD_RESPONSE_NOTREADY sent (no response was ready)
+
+
 //****************************************************************************
 // Common response codes
 //****************************************************************************
@@ -35,6 +129,29 @@ const byte CMD_RESPONSE_NOTREADY = 0x02;    // Indicates that a response is not
 const byte CMD_RESPONSE_BUSY     = 0x03;    // Indicates that the slave device could not process the current command because it is busy
 const byte CMD_RESPONSE_ERROR    = 0x04;    // Indicates that there was some error in processing the current command
 const byte CMD_RESPONSE_UNKNOWN  = 0x05;    // Indicates that the command was not recognized
+const byte CMD_RESPONSE_CORRUPT  = 0x06;    // Indicates that the command failed its CRC check and should be resent
+
+
+//****************************************************************************
+/// Copies a string into the variable length payload at the end of a message,
+/// writing only the bytes used (at most maxLength characters, truncated to fit
+/// the capacity of the payload field, plus the terminator) rather than the
+/// whole field. Returns the number of bytes written.
+//****************************************************************************
+inline byte CopyPayloadString(char* pPayload, const byte capacity, const char* pString, const byte maxLength=0xFF)
+{
+    byte count = 0;
+
+    while (count < capacity - 1 && count < maxLength && pString[count] != '\0')
+    {
+        pPayload[count] = pString[count];
+        count++;
+    }
+
+    pPayload[count++] = '\0';
+
+    return count;
+}
 
 
 //****************************************************************************
@@ -47,7 +164,7 @@ const byte CMD_RESPONSE_UNKNOWN  = 0x05;    // Indicates that the command was no
 ///       that the field layout is EXACTLY as specified in the struct without
 ///       any hidden fields (i.e., virtual) interfering with that layout.
 //****************************************************************************
-struct CommandMessage
+struct COMMANDBUS_PACKED CommandMessage
 {
     byte Length;        // The length of the command, in bytes
     byte CommandCode;   // Command code
@@ -55,33 +172,270 @@ struct CommandMessage
     CommandMessage(const byte commandCode=0) : CommandCode(commandCode) { Length = sizeof(*this); };
 };
 
+static_assert(sizeof(CommandMessage) == 2, "CommandMessage has the wrong wire size");
+
+
+//****************************************************************************
+/// The Master Address command request
+///
+/// Informs a slave device of the master's I2C address. This command may be
+/// broadcast to all slave devices using the general call address, and no
+/// response is sent.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandMasterAddress : public CommandMessage
+{
+    byte MasterAddress;        // The I2C address of the master
+
+    CommandMasterAddress(const byte masterAddress) : CommandMessage(CMD_MASTER_ADDR), MasterAddress(masterAddress) { Length = sizeof(*this); };
+};
+
+static_assert(sizeof(CommandMasterAddress) == 3, "CommandMasterAddress has the wrong wire size");
+
 
-struct CommandExecute : public CommandMessage
+//****************************************************************************
+/// The Execute command request
+///
+/// This is a variable length message: Length covers the header and only the
+/// used part of CommandLine (including its terminator), so a short command 
+/// line puts only a few bytes on the bus.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandExecute : public CommandMessage
 {
     byte RequestorAddress;
-    char CommandLine[27];        // The command line to execute
+    char CommandLine[27];        // The command line to execute (up to 26 characters)
 
     CommandExecute(byte requestorAddr, const char* commandLine) : CommandMessage(CMD_EXECUTE), RequestorAddress(requestorAddr) 
     { 
-        Length = sizeof(*this); 
-        memset(CommandLine, 0, sizeof(CommandLine));
-        strncpy(CommandLine, commandLine, sizeof(CommandLine)-1); 
+        Length = HeaderLength() + CopyPayloadString(CommandLine, sizeof(CommandLine), commandLine); 
     }
+
+    /// The length of the fixed part of the message, ahead of CommandLine
+    byte HeaderLength() const { return (byte)((const byte*)CommandLine - (const byte*)this); };
 };
 
+static_assert(sizeof(CommandExecute) == 30, "CommandExecute has the wrong wire size");
+
 
-struct CommandEcho : public CommandMessage
+//****************************************************************************
+/// The Echo command request
+///
+/// This is a variable length message: Length covers the header and only the
+/// used part of EchoData (including its terminator).
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandEcho : public CommandMessage
 {
-    char EchoData[27];        // The data to echo
+    char EchoData[27];        // The data to echo (up to 26 characters)
 
     CommandEcho(const char* echoData) : CommandMessage(CMD_ECHO) 
     { 
-        Length = sizeof(*this); 
-        memset(EchoData, 0, sizeof(EchoData));
-        strncpy(EchoData, echoData, sizeof(EchoData)-1); 
+        Length = HeaderLength() + CopyPayloadString(EchoData, sizeof(EchoData), echoData); 
     }
+
+    /// The length of the fixed part of the message, ahead of EchoData
+    byte HeaderLength() const { return (byte)((const byte*)EchoData - (const byte*)this); };
+};
+
+static_assert(sizeof(CommandEcho) == 29, "CommandEcho has the wrong wire size");
+
+
+//****************************************************************************
+/// The batch command request
+///
+/// Carries several complete command messages (each starting with its own
+/// Length byte) in a single message, so that a burst of small commands costs
+/// one bus transaction instead of one each. The slave device handles the 
+/// commands in order and replies with a single CommandResponseBatch.
+///
+/// CMD_MASTER_ADDR can be batched, but CMD_QUERY_RESPONSE and CMD_QUERY_STATUS
+/// can't (their responses would be thrown away), and neither can CMD_BATCH
+/// or CMD_TAGGED. A batched command that would defer its response is given
+/// CMD_RESPONSE_ERROR instead, since its response could never be queried.
+///
+/// Length starts out as the size of the empty batch and grows as commands are
+/// added, so only the bytes actually used are sent.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandBatch : public CommandMessage
+{
+    byte Commands[30];        // The batched command messages
+
+    CommandBatch() : CommandMessage(CMD_BATCH) { };
+
+    /// Appends a command to the batch. Returns false if it doesn't fit.
+    bool Add(const CommandMessage* pCommand)
+    {
+        if (pCommand->Length > sizeof(*this) - Length) return false;
+
+        memcpy(((byte*)this) + Length, (const byte*)pCommand, pCommand->Length);
+        Length += pCommand->Length;
+
+        return true;
+    }
+};
+
+static_assert(sizeof(CommandBatch) == 32, "CommandBatch has the wrong wire size");
+
+
+//****************************************************************************
+/// A command with binary, typed parameters
+///
+/// An application command whose parameters are sent as typed binary fields 
+/// (integers and floats, in little-endian order) rather than as text, so
+/// neither end has to format or parse strings. SchemaID identifies the types
+/// and order of the parameters, so the receiver can check that it decodes
+/// them the way the sender encoded them. Use a CommandSchema (see
+/// CommandSchema.h) to encode and decode the parameters.
+///
+/// This is a variable length message: Length covers the header and only the
+/// encoded parameters.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandTyped : public CommandMessage
+{
+    byte SchemaID;              // Identifies the layout of Parameters
+    byte Parameters[29];        // The encoded parameters
+
+    CommandTyped(const byte commandCode=CMD_NONE, const byte schemaID=0) : CommandMessage(commandCode), SchemaID(schemaID) { Length = HeaderLength(); };
+
+    /// The length of the fixed part of the message, ahead of Parameters
+    byte HeaderLength() const { return (byte)((const byte*)Parameters - (const byte*)this); };
+};
+
+static_assert(sizeof(CommandTyped) == 32, "CommandTyped has the wrong wire size");
+
+
+//****************************************************************************
+/// The tagged (pipelined) command request
+///
+/// Carries a complete command message with a tag assigned by the master, so
+/// the master can send several commands without reading each response. The
+/// slave device doesn't post a response to the tagged command itself; its
+/// handler's response is held (keyed by the tag) until the master collects it
+/// with CMD_COLLECT, so a fast command is never held up behind a slow,
+/// deferred one. Tags must be non-zero, and unique among the master's
+/// pipelined commands to the slave device.
+///
+/// This is a variable length message: Length covers the header and the
+/// carried command.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandTagged : public CommandMessage
+{
+    byte Tag;                   // The master's tag for the command
+    byte Command[29];           // The carried command message
+
+    CommandTagged(const byte tag=0, const CommandMessage* pCommand=NULL) : CommandMessage(CMD_TAGGED), Tag(tag) 
+    { 
+        Length = HeaderLength();
+
+        if (pCommand != NULL && pCommand->Length <= sizeof(Command))
+        {
+            memcpy(Command, (const byte*)pCommand, pCommand->Length);
+            Length += pCommand->Length;
+        }
+    }
+
+    /// The length of the fixed part of the message, ahead of Command
+    byte HeaderLength() const { return (byte)((const byte*)Command - (const byte*)this); };
+
+    const CommandMessage* GetCommand() const { return (const CommandMessage*)Command; };
+};
+
+static_assert(sizeof(CommandTagged) == 32, "CommandTagged has the wrong wire size");
+
+
+//****************************************************************************
+/// The notification pushed by a slave device to the master
+///
+/// In push mode (see CommandListener::EnablePush()), a slave device that has
+/// been told the master's address with CMD_MASTER_ADDR becomes a bus master
+/// itself from time to time, and writes this message to the master's address
+/// rather than waiting to be polled. It coalesces everything that changed
+/// since the last notification: the ResponseIDs of deferred responses that
+/// are now ready to be read, followed by the device's latest telemetry data
+/// (if any).
+///
+/// This is a variable length message: Length covers the header, the ready
+/// ResponseIDs and the telemetry data.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandNotify : public CommandMessage
+{
+    byte SourceAddress;         // The I2C address of the slave device that sent the notification
+    byte ReadyCount;            // The number of ResponseIDs at the start of Data
+    byte Data[28];              // The ready ResponseIDs, then the telemetry data
+
+    CommandNotify(const byte sourceAddress=0) : CommandMessage(CMD_NOTIFY), SourceAddress(sourceAddress), ReadyCount(0) { Length = HeaderLength(); };
+
+    /// The length of the fixed part of the message, ahead of Data
+    byte HeaderLength() const { return (byte)((const byte*)Data - (const byte*)this); };
+
+    /// Appends the ResponseID of a ready deferred response. ResponseIDs must
+    /// be added ahead of the telemetry data. Returns false if it doesn't fit.
+    bool AddReady(const byte responseID)
+    {
+        if (Length >= sizeof(*this) || TelemetryLength() > 0) return false;
+
+        Data[ReadyCount++] = responseID;
+        Length++;
+
+        return true;
+    }
+
+    /// Appends the telemetry data. Returns false if it doesn't fit.
+    bool SetTelemetry(const byte* pTelemetry, const byte length)
+    {
+        if (length > sizeof(*this) - Length) return false;
+
+        memcpy(((byte*)this) + Length, pTelemetry, length);
+        Length += length;
+
+        return true;
+    }
+
+    const byte* ReadyResponseIDs() const { return Data; };
+
+    const byte* Telemetry() const { return Data + ReadyCount; };
+
+    byte TelemetryLength() const { return Length - HeaderLength() - ReadyCount; };
+};
+
+static_assert(sizeof(CommandNotify) == 32, "CommandNotify has the wrong wire size");
+
+
+//****************************************************************************
+/// The Query Histogram command request
+///
+/// Asks for one page of the handler latency histograms kept by a slave device
+/// that was built with COMMANDBUS_HISTOGRAM_CODES enabled. Each command code's
+/// histogram takes one or more pages; the response says how many pages there
+/// are in all, so the master reads pages 0, 1, ... until it has them all.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandQueryHistogram : public CommandMessage
+{
+    byte Page;              // The page to read
+
+    CommandQueryHistogram(const byte page=0) : CommandMessage(CMD_QUERY_HISTOGRAM), Page(page) { Length = sizeof(*this); };
+};
+
+static_assert(sizeof(CommandQueryHistogram) == 3, "CommandQueryHistogram has the wrong wire size");
+
+
+//****************************************************************************
+/// The Query Trace command request
+///
+/// Reads the bus trace recorded by a slave device that was built with
+/// COMMANDBUS_TRACE_SIZE enabled, starting from the record with a sequence
+/// number. Every record is given the next sequence number (wrapping at 
+/// 0xFFFF), so the master reads from 0, then from the sequence number after
+/// the last record it got, until it reaches Head. A gap in sequence numbers
+/// means records were overwritten before they were read.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandQueryTrace : public CommandMessage
+{
+    LittleEndian<uint16_t> Sequence;    // The sequence number of the first record to read
+
+    CommandQueryTrace(const uint16_t sequence=0) : CommandMessage(CMD_QUERY_TRACE), Sequence(sequence) { Length = sizeof(*this); };
 };
 
+static_assert(sizeof(CommandQueryTrace) == 4, "CommandQueryTrace has the wrong wire size");
+
 
 //****************************************************************************
 /// The Query Response Ready command request
@@ -96,14 +450,16 @@ struct CommandEcho : public CommandMessage
 /// CMD_RESPONSE_DEFERRED response so that it can re-query the device at a later 
 /// time for the response.
 //****************************************************************************
-struct CommandQueryResponseReady : public CommandMessage
+struct COMMANDBUS_PACKED CommandQueryResponseReady : public CommandMessage
 {
     byte ResponseID;        // The ID of the response this request is for
     byte OriginalCommand;   // The command code of the original request that was deferred
 
-    CommandQueryResponseReady(const byte responseID=0) : CommandMessage(CMD_QUERY_RESPONSE), ResponseID(responseID) { Length = sizeof(*this); };
+    CommandQueryResponseReady(const byte responseID=0, const byte originalCommand=CMD_NONE) : CommandMessage(CMD_QUERY_RESPONSE), ResponseID(responseID), OriginalCommand(originalCommand) { Length = sizeof(*this); };
 };
 
+static_assert(sizeof(CommandQueryResponseReady) == 4, "CommandQueryResponseReady has the wrong wire size");
+
 
 //****************************************************************************
 /// The basic structure for a command response over the I2C bus. This is used
@@ -117,7 +473,7 @@ struct CommandQueryResponseReady : public CommandMessage
 ///       that the field layout is EXACTLY as specified in the struct without
 ///       any hidden fields (i.e., virtual) interfering with that layout.
 //****************************************************************************
-struct CommandResponse
+struct COMMANDBUS_PACKED CommandResponse
 {
     byte Length;        // The length of the response, in bytes
     byte ResponseCode;  // Command Response code (one of CMD_RESPONSE_* values)
@@ -126,6 +482,8 @@ struct CommandResponse
     CommandResponse(const byte responseCode=CMD_RESPONSE_OK, const byte responseID=0) : ResponseCode(responseCode), ResponseID(responseID) { Length = sizeof(*this); };
 };
 
+static_assert(sizeof(CommandResponse) == 3, "CommandResponse has the wrong wire size");
+
 
 //****************************************************************************
 /// The response to the CMD_QUERY_ID command
@@ -133,13 +491,285 @@ struct CommandResponse
 /// This response is sent for the CMD_QUERY_ID to reply with the ID of the slave
 /// device.
 //****************************************************************************
-struct CommandResponseQueryID : public CommandResponse
+struct COMMANDBUS_PACKED CommandResponseQueryID : public CommandResponse
 {
     byte ID;
     
     CommandResponseQueryID(const byte id=0) : ID(id) { Length = sizeof(*this); };
 };
 
+static_assert(sizeof(CommandResponseQueryID) == 4, "CommandResponseQueryID has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_ECHO command
+///
+/// This response is sent for the CMD_ECHO command to reply with the data that
+/// was sent in the command. Like CommandEcho, it is a variable length message.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseEcho : public CommandResponse
+{
+    char EchoData[27];        // The echoed data
+
+    CommandResponseEcho(const char* echoData, const byte maxLength=0xFF) 
+    { 
+        Length = HeaderLength() + CopyPayloadString(EchoData, sizeof(EchoData), echoData, maxLength); 
+    }
+
+    /// The length of the fixed part of the message, ahead of EchoData
+    byte HeaderLength() const { return (byte)((const byte*)EchoData - (const byte*)this); };
+};
+
+static_assert(sizeof(CommandResponseEcho) == 30, "CommandResponseEcho has the wrong wire size");
+
+
+//****************************************************************************
+/// A response with binary, typed values
+///
+/// The response counterpart of CommandTyped: its values are typed binary
+/// fields whose layout is identified by SchemaID. Use a CommandSchema (see
+/// CommandSchema.h) to encode and decode the values.
+///
+/// This is a variable length message: Length covers the header and only the
+/// encoded values.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseTyped : public CommandResponse
+{
+    byte SchemaID;              // Identifies the layout of Values
+    byte Values[28];            // The encoded values
+
+    CommandResponseTyped(const byte schemaID=0) : SchemaID(schemaID) { Length = HeaderLength(); };
+
+    /// The length of the fixed part of the message, ahead of Values
+    byte HeaderLength() const { return (byte)((const byte*)Values - (const byte*)this); };
+};
+
+static_assert(sizeof(CommandResponseTyped) == 32, "CommandResponseTyped has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_BATCH command
+///
+/// Holds the response code of each of the batched commands, in order (or
+/// CMD_RESPONSE_OK for a command that posted no response). Any data in the
+/// individual responses is discarded, so commands whose response data is
+/// needed should not be batched. The response is cut short at the first
+/// malformed command in the batch, which is given CMD_RESPONSE_ERROR.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseBatch : public CommandResponse
+{
+    byte Count;                 // The number of response codes
+    byte ResponseCodes[28];     // The response code of each command in the batch
+
+    CommandResponseBatch() : Count(0) { Length = sizeof(CommandResponse) + sizeof(Count); };
+
+    /// Appends a response code. Returns false if the response is full.
+    bool Add(const byte responseCode)
+    {
+        if (Count >= sizeof(ResponseCodes)) return false;
+
+        ResponseCodes[Count++] = responseCode;
+        Length++;
+
+        return true;
+    }
+};
+
+static_assert(sizeof(CommandResponseBatch) == 32, "CommandResponseBatch has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_COLLECT command
+///
+/// Holds the responses of pipelined (CMD_TAGGED) commands that have completed,
+/// in no particular order, one after another (each starting with its own
+/// Length byte) with its ResponseID set to the command's tag. Each response is
+/// collected only once. InFlight is the number of pipelined commands left on
+/// the slave device: still being handled, or ready but not fitting in this
+/// response. Once it is 0, a pipelined command that was sent ahead of the
+/// CMD_COLLECT but never collected was not accepted (the slave device had no
+/// room for it) and must be sent again.
+///
+/// This is a variable length message: Length covers the header and the
+/// collected responses.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseCollect : public CommandResponse
+{
+    byte InFlight;              // The number of pipelined commands still to be collected
+    byte Count;                 // The number of responses in Responses
+    byte Responses[27];         // The collected responses
+
+    CommandResponseCollect() : InFlight(0), Count(0) { Length = HeaderLength(); };
+
+    /// The length of the fixed part of the message, ahead of Responses
+    byte HeaderLength() const { return (byte)((const byte*)Responses - (const byte*)this); };
+
+    /// Appends the response to the pipelined command with a tag. Returns false
+    /// if it doesn't fit.
+    bool Add(const CommandResponse* pResponse, const byte tag)
+    {
+        if (pResponse->Length > sizeof(*this) - Length) return false;
+
+        auto pCopy = (CommandResponse*)(((byte*)this) + Length);
+
+        memcpy((byte*)pCopy, (const byte*)pResponse, pResponse->Length);
+        pCopy->ResponseID = tag;
+        Length += pResponse->Length;
+        Count++;
+
+        return true;
+    }
+};
+
+static_assert(sizeof(CommandResponseCollect) == 32, "CommandResponseCollect has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_QUERY_STATUS command
+///
+/// Reports how much room a slave device has left for new commands, so the
+/// master can hold back rather than send commands that would only be
+/// answered with CMD_RESPONSE_BUSY. The slave device answers straight from
+/// its receive interrupt handler, so the response can be read at once.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseStatus : public CommandResponse
+{
+    byte FreeCommandSlots;      // Free slots in the command queue
+    byte FreePrioritySlots;     // Free slots in the high priority command queue
+    byte FreeDeferredSlots;     // Free deferred response slots (for deferred and pipelined commands)
+
+    CommandResponseStatus(const byte freeCommandSlots=0, const byte freePrioritySlots=0, const byte freeDeferredSlots=0) : 
+        FreeCommandSlots(freeCommandSlots), FreePrioritySlots(freePrioritySlots), FreeDeferredSlots(freeDeferredSlots) 
+    { 
+        Length = sizeof(*this); 
+    };
+};
+
+static_assert(sizeof(CommandResponseStatus) == 6, "CommandResponseStatus has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_QUERY_STATS command
+///
+/// Reports the performance statistics kept by a slave device that was built
+/// with COMMANDBUS_STATS enabled. Times are in microseconds. Latency is the
+/// time from a command being received to its response being ready.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseStats : public CommandResponse
+{
+    LittleEndian<uint16_t> CommandsReceived; // Commands received
+    LittleEndian<uint16_t> CommandsDropped;  // Commands discarded without a response (queue full or too big)
+    LittleEndian<uint16_t> BusyResponses;    // CMD_RESPONSE_BUSY responses sent
+    LittleEndian<uint32_t> MaxLatency;       // Longest latency
+    LittleEndian<uint32_t> AverageLatency;   // Average latency
+    LittleEndian<uint16_t> MaxIsrTime;       // Longest time spent in the receive/request interrupt handlers
+    byte PeakQueueDepth;                     // Most commands waiting in the command queue at once
+
+    CommandResponseStats() { Length = sizeof(*this); };
+};
+
+static_assert(sizeof(CommandResponseStats) == 20, "CommandResponseStats has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_QUERY_HISTOGRAM command
+///
+/// Holds part of the handler latency histogram of one command code: the
+/// number of times its handler took each range of time to run, from
+/// FirstBucket on. Bucket 0 counts times under 2 microseconds, and bucket n
+/// counts times from 2^n up to 2^(n+1) microseconds, except for the last
+/// bucket, which counts everything longer. Counts stop at 0xFFFF.
+///
+/// This is a variable length message: Length covers the header and only the
+/// BucketCount counts sent (none, if Page is past the last page).
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseHistogram : public CommandResponse
+{
+    byte Page;                              // The page sent
+    byte PageCount;                         // The number of pages in all
+    byte CommandCode;                       // The command code the histogram is for
+    byte FirstBucket;                       // The bucket of the first count
+    byte BucketCount;                       // The number of counts
+    LittleEndian<uint16_t> Counts[12];      // The count in each bucket, from FirstBucket on
+
+    CommandResponseHistogram(const byte page=0, const byte pageCount=0) : Page(page), PageCount(pageCount), CommandCode(CMD_NONE), FirstBucket(0), BucketCount(0) 
+    { 
+        Length = HeaderLength(); 
+    };
+
+    /// The length of the fixed part of the message, ahead of Counts
+    byte HeaderLength() const { return (byte)((const byte*)Counts - (const byte*)this); };
+
+    /// Appends the count of the next bucket. Returns false if the page is full.
+    bool Add(const uint16_t count)
+    {
+        if (BucketCount >= sizeof(Counts) / sizeof(Counts[0])) return false;
+
+        Counts[BucketCount++] = count;
+        Length += sizeof(Counts[0]);
+
+        return true;
+    }
+};
+
+static_assert(sizeof(CommandResponseHistogram) == 32, "CommandResponseHistogram has the wrong wire size");
+
+
+//****************************************************************************
+/// A bus trace record, for one frame received or sent by a slave device (or
+/// for a command being handled by Poll())
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandTraceRecord
+{
+    LittleEndian<uint32_t> Time;        // When it happened (micros)
+    byte Event;                         // TRACE_DIRECTION_* | TRACE_* outcome
+    byte Code;                          // The CommandCode (received) or ResponseCode (sent)
+    byte Length;                        // The length of the message
+};
+
+static_assert(sizeof(CommandTraceRecord) == 7, "CommandTraceRecord has the wrong wire size");
+
+
+//****************************************************************************
+/// The response to the CMD_QUERY_TRACE command
+///
+/// Holds up to 3 consecutive trace records, from the oldest record still held
+/// at or after the requested sequence number.
+///
+/// This is a variable length message: Length covers the header and only the
+/// Count records sent.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseTrace : public CommandResponse
+{
+    LittleEndian<uint16_t> Sequence;    // The sequence number of the first record
+    LittleEndian<uint16_t> Head;        // The sequence number the next record will be given
+    byte Count;                         // The number of records
+    CommandTraceRecord Records[3];      // The records
+
+    CommandResponseTrace(const uint16_t sequence=0, const uint16_t head=0) : Sequence(sequence), Head(head), Count(0) { Length = HeaderLength(); };
+
+    /// The length of the fixed part of the message, ahead of Records
+    byte HeaderLength() const { return (byte)((const byte*)Records - (const byte*)this); };
+
+    /// Appends the next record. Returns false if the response is full.
+    bool Add(const uint32_t time, const byte event, const byte code, const byte length)
+    {
+        if (Count >= sizeof(Records) / sizeof(Records[0])) return false;
+
+        auto& record = Records[Count++];
+
+        record.Time   = time;
+        record.Event  = event;
+        record.Code   = code;
+        record.Length = length;
+        Length += sizeof(record);
+
+        return true;
+    }
+};
+
+static_assert(sizeof(CommandResponseTrace) == 29, "CommandResponseTrace has the wrong wire size");
+
 
 //****************************************************************************
 /// The response deferred command response.
@@ -152,11 +782,37 @@ struct CommandResponseQueryID : public CommandResponse
 /// code and the device address of the slave device so that the master can re-query 
 /// the device at a later time for the response (via the CMD_QUERY_RESPONSE
 /// command.
+///
+/// ReadyInMs is the slave device's estimate of how long the response will
+/// take, learned from how long the same command took before, so the master
+/// can wait that long before its first query rather than polling.
 //****************************************************************************
-struct CommandResponseDeferred : public CommandResponse
+struct COMMANDBUS_PACKED CommandResponseDeferred : public CommandResponse
 {
-    CommandResponseDeferred(const byte responseID=0) : CommandResponse(CMD_RESPONSE_DEFERRED, responseID) { Length = sizeof(*this); };
+    LittleEndian<uint16_t> ReadyInMs;   // Estimated time until the response is ready, in milliseconds (0 if unknown)
+
+    CommandResponseDeferred(const byte responseID=0, const uint16_t readyInMs=0) : CommandResponse(CMD_RESPONSE_DEFERRED, responseID), ReadyInMs(readyInMs) { Length = sizeof(*this); };
 };
 
+static_assert(sizeof(CommandResponseDeferred) == 5, "CommandResponseDeferred has the wrong wire size");
+
+
+//****************************************************************************
+/// The response not ready response.
+///
+/// Sent in response to CMD_QUERY_RESPONSE while a deferred response is still
+/// being worked on, with a hint of how long the master should wait before
+/// querying again. A slave device may also send a plain CommandResponse with
+/// CMD_RESPONSE_NOTREADY (with no hint).
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandResponseNotReady : public CommandResponse
+{
+    LittleEndian<uint16_t> RetryAfterMs;    // Suggested time to wait before querying again, in milliseconds (0 if unknown)
+
+    CommandResponseNotReady(const byte responseID=0, const uint16_t retryAfterMs=0) : CommandResponse(CMD_RESPONSE_NOTREADY, responseID), RetryAfterMs(retryAfterMs) { Length = sizeof(*this); };
+};
+
+static_assert(sizeof(CommandResponseNotReady) == 5, "CommandResponseNotReady has the wrong wire size");
+
 #endif
 
@@ -0,0 +1,88 @@
+/*******************************************************************************
+ CommandQueue.h
+
+ Defines a lock-free, single-producer/single-consumer ring of fixed-size
+ command slots. The producer is the I2C receive interrupt handler and the
+ consumer is CommandListener::Poll(), so neither side ever has to disable
+ interrupts to hand a command over.
+*******************************************************************************/
+#ifndef _CommandQueue_h_
+#define _CommandQueue_h_
+
+#include <Arduino.h>
+#include "CommandBusConfig.h"
+
+
+//****************************************************************************
+/// A fixed capacity ring of SIZE command slots, each SLOT_SIZE bytes long.
+///
+/// The head index is only ever written by the producer and the tail index is
+/// only ever written by the consumer. Both are free running byte counters, so
+/// a single byte store publishes a slot (atomic on every supported target) and
+/// SIZE must be a power of 2 that is no larger than 128.
+///
+/// Producer: Reserve() a slot, fill it in, then Commit() it.
+/// Consumer: Front() to peek at the oldest slot, then Pop() when done with it.
+//****************************************************************************
+template <byte SIZE, byte SLOT_SIZE> class CommandQueue
+{
+    static_assert(SIZE > 0 && SIZE <= 128 && (SIZE & (SIZE - 1)) == 0, "CommandQueue SIZE must be a power of 2 no larger than 128");
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: CommandQueue() : _head(0), _tail(0) { };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: static const byte Capacity = SIZE;
+
+    public: static const byte SlotSize = SLOT_SIZE;
+
+    public: byte Count() const { return (byte)(_head - _tail); };
+
+    public: bool IsEmpty() const { return _head == _tail; };
+
+    public: bool IsFull() const { return Count() >= SIZE; };
+
+    /// Returns the index (0 to SIZE-1) of a slot returned by Reserve() or Front(),
+    /// for keeping per-slot data outside the queue.
+    public: byte IndexOf(const byte* pSlot) const { return (byte)((pSlot - _slots[0]) / SLOT_SIZE); };
+
+    /// Resets the queue to empty. Only call this when the producer is idle.
+    public: void Clear() { _tail = _head; };
+
+    //************************************************************************
+    // Producer side
+    //************************************************************************
+
+    /// Returns the next free slot, or NULL if the queue is full.
+    public: byte* Reserve() { return IsFull() ? NULL : _slots[_head & MASK]; };
+
+    /// Publishes the slot returned by the last call to Reserve().
+    public: void Commit() { COMMANDBUS_BARRIER(); _head = _head + 1; };
+
+    //************************************************************************
+    // Consumer side
+    //************************************************************************
+
+    /// Returns the oldest pending slot, or NULL if the queue is empty.
+    public: const byte* Front() const { return IsEmpty() ? NULL : _slots[_tail & MASK]; };
+
+    /// Releases the slot returned by the last call to Front().
+    public: void Pop() { COMMANDBUS_BARRIER(); _tail = _tail + 1; };
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: static const byte MASK = SIZE - 1;
+
+    private: byte _slots[SIZE][SLOT_SIZE];
+
+    private: volatile byte _head;
+
+    private: volatile byte _tail;
+};
+
+#endif
@@ -0,0 +1,162 @@
+/*******************************************************************************
+ CommandSchema.h
+
+ Defines compile-time schemas for the binary, typed parameters of
+ CommandTyped commands and the typed values of CommandResponseTyped
+ responses. A schema generates the code that encodes and decodes each field,
+ so remote calls pass their arguments without any string formatting or
+ parsing.
+*******************************************************************************/
+#ifndef _CommandSchema_h_
+#define _CommandSchema_h_
+
+#include <Arduino.h>
+#include "CommandProtocol.h"
+
+
+//****************************************************************************
+/// Encodes and decodes a single parameter of type T.
+///
+/// Integers of up to 32 bits are stored in little-endian order. Other types
+/// need a specialization (float is stored as its IEEE-754 bit pattern).
+//****************************************************************************
+template <class T> struct CommandParameter
+{
+    static_assert(sizeof(T) <= sizeof(uint32_t), "CommandParameter integers can be at most 32 bits");
+
+    static const byte Size = sizeof(T);
+
+    static void Write(byte* pBytes, const T value) { WriteLittleEndian(pBytes, value); };
+
+    static T Read(const byte* pBytes) { return ReadLittleEndian<T>(pBytes); };
+};
+
+
+template <> struct CommandParameter<float>
+{
+    static_assert(sizeof(float) == sizeof(uint32_t), "float must be 32 bits");
+
+    static const byte Size = sizeof(float);
+
+    static void Write(byte* pBytes, const float value)
+    {
+        uint32_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+        WriteLittleEndian(pBytes, bits);
+    };
+
+    static float Read(const byte* pBytes)
+    {
+        uint32_t bits = ReadLittleEndian<uint32_t>(pBytes);
+        float value;
+
+        memcpy(&value, &bits, sizeof(value));
+
+        return value;
+    };
+};
+
+
+//****************************************************************************
+/// Encodes and decodes a list of parameters, one after another with no
+/// padding in between.
+//****************************************************************************
+template <class... Params> struct CommandParameterList;
+
+template <> struct CommandParameterList<>
+{
+    static const byte Size = 0;
+
+    static void Encode(byte* pBytes) { };
+
+    static void Decode(const byte* pBytes) { };
+};
+
+template <class T, class... Rest> struct CommandParameterList<T, Rest...>
+{
+    static const byte Size = CommandParameter<T>::Size + CommandParameterList<Rest...>::Size;
+
+    static void Encode(byte* pBytes, const T& value, const Rest&... rest)
+    {
+        CommandParameter<T>::Write(pBytes, value);
+        CommandParameterList<Rest...>::Encode(pBytes + CommandParameter<T>::Size, rest...);
+    };
+
+    static void Decode(const byte* pBytes, T& value, Rest&... rest)
+    {
+        value = CommandParameter<T>::Read(pBytes);
+        CommandParameterList<Rest...>::Decode(pBytes + CommandParameter<T>::Size, rest...);
+    };
+};
+
+
+//****************************************************************************
+/// A schema for the parameters of a CommandTyped command (or the values of a
+/// CommandResponseTyped response): SCHEMA_ID and the types of the fields, in
+/// order. For example:
+///
+///     typedef CommandSchema<0x01, int16_t, int16_t, float> MotorMoveSchema;
+///
+///     // Master
+///     CommandTyped command(CMD_MOTOR_MOVE);
+///     MotorMoveSchema::Encode(command, left, right, speed);
+///
+///     // Slave (in the CMD_MOTOR_MOVE handler)
+///     int16_t left, right;
+///     float speed;
+///     if (!MotorMoveSchema::Decode(pCommand, left, right, speed)) ...
+///
+/// Decode() returns false if the message wasn't encoded with the same schema
+/// (its SchemaID or length doesn't match).
+//****************************************************************************
+template <byte SCHEMA_ID, class... Params> struct CommandSchema
+{
+    typedef CommandParameterList<Params...> Fields;
+
+    static const byte SchemaID = SCHEMA_ID;
+
+    static const byte Size = Fields::Size;
+
+    static_assert(Size <= sizeof(CommandTyped::Parameters), "CommandSchema parameters are too big for a CommandTyped command");
+
+    static void Encode(CommandTyped& command, const Params&... params)
+    {
+        command.SchemaID = SCHEMA_ID;
+        Fields::Encode(command.Parameters, params...);
+        command.Length = command.HeaderLength() + Size;
+    };
+
+    static bool Decode(const CommandMessage* pCommand, Params&... params)
+    {
+        auto pTyped = (const CommandTyped*)pCommand;
+
+        if (pCommand->Length != pTyped->HeaderLength() + Size || pTyped->SchemaID != SCHEMA_ID) return false;
+
+        Fields::Decode(pTyped->Parameters, params...);
+
+        return true;
+    };
+
+    static void Encode(CommandResponseTyped& response, const Params&... params)
+    {
+        static_assert(Size <= sizeof(CommandResponseTyped::Values), "CommandSchema values are too big for a CommandResponseTyped response");
+
+        response.SchemaID = SCHEMA_ID;
+        Fields::Encode(response.Values, params...);
+        response.Length = response.HeaderLength() + Size;
+    };
+
+    static bool Decode(const CommandResponse* pResponse, Params&... params)
+    {
+        auto pTyped = (const CommandResponseTyped*)pResponse;
+
+        if (pResponse->Length != pTyped->HeaderLength() + Size || pTyped->SchemaID != SCHEMA_ID) return false;
+
+        Fields::Decode(pTyped->Values, params...);
+
+        return true;
+    };
+};
+
+#endif
@@ -0,0 +1,47 @@
+/*******************************************************************************
+ Header file for the CommandTransport class.
+*******************************************************************************/
+#ifndef _CommandTransport_h_
+#define _CommandTransport_h_
+
+#include <RTL_StdLib.h>
+#include <RTL_TaskScheduler.h>
+#include "CommandListener.h"
+
+
+//****************************************************************************
+/// Base class for the links a CommandListener can receive commands and send
+/// responses over.
+///
+/// A transport moves the bytes of command and response frames between its
+/// bus and the listener's transport-neutral entry points:
+/// OnCommandReceived() or BeginCommandFrame() / ReceiveCommandByte() /
+/// EndCommandFrame() for commands, and SendResponse() or ReadResponseFrame()
+/// for responses. The frames themselves (CommandMessage / CommandResponse, and
+/// the CRC byte if enabled) are the same on every transport, so handlers
+/// don't know or care which bus a command came in on.
+///
+/// Transports that have to be polled for received bytes do it in Poll(), so
+/// they can be added to the task scheduler like any other EventSource.
+//****************************************************************************
+class CommandTransport : public EventSource
+{
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    protected: CommandTransport(CommandListener& listener) : _listener(listener) { };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: virtual void Begin() = 0;
+
+    public: CommandListener& GetListener() const { return _listener; };
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    protected: CommandListener& _listener;
+};
+
+#endif
@@ -0,0 +1,48 @@
+/*******************************************************************************
+ I2CCommandTransport.cpp
+
+ Implementation file for the I2C command transport class.
+*******************************************************************************/
+#define DEBUG 0
+
+#include <Arduino.h>
+#include <RTL_Debug.h>
+#include "I2CCommandTransport.h"
+
+
+DEFINE_CLASSNAME(I2CCommandTransport);
+
+
+I2CCommandTransport* I2CCommandTransport::_pActiveTransport = NULL;
+
+
+void I2CCommandTransport::Begin()
+{
+    TRACE(Logger(_classname_, __func__, this) << endl);
+
+    _pActiveTransport = this;
+
+    _twi.begin(_slaveAddress);
+    _twi.onReceive(&I2CCommandTransport::OnReceive);
+    _twi.onRequest(&I2CCommandTransport::OnRequest);
+}
+
+
+//****************************************************************************
+// Wire library callbacks
+// NOTE: These are called from an interrupt handler.
+//****************************************************************************
+void I2CCommandTransport::OnReceive(int messageLength)
+{
+    auto pTransport = _pActiveTransport;
+
+    if (pTransport != NULL) pTransport->_listener.OnCommandReceived(pTransport->_twi, messageLength);
+}
+
+
+void I2CCommandTransport::OnRequest()
+{
+    auto pTransport = _pActiveTransport;
+
+    if (pTransport != NULL) pTransport->_listener.SendResponse(pTransport->_twi);
+}
@@ -0,0 +1,53 @@
+/*******************************************************************************
+ Header file for the I2CCommandTransport class.
+*******************************************************************************/
+#ifndef _I2CCommandTransport_h_
+#define _I2CCommandTransport_h_
+
+#include <Wire.h>
+#include "CommandTransport.h"
+
+
+//****************************************************************************
+/// Connects a CommandListener to an I2C bus as a slave device.
+///
+/// Begin() starts the Wire library on the slave address and installs its
+/// receive and request callbacks. The Wire library's callbacks don't take a
+/// context, so only one I2C transport can be active at a time.
+//****************************************************************************
+class I2CCommandTransport : public CommandTransport
+{
+    DECLARE_CLASSNAME;
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: I2CCommandTransport(CommandListener& listener, byte slaveAddress, TwoWire& twi=Wire) :
+        CommandTransport(listener),
+        _twi(twi),
+        _slaveAddress(slaveAddress)
+    {
+    };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void Begin();
+
+    /***************************************************************************
+    Internal implementation
+    ***************************************************************************/
+    private: static void OnReceive(int messageLength);
+    private: static void OnRequest();
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: static I2CCommandTransport* _pActiveTransport;
+
+    private: TwoWire& _twi;
+
+    private: byte _slaveAddress;
+};
+
+#endif
@@ -0,0 +1,132 @@
+/*******************************************************************************
+ SPICommandTransport.cpp
+
+ Implementation file for the SPI slave command transport class.
+*******************************************************************************/
+#define DEBUG 0
+
+#include <Arduino.h>
+#include <RTL_Debug.h>
+#include "SPICommandTransport.h"
+
+
+DEFINE_CLASSNAME(SPICommandTransport);
+
+
+void SPICommandTransport::Begin()
+{
+    TRACE(Logger(_classname_, __func__, this) << endl);
+
+    _state = SPI_MODE;
+
+#if defined(SPCR) && defined(SPE) && defined(SPIE)
+    // Slave mode, with the transfer complete interrupt
+    pinMode(MISO, OUTPUT);
+    SPCR = _BV(SPE) | _BV(SPIE);
+    SPDR = SPI_IDLE_BYTE;
+#endif
+}
+
+
+//****************************************************************************
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+byte SPICommandTransport::OnTransfer(byte data)
+{
+    switch (_state)
+    {
+        case SPI_MODE:
+            if (data == SPI_WRITE_COMMAND)
+            {
+                _state = SPI_COMMAND_LENGTH;
+            }
+            else if (data == SPI_READ_RESPONSE)
+            {
+                _state = SPI_RESPONSE;
+                _remaining = 0;
+
+                return NextResponseByte();
+            }
+        break;
+
+        case SPI_COMMAND_LENGTH:
+            _listener.BeginCommandFrame();
+            _listener.ReceiveCommandByte(data);
+
+            // The rest of the command, and its CRC byte
+            _remaining = (data > 0) ? data - 1 + CommandListener::CRC_SIZE : 0;
+
+            if (_remaining == 0)
+            {
+                _listener.EndCommandFrame();
+                _state = SPI_MODE;
+            }
+            else
+            {
+                _state = SPI_COMMAND;
+            }
+        break;
+
+        case SPI_COMMAND:
+            _listener.ReceiveCommandByte(data);
+
+            if (--_remaining == 0)
+            {
+                _listener.EndCommandFrame();
+                _state = SPI_MODE;
+            }
+        break;
+
+        case SPI_RESPONSE:
+            return NextResponseByte();
+    }
+
+    return SPI_IDLE_BYTE;
+}
+
+
+//****************************************************************************
+// Ends the transaction. A partly received command is passed on to the
+// listener, which drops it. The transport goes back to waiting for a mode
+// byte as soon as a frame is complete anyway, so this only resynchronizes
+// it after a transaction that the master cut short.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+void SPICommandTransport::OnDeselect()
+{
+    if (_state == SPI_COMMAND) _listener.EndCommandFrame();
+
+    _state = SPI_MODE;
+}
+
+
+//****************************************************************************
+// Returns the next byte of the response frame. The Length byte at the start
+// of the frame says how many bytes follow it; a Length byte that can't be a
+// response's (or no frame at all) ends the response at once.
+// NOTE: This method is called from an interrupt handler, so it should do
+//       as little as possible and get out as quickly as possible.
+//****************************************************************************
+byte SPICommandTransport::NextResponseByte()
+{
+    byte data = SPI_IDLE_BYTE;
+    byte count = _listener.ReadResponseFrame(&data, 1);
+
+    if (_remaining == 0)
+    {
+        // The first byte is the Length byte, which says how many bytes follow
+        bool valid = count == 1 && data >= sizeof(CommandResponse) && data <= CommandListener::MAX_RESPONSE_SIZE;
+
+        _remaining = valid ? data - 1 + CommandListener::CRC_SIZE : 0;
+    }
+    else
+    {
+        _remaining--;
+    }
+
+    if (_remaining == 0) _state = SPI_MODE;
+
+    return data;
+}
@@ -0,0 +1,91 @@
+/*******************************************************************************
+ Header file for the SPICommandTransport class.
+*******************************************************************************/
+#ifndef _SPICommandTransport_h_
+#define _SPICommandTransport_h_
+
+#include "CommandTransport.h"
+
+
+//****************************************************************************
+/// Connects a CommandListener to an SPI bus as a slave device.
+///
+/// Each transaction (slave select held low) starts with a mode byte:
+///
+///     SPI_WRITE_COMMAND   followed by the command frame (whose Length byte
+///                         gives the frame's size, plus its CRC byte if
+///                         enabled)
+///
+///     SPI_READ_RESPONSE   after which each byte clocked out is the next byte
+///                         of the response frame. The master reads the Length
+///                         byte first to know how many more bytes to read,
+///                         and sends SPI_IDLE_BYTE while it reads.
+///
+/// The transport waits for the next mode byte as soon as a frame is complete,
+/// so the master must not clock out more bytes than the frame holds.
+///
+/// SPI is full duplex, so the byte for the slave to send is loaded while the
+/// previous byte is being received. The Arduino core has no SPI slave API,
+/// so the sketch forwards the SPI interrupt to the transport. Forwarding the
+/// rising edge of the slave select pin to OnDeselect() as well is optional;
+/// it resynchronizes the transport after a transaction the master abandoned.
+/// On AVR, Begin() enables the SPI peripheral in slave mode with its
+/// interrupt, and the sketch adds:
+///
+///     ISR(SPI_STC_vect) { SPDR = transport.OnTransfer(SPDR); }
+//****************************************************************************
+class SPICommandTransport : public CommandTransport
+{
+    DECLARE_CLASSNAME;
+
+    public: static const byte SPI_WRITE_COMMAND = 0x01;
+
+    public: static const byte SPI_READ_RESPONSE = 0x02;
+
+    public: static const byte SPI_IDLE_BYTE = 0xFF;
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: SPICommandTransport(CommandListener& listener) :
+        CommandTransport(listener),
+        _state(SPI_MODE),
+        _remaining(0)
+    {
+    };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void Begin();
+
+    /// Called from the SPI interrupt handler with each byte received, and
+    /// returns the byte to send in the next transfer.
+    public: byte OnTransfer(byte data);
+
+    /// Called when the master deselects the slave (slave select goes high),
+    /// which ends the transaction.
+    public: void OnDeselect();
+
+    /***************************************************************************
+    Internal implementation
+    ***************************************************************************/
+    private: enum TransferState : byte
+    {
+        SPI_MODE,               // Waiting for the mode byte of a transaction
+        SPI_COMMAND_LENGTH,     // Waiting for the Length byte of a command
+        SPI_COMMAND,            // Receiving the rest of a command
+        SPI_RESPONSE            // Sending a response
+    };
+
+    private: byte NextResponseByte();
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: volatile TransferState _state;
+
+    private: byte _remaining;                   // Bytes left in the current transaction
+};
+
+#endif
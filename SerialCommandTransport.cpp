@@ -0,0 +1,151 @@
+/*******************************************************************************
+ SerialCommandTransport.cpp
+
+ Implementation file for the UART/RS-485 command transport class.
+*******************************************************************************/
+#define DEBUG 0
+
+#include <Arduino.h>
+#include <RTL_Debug.h>
+#include "SerialCommandTransport.h"
+
+
+DEFINE_CLASSNAME(SerialCommandTransport);
+
+
+void SerialCommandTransport::Begin()
+{
+    TRACE(Logger(_classname_, __func__, this) << endl);
+
+    if (_driverEnablePin != NO_DRIVER_ENABLE_PIN)
+    {
+        pinMode(_driverEnablePin, OUTPUT);
+        digitalWrite(_driverEnablePin, LOW);
+    }
+
+    _state = RX_ADDRESS;
+}
+
+
+//****************************************************************************
+// EventSource Poll method override to receive the bytes waiting on the link
+//****************************************************************************
+void SerialCommandTransport::Poll()
+{
+    auto now = COMMANDBUS_MICROS();
+
+    if (_state != RX_ADDRESS && now - _lastReceiveTime > _frameTimeout) AbandonTransaction();
+
+    while (_stream.available() > 0)
+    {
+        ReceiveByte(_stream.read());
+        _lastReceiveTime = now;
+    }
+
+    EventSource::Poll();
+}
+
+
+void SerialCommandTransport::ReceiveByte(byte data)
+{
+    switch (_state)
+    {
+        case RX_ADDRESS:
+        {
+            byte address = data >> 1;
+            bool read = (data & 1) != 0;
+
+            if (address == _slaveAddress || (address == I2C_GENERAL_CALL_ADDRESS && !read))
+            {
+                _state = read ? RX_READ_COUNT : RX_COMMAND_LENGTH;
+            }
+            else
+            {
+                _state = read ? RX_SKIP_COUNT : RX_SKIP_LENGTH;
+            }
+        }
+        break;
+
+        case RX_COMMAND_LENGTH:
+            _listener.BeginCommandFrame();
+            _listener.ReceiveCommandByte(data);
+
+            // The rest of the command, and its CRC byte
+            _remaining = (data > 0) ? data - 1 + CommandListener::CRC_SIZE : 0;
+
+            if (_remaining == 0)
+            {
+                _listener.EndCommandFrame();
+                _state = RX_ADDRESS;
+            }
+            else
+            {
+                _state = RX_COMMAND;
+            }
+        break;
+
+        case RX_COMMAND:
+            _listener.ReceiveCommandByte(data);
+
+            if (--_remaining == 0)
+            {
+                _listener.EndCommandFrame();
+                _state = RX_ADDRESS;
+            }
+        break;
+
+        case RX_READ_COUNT:
+            SendResponse(data);
+            _state = RX_ADDRESS;
+        break;
+
+        case RX_SKIP_LENGTH:
+            _remaining = (data > 0) ? data - 1 + CommandListener::CRC_SIZE : 0;
+            _state = (_remaining > 0) ? RX_SKIP : RX_ADDRESS;
+        break;
+
+        case RX_SKIP_COUNT:
+            _remaining = data;
+            _state = (_remaining > 0) ? RX_SKIP : RX_ADDRESS;
+        break;
+
+        case RX_SKIP:
+            if (--_remaining == 0) _state = RX_ADDRESS;
+        break;
+    }
+}
+
+
+//****************************************************************************
+// Sends the next count bytes of the response frame, padded with 0xFF if the
+// frame ends first
+//****************************************************************************
+void SerialCommandTransport::SendResponse(byte count)
+{
+    byte buffer[TX_WINDOW];
+
+    if (count > TX_WINDOW) count = TX_WINDOW;
+
+    byte length = _listener.ReadResponseFrame(buffer, count);
+
+    memset(buffer + length, 0xFF, count - length);
+
+    if (_driverEnablePin != NO_DRIVER_ENABLE_PIN) digitalWrite(_driverEnablePin, HIGH);
+
+    _stream.write(buffer, count);
+    _stream.flush();
+
+    if (_driverEnablePin != NO_DRIVER_ENABLE_PIN) digitalWrite(_driverEnablePin, LOW);
+}
+
+
+//****************************************************************************
+// Gives up on a transaction that stopped part of the way through. A partly
+// received command is passed on to the listener, which drops it.
+//****************************************************************************
+void SerialCommandTransport::AbandonTransaction()
+{
+    if (_state == RX_COMMAND) _listener.EndCommandFrame();
+
+    _state = RX_ADDRESS;
+}
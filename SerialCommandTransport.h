@@ -0,0 +1,103 @@
+/*******************************************************************************
+ Header file for the SerialCommandTransport class.
+*******************************************************************************/
+#ifndef _SerialCommandTransport_h_
+#define _SerialCommandTransport_h_
+
+#include "CommandTransport.h"
+
+
+//****************************************************************************
+/// Connects a CommandListener to a UART or RS-485 link.
+///
+/// A serial link has no START/STOP conditions, so each transaction is framed
+/// the way it would be on an I2C bus, starting with an address byte:
+///
+///     (address << 1)      followed by the command frame (whose Length byte
+///                         gives the frame's size, plus its CRC byte if
+///                         enabled). Address 0 (I2C_GENERAL_CALL_ADDRESS)
+///                         broadcasts the command to every slave device.
+///
+///     (address << 1) | 1  followed by a count byte, to read the next count
+///                         bytes (at most TX_WINDOW) of the response frame.
+///                         The slave sends exactly count bytes, padded with
+///                         0xFF like an idle I2C bus.
+///
+/// Transactions addressed to other slave devices (and their responses) are
+/// skipped over, so several slave devices can share a multi-drop RS-485 bus.
+/// A gap of more than the frame timeout in the middle of a transaction
+/// abandons it, so the receiver resynchronizes after noise on the line.
+///
+/// For RS-485, pass the pin that enables the line driver; it is driven high
+/// only while a response is being sent.
+///
+/// Bytes are received in Poll(), which must be called often enough to keep
+/// the serial receive buffer from overflowing.
+//****************************************************************************
+class SerialCommandTransport : public CommandTransport
+{
+    DECLARE_CLASSNAME;
+
+    public: static const byte TX_WINDOW = CommandListener::TX_WINDOW;
+
+    public: static const int NO_DRIVER_ENABLE_PIN = -1;
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: SerialCommandTransport(CommandListener& listener, byte slaveAddress, Stream& stream, int driverEnablePin=NO_DRIVER_ENABLE_PIN) :
+        CommandTransport(listener),
+        _stream(stream),
+        _slaveAddress(slaveAddress),
+        _driverEnablePin(driverEnablePin),
+        _state(RX_ADDRESS),
+        _remaining(0),
+        _lastReceiveTime(0),
+        _frameTimeout(COMMANDBUS_SERIAL_FRAME_TIMEOUT)
+    {
+    };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void Begin();
+    public: void Poll();
+    public: void SetFrameTimeout(unsigned long microseconds) { _frameTimeout = microseconds; };
+
+    /***************************************************************************
+    Internal implementation
+    ***************************************************************************/
+    private: enum ReceiveState : byte
+    {
+        RX_ADDRESS,             // Waiting for the address byte of a transaction
+        RX_COMMAND_LENGTH,      // Waiting for the Length byte of a command to this device
+        RX_COMMAND,             // Receiving the rest of a command to this device
+        RX_READ_COUNT,          // Waiting for the count byte of a response read from this device
+        RX_SKIP_LENGTH,         // Waiting for the Length byte of a command to another device
+        RX_SKIP_COUNT,          // Waiting for the count byte of a response read from another device
+        RX_SKIP                 // Skipping the rest of a transaction with another device
+    };
+
+    private: void ReceiveByte(byte data);
+    private: void SendResponse(byte count);
+    private: void AbandonTransaction();
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: Stream& _stream;
+
+    private: byte _slaveAddress;
+
+    private: int _driverEnablePin;
+
+    private: ReceiveState _state;
+
+    private: byte _remaining;                   // Bytes left in the current transaction
+
+    private: unsigned long _lastReceiveTime;
+
+    private: unsigned long _frameTimeout;
+};
+
+#endif
@@ -0,0 +1,672 @@
+/*******************************************************************************
+ Benchmark.cpp
+
+ The listener benchmarks, in two parts.
+
+ The ISR-replay benchmark: each scenario is a script of bus events (a command
+ frame received, a response requested, or a pass of the main loop) that is
+ replayed many times straight into a listener's interrupt-level entry points,
+ timing each kind of event on the host's clock. The numbers are host
+ nanoseconds, so they only compare builds and changes with each other, but
+ the ISR times are what bound the bus's clock stretching on a real device.
+
+ The stream benchmark: each recorded command stream (bursts of setpoints, a
+ CMD_QUERY_RESPONSE storm, a CMD_ECHO flood and mixed traffic) is replayed
+ end to end. A CommandClient on the bus thread sends each command at its
+ recorded time over the loopback bus, whose transactions take as long as
+ they would at the bus clock and run the slave's interrupt handlers on that
+ thread, while the slave's main loop runs Poll() on a thread of its own. For
+ each stream it reports the commands completed per second, the share of
+ command frames the slave refused (answered BUSY or dropped), the commands
+ lost, and percentiles of the latency from each command's recorded time to
+ its response (or, for a setpoint, to its handler). These depend on the
+ host's scheduling of the two threads, most of all on a single-core host.
+
+     bench [bus clock in Hz]
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <Arduino.h>
+#include <RTL_Debug.h>
+#include <Wire.h>
+#include "../CommandListener.h"
+#include "../CommandClient.h"
+#include "../I2CCommandTransport.h"
+
+
+static const long REPLAY_COUNT = 200000;
+
+
+//****************************************************************************
+/// A setpoint for the slave device, which posts no response. Sequence is the
+/// command's index in its stream, so its handler's time can be matched up.
+//****************************************************************************
+struct COMMANDBUS_PACKED CommandSetpoint : public CommandMessage
+{
+    LittleEndian<uint16_t> Sequence;
+    LittleEndian<int16_t> Value;
+
+    CommandSetpoint(const uint16_t sequence=0, const int16_t value=0);
+};
+
+
+//****************************************************************************
+/// A listener whose commands cost as little as possible, so the benchmark
+/// measures the library rather than the handlers. A deferred command is
+/// completed by CompleteDeferred() once DeferTime has passed.
+//****************************************************************************
+class BenchListener : public CommandListener
+{
+    public: static const byte CMD_BENCH_OK    = 0x20;
+    public: static const byte CMD_BENCH_DEFER = 0x21;
+    public: static const byte CMD_BENCH_SET   = 0x22;
+
+    public: static const CommandHandlerEntry CommandTable[3];
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: BenchListener() : CommandListener(0x42, CommandTable, COMMAND_TABLE_SIZE(CommandTable)) { };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void HandleOK(const CommandMessage* pCommand) { BeginResponse<CommandResponse>(CMD_RESPONSE_OK); CommitResponse(); };
+    public: void HandleDefer(const CommandMessage* pCommand);
+    public: void HandleSet(const CommandMessage* pCommand);
+
+    /// Posts the responses of the deferred commands whose time has come
+    public: void CompleteDeferred();
+
+    public: byte DeferredID = 0;
+
+    /// How long a deferred command takes, in microseconds
+    public: unsigned long DeferTime = 0;
+
+    /// The times the setpoints were handled, indexed by their Sequence (if not NULL)
+    public: unsigned long* pSetpointTimes = NULL;
+
+    public: uint16_t SetpointCount = 0;
+
+    /***************************************************************************
+    Shared implementation
+    ***************************************************************************/
+    protected: bool IsResponseExpected(const CommandMessage* pCommand) { return pCommand->CommandCode != CMD_BENCH_SET; };
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: struct DeferredCommand
+    {
+        byte ResponseID;
+        unsigned long DueTime;
+    };
+
+    private: DeferredCommand _deferred[COMMANDBUS_DEFERRED_SIZE];
+
+    private: byte _deferredCount = 0;
+};
+
+const CommandHandlerEntry BenchListener::CommandTable[] PROGMEM =
+{
+    COMMAND_HANDLER(CMD_BENCH_OK,    BenchListener, HandleOK),
+    COMMAND_HANDLER(CMD_BENCH_DEFER, BenchListener, HandleDefer),
+    COMMAND_HANDLER(CMD_BENCH_SET,   BenchListener, HandleSet),
+};
+
+
+CommandSetpoint::CommandSetpoint(const uint16_t sequence, const int16_t value) : 
+    CommandMessage(BenchListener::CMD_BENCH_SET), Sequence(sequence), Value(value)
+{
+    Length = sizeof(*this);
+}
+
+
+void BenchListener::HandleDefer(const CommandMessage* pCommand)
+{
+    DeferredID = DeferResponse(pCommand);
+
+    if (DeferredID == 0 || _deferredCount >= COMMANDBUS_DEFERRED_SIZE) return;
+
+    _deferred[_deferredCount].ResponseID = DeferredID;
+    _deferred[_deferredCount].DueTime = micros() + DeferTime;
+    _deferredCount++;
+}
+
+
+void BenchListener::HandleSet(const CommandMessage* pCommand)
+{
+    auto pSetpoint = (const CommandSetpoint*)pCommand;
+
+    if (pSetpointTimes != NULL) pSetpointTimes[pSetpoint->Sequence.Get()] = micros();
+
+    SetpointCount++;
+}
+
+
+void BenchListener::CompleteDeferred()
+{
+    unsigned long now = micros();
+
+    for (byte i = 0; i < _deferredCount; )
+    {
+        if ((long)(now - _deferred[i].DueTime) < 0)
+        {
+            i++;
+            continue;
+        }
+
+        auto response = CommandResponse(CMD_RESPONSE_OK, _deferred[i].ResponseID);
+
+        PostDeferredResponse(&response);
+        _deferred[i] = _deferred[--_deferredCount];
+    }
+}
+
+
+//****************************************************************************
+/// The Wire library's view of a transaction: the bytes received to be read,
+/// and the bytes written in reply (which are discarded)
+//****************************************************************************
+class ReplayStream : public Stream
+{
+    public: void Load(const byte* pData, byte count) { _pData = pData; _count = count; _cursor = 0; };
+
+    public: int available() { return _count - _cursor; };
+    public: int read() { return (_cursor < _count) ? _pData[_cursor++] : -1; };
+    public: size_t write(uint8_t data) { Sink += data; return 1; };
+    public: size_t write(const uint8_t* pBuffer, size_t count) { Sink += (count > 0) ? pBuffer[0] : 0; return count; };
+
+    public: unsigned long Sink = 0;
+
+    private: const byte* _pData = NULL;
+
+    private: byte _count = 0;
+
+    private: byte _cursor = 0;
+};
+
+
+//****************************************************************************
+// ISR-replay scenarios
+//****************************************************************************
+enum BusEventType : byte { EVENT_RECEIVE, EVENT_REQUEST, EVENT_POLL, EVENT_TYPE_COUNT };
+
+static const char* const eventNames[EVENT_TYPE_COUNT] = { "receive ISR", "request ISR", "Poll()" };
+
+struct BusEvent
+{
+    BusEventType Type;
+    byte Frame[COMMANDBUS_COMMAND_SIZE + COMMANDBUS_CRC_SIZE];
+    byte Length;
+};
+
+struct Scenario
+{
+    const char* Name;
+    BusEvent Events[4];
+    byte EventCount;
+};
+
+
+//****************************************************************************
+// Returns a receive event for a command (with its CRC byte, if enabled)
+//****************************************************************************
+static BusEvent Receive(const CommandMessage& command)
+{
+    BusEvent event;
+
+    event.Type = EVENT_RECEIVE;
+    memcpy(event.Frame, &command, command.Length);
+    event.Length = command.Length;
+#if COMMANDBUS_CRC
+    event.Frame[event.Length++] = CRC8(event.Frame, command.Length);
+#endif
+
+    return event;
+}
+
+
+static BusEvent Event(BusEventType type)
+{
+    BusEvent event;
+
+    event.Type   = type;
+    event.Length = 0;
+
+    return event;
+}
+
+
+//****************************************************************************
+// Replays a scenario, and prints the average time of each kind of event
+//****************************************************************************
+static void ReplayScenario(BenchListener& listener, ReplayStream& stream, const Scenario& scenario)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::duration totals[EVENT_TYPE_COUNT] = { };
+    long counts[EVENT_TYPE_COUNT] = { };
+
+    for (long i = 0; i < REPLAY_COUNT; i++)
+    {
+        for (byte e = 0; e < scenario.EventCount; e++)
+        {
+            auto& event = scenario.Events[e];
+            auto startTime = Clock::now();
+
+            switch (event.Type)
+            {
+                case EVENT_RECEIVE:
+                    stream.Load(event.Frame, event.Length);
+                    listener.OnCommandReceived(stream, event.Length);
+                break;
+
+                case EVENT_REQUEST:
+                    listener.SendResponse(stream);
+                break;
+
+                default:
+                    listener.Poll();
+                break;
+            }
+
+            totals[event.Type] += Clock::now() - startTime;
+            counts[event.Type]++;
+        }
+    }
+
+    printf("%-28s", scenario.Name);
+
+    for (byte type = 0; type < EVENT_TYPE_COUNT; type++)
+    {
+        if (counts[type] == 0)
+        {
+            printf("  %11s %8s", "", "");
+            continue;
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(totals[type]).count() / counts[type];
+
+        printf("  %11s %6.1fns", eventNames[type], ns);
+    }
+
+    printf("\n");
+}
+
+
+//****************************************************************************
+// Runs the ISR-replay benchmark
+//****************************************************************************
+static unsigned long RunISRReplay()
+{
+    BenchListener listener;
+    ReplayStream stream;
+
+    listener.Begin();
+
+    // A deferred command that never completes, for the CMD_QUERY_RESPONSE polls
+    auto defer = CommandMessage(BenchListener::CMD_BENCH_DEFER);
+    auto deferEvent = Receive(defer);
+
+    stream.Load(deferEvent.Frame, deferEvent.Length);
+    listener.OnCommandReceived(stream, deferEvent.Length);
+    listener.Poll();
+    listener.SendResponse(stream);
+
+    auto queryID = CommandMessage(CMD_QUERY_ID);
+    auto ok = CommandMessage(BenchListener::CMD_BENCH_OK);
+    auto echo = CommandEcho("0123456789abcdefghijklm");
+    auto query = CommandQueryResponseReady(listener.DeferredID, BenchListener::CMD_BENCH_DEFER);
+    auto batch = CommandBatch();
+
+    while (batch.Add(&ok)) { };
+
+    const Scenario scenarios[] =
+    {
+        { "cached CMD_QUERY_ID",        { Receive(queryID), Event(EVENT_REQUEST) },                      2 },
+        { "queued command",             { Receive(ok), Event(EVENT_POLL), Event(EVENT_REQUEST) },        3 },
+        { "CMD_QUERY_RESPONSE pending", { Receive(query), Event(EVENT_REQUEST) },                        2 },
+        { "CMD_ECHO (26 bytes)",        { Receive(echo), Event(EVENT_POLL), Event(EVENT_REQUEST) },      3 },
+        { "CMD_BATCH (15 commands)",    { Receive(batch), Event(EVENT_POLL), Event(EVENT_REQUEST) },     3 },
+        { "response poll (idle)",       { Event(EVENT_REQUEST) },                                        1 },
+    };
+
+    printf("ISR-replay benchmark, %ld replays of each scenario\n", REPLAY_COUNT);
+
+    for (auto& scenario : scenarios) ReplayScenario(listener, stream, scenario);
+
+    return stream.Sink;
+}
+
+
+//****************************************************************************
+// Recorded command streams
+//****************************************************************************
+struct StreamCommand
+{
+    unsigned long Time;                     // When it is sent, in microseconds from the start of the stream
+    byte Frame[COMMANDBUS_COMMAND_SIZE];    // The command
+};
+
+struct CommandStream
+{
+    const char* Name;
+    std::vector<StreamCommand> Commands;
+    unsigned long ResponseDelay;            // The master's delay before it reads a response
+    unsigned long QueryInterval;            // The master's interval between CMD_QUERY_RESPONSE polls
+    unsigned long DeferTime;                // How long the slave takes over a deferred command
+    unsigned long LoopTime;                 // How long each pass of the slave's main loop spends on other work
+};
+
+
+static void Record(CommandStream& stream, unsigned long time, const CommandMessage& command)
+{
+    StreamCommand streamCommand;
+
+    streamCommand.Time = time;
+    memcpy(streamCommand.Frame, &command, command.Length);
+    stream.Commands.push_back(streamCommand);
+}
+
+
+static void RecordSetpoint(CommandStream& stream, unsigned long time, int16_t value)
+{
+    Record(stream, time, CommandSetpoint((uint16_t)stream.Commands.size(), value));
+}
+
+
+//****************************************************************************
+// Builds the streams. Each comes from a fixed seed, so every run (and every
+// build being compared) replays the same commands at the same times.
+//****************************************************************************
+static std::vector<CommandStream> RecordStreams()
+{
+    std::vector<CommandStream> streams;
+    std::minstd_rand random(1);
+    auto echo = CommandEcho("0123456789abcdefghijklm");
+    auto defer = CommandMessage(BenchListener::CMD_BENCH_DEFER);
+    auto ok = CommandMessage(BenchListener::CMD_BENCH_OK);
+
+    // A controller updating its outputs in bursts, faster than a slave whose
+    // main loop is busy can take them
+    CommandStream setpoints = { "bursty setpoints", { }, COMMANDBUS_CLIENT_RESPONSE_DELAY, COMMANDBUS_CLIENT_QUERY_INTERVAL, 0, 1000 };
+
+    for (unsigned long burst = 0; burst < 20; burst++)
+    {
+        for (int i = 0; i < 32; i++) RecordSetpoint(setpoints, burst * 10000, (int16_t)random());
+    }
+
+    streams.push_back(setpoints);
+
+    // Deferred commands, each polled for with CMD_QUERY_RESPONSE as fast as
+    // the master can until it completes
+    CommandStream storm = { "CMD_QUERY_RESPONSE storm", { }, 0, 0, 2000, 0 };
+
+    for (unsigned long i = 0; i < 60; i++) Record(storm, i * 4000 + random() % 1000, defer);
+
+    streams.push_back(storm);
+
+    // Back to back echoes, each with a response streamed over several reads
+    CommandStream echoes = { "CMD_ECHO flood", { }, COMMANDBUS_CLIENT_RESPONSE_DELAY, COMMANDBUS_CLIENT_QUERY_INTERVAL, 0, 0 };
+
+    for (int i = 0; i < 500; i++) Record(echoes, 0, echo);
+
+    streams.push_back(echoes);
+
+    // All of them at random, averaging one command every 1.5ms
+    CommandStream mixed = { "mixed traffic", { }, COMMANDBUS_CLIENT_RESPONSE_DELAY, 1000, 1000, 100 };
+    std::exponential_distribution<double> gap(1.0 / 1500);
+    double time = 0;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        auto kind = random() % 20;
+
+        time += gap(random);
+
+        if (kind < 12) RecordSetpoint(mixed, (unsigned long)time, (int16_t)random());
+        else if (kind < 16) Record(mixed, (unsigned long)time, ok);
+        else if (kind < 19) Record(mixed, (unsigned long)time, echo);
+        else Record(mixed, (unsigned long)time, defer);
+    }
+
+    streams.push_back(mixed);
+
+    return streams;
+}
+
+
+//****************************************************************************
+// The stream replay
+//****************************************************************************
+static const byte SLAVE_ADDRESS = 0x10;
+
+struct CommandResult
+{
+    unsigned long Time;                     // The command's recorded time
+    unsigned long DoneTime;                 // When its response arrived (0 if it hasn't)
+    byte ResponseCode;
+};
+
+
+// What the bus has carried: command frames (other than CMD_QUERY_RESPONSE
+// polls), polls, and BUSY answers. A read that follows a write starts the
+// response to the command written.
+static unsigned long commandFrames = 0;
+
+static unsigned long queryFrames = 0;
+
+static unsigned long busyResponses = 0;
+
+static bool responseAwaited = false;
+
+
+static void OnTransaction(int address, bool isRead, const uint8_t* pData, int count)
+{
+    if (!isRead)
+    {
+        if (count >= 2 && pData[1] == CMD_QUERY_RESPONSE) queryFrames++;
+        else commandFrames++;
+
+        responseAwaited = true;
+    }
+    else if (responseAwaited)
+    {
+        if (count >= 2 && pData[1] == CMD_RESPONSE_BUSY) busyResponses++;
+
+        responseAwaited = false;
+    }
+}
+
+
+static void OnResponse(CommandClient& client, byte slaveAddress, const CommandResponse* pResponse, void* pContext)
+{
+    auto pResult = (CommandResult*)pContext;
+
+    pResult->DoneTime = micros();
+    pResult->ResponseCode = pResponse->ResponseCode;
+}
+
+
+//****************************************************************************
+// Spends the given time, yielding to the other thread meanwhile
+//****************************************************************************
+static void Spin(unsigned long duration)
+{
+    unsigned long startTime = micros();
+
+    do
+    {
+        std::this_thread::yield();
+    }
+    while (micros() - startTime < duration);
+}
+
+
+//****************************************************************************
+// The slave device's main loop
+//****************************************************************************
+static void RunSlave(BenchListener* pListener, const CommandStream* pStream, std::atomic<bool>* pStop)
+{
+    while (!pStop->load())
+    {
+        pListener->Poll();
+        pListener->CompleteDeferred();
+        Spin(pStream->LoopTime);
+    }
+}
+
+
+static unsigned long Percentile(const std::vector<unsigned long>& sorted, double fraction)
+{
+    if (sorted.empty()) return 0;
+
+    size_t index = (size_t)(fraction * sorted.size());
+
+    return sorted[(index < sorted.size()) ? index : sorted.size() - 1];
+}
+
+
+//****************************************************************************
+// Replays a stream end to end, and prints its throughput, refusals, losses
+// and latency percentiles
+//****************************************************************************
+static void ReplayCommandStream(const CommandStream& stream, unsigned long busClock)
+{
+    TwoWire slaveWire;
+    TwoWire masterWire;
+    BenchListener listener;
+    I2CCommandTransport transport(listener, SLAVE_ADDRESS, slaveWire);
+    CommandClient client(masterWire);
+    auto count = stream.Commands.size();
+    std::vector<CommandResult> results(count, CommandResult());
+    std::vector<unsigned long> setpointTimes(count, 0);
+
+    TwoWire::ResetBus();
+    TwoWire::OnTransaction = &OnTransaction;
+    commandFrames = queryFrames = busyResponses = 0;
+    responseAwaited = false;
+
+    masterWire.begin();
+    masterWire.setClock(busClock);
+    client.SetResponseDelay(stream.ResponseDelay);
+    client.SetQueryInterval(stream.QueryInterval);
+    listener.DeferTime = stream.DeferTime;
+    listener.pSetpointTimes = setpointTimes.data();
+    transport.Begin();
+    listener.Begin();
+
+    std::atomic<bool> stop(false);
+    std::thread slave(&RunSlave, &listener, &stream, &stop);
+
+    // The bus thread: each command is sent as soon as its time has come and
+    // the client has room for it
+    unsigned long startTime = micros();
+    size_t next = 0;
+
+    while (next < count || !client.IsIdle())
+    {
+        while (next < count && micros() - startTime >= stream.Commands[next].Time)
+        {
+            auto pCommand = (const CommandMessage*)stream.Commands[next].Frame;
+            auto handler = (pCommand->CommandCode == BenchListener::CMD_BENCH_SET) ? NULL : &OnResponse;
+
+            results[next].Time = startTime + stream.Commands[next].Time;
+
+            if (!client.SendCommand(SLAVE_ADDRESS, pCommand, handler, &results[next])) break;
+
+            next++;
+        }
+
+        client.Poll();
+        std::this_thread::yield();
+    }
+
+    // Gives the slave time to handle the last setpoints
+    Spin(10000);
+    stop = true;
+    slave.join();
+
+    TwoWire::OnTransaction = NULL;
+
+    std::vector<unsigned long> latencies;
+    unsigned long setpointFrames = 0;
+    unsigned long lost = 0;
+    unsigned long lastTime = startTime;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto pCommand = (const CommandMessage*)stream.Commands[i].Frame;
+        unsigned long doneTime;
+
+        if (pCommand->CommandCode == BenchListener::CMD_BENCH_SET)
+        {
+            setpointFrames++;
+            doneTime = setpointTimes[i];
+        }
+        else
+        {
+            doneTime = (results[i].ResponseCode == CMD_RESPONSE_OK) ? results[i].DoneTime : 0;
+        }
+
+        if (doneTime == 0)
+        {
+            lost++;
+            continue;
+        }
+
+        latencies.push_back(doneTime - results[i].Time);
+
+        if ((long)(doneTime - lastTime) > 0) lastTime = doneTime;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    // Refused frames are those answered BUSY and the setpoints dropped (which
+    // are sent once, and so are the setpoints lost)
+    unsigned long dropped = setpointFrames - listener.SetpointCount;
+    double seconds = (lastTime - startTime) / 1e6;
+
+    printf("%-28s %6lu %9.0f %7.2f%% %6lu %8lu %6lu %6lu %6lu %6lu\n", stream.Name, (unsigned long)count, 
+        (seconds > 0) ? latencies.size() / seconds : 0.0, 
+        (commandFrames > 0) ? 100.0 * (busyResponses + dropped) / commandFrames : 0.0, lost, queryFrames, 
+        Percentile(latencies, 0.5), Percentile(latencies, 0.9), Percentile(latencies, 0.99), 
+        latencies.empty() ? 0 : latencies.back());
+}
+
+
+//****************************************************************************
+// Runs the stream benchmark
+//****************************************************************************
+static void RunStreamReplay(unsigned long busClock)
+{
+    auto streams = RecordStreams();
+
+    MockUseHostClock(true);
+
+    printf("\nStream benchmark, %lu Hz bus, %u hardware threads\n", busClock, std::thread::hardware_concurrency());
+    printf("%-28s %6s %9s %8s %6s %8s %6s %6s %6s %6s\n", "stream", "cmds", "cmds/s", "refused", "lost", "queries", "p50us", "p90us", "p99us", "maxus");
+
+    for (auto& stream : streams) ReplayCommandStream(stream, busClock);
+
+    MockUseHostClock(false);
+}
+
+
+int main(int argc, char* argv[])
+{
+    unsigned long busClock = (argc > 1) ? strtoul(argv[1], NULL, 0) : 400000;
+    unsigned long sink = RunISRReplay();
+
+    RunStreamReplay(busClock);
+
+    // Keeps the replies from being optimized away
+    return (sink == 0xFFFFFFFFUL) ? 1 : 0;
+}
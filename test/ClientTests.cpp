@@ -0,0 +1,174 @@
+/*******************************************************************************
+ ClientTests.cpp
+
+ Tests of CommandClient, talking to a TestListener over the loopback bus.
+*******************************************************************************/
+#include "CommandBusTest.h"
+
+
+TEST(ClientCompletesCommand)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+
+    CHECK(bus.Send(&command));
+
+    bus.Run(100000);
+
+    CHECK(bus.Client.IsIdle());
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(1, bus.Listener.HandledCount);
+}
+
+
+TEST(ClientReadsCachedResponse)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(CMD_QUERY_ID);
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(0x42, ((const CommandResponseQueryID*)bus.LastResponse())->ID);
+}
+
+
+TEST(ClientSendsCommandsInOrder)
+{
+    TestBus<> bus;
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    auto unknown = CommandMessage(0x7F);
+
+    bus.Send(&ok);
+    bus.Send(&unknown);
+
+    CHECK_EQUAL(2, bus.Client.PendingCount());
+    CHECK(bus.Client.IsBusy(bus.SLAVE_ADDRESS));
+
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_UNKNOWN, bus.LastResponse()->ResponseCode);
+}
+
+
+TEST(ClientFollowsDeferredResponse)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    bus.Send(&command);
+    bus.Run(20000);
+
+    CHECK_EQUAL(0, bus.ResponseCount);
+    CHECK_EQUAL(1, bus.Listener.HandledCount);
+    CHECK(bus.Listener.CompleteDeferred(CMD_RESPONSE_ERROR));
+
+    bus.Run(100000);
+
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(bus.Listener.DeferredID, bus.LastResponse()->ResponseID);
+}
+
+
+TEST(ClientSendsWhileResponseIsDeferred)
+{
+    TestBus<> bus;
+    auto defer = CommandMessage(TestListener::CMD_TEST_DEFER);
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+
+    bus.Send(&defer);
+    bus.Send(&ok);
+    bus.Run(20000);
+
+    // The second command completes while the first is still deferred
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+
+    bus.Listener.CompleteDeferred();
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+}
+
+
+TEST(ClientTimesOutWithoutSlave)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(CMD_QUERY_ID);
+
+    bus.Client.SetTimeout(10000);
+    bus.Client.SendCommand(bus.SLAVE_ADDRESS + 1, &command, &TestBus<>::OnResponse, &bus);
+    bus.Run(100000);
+
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, bus.LastResponse()->ResponseCode);
+}
+
+
+TEST(ClientCompletesCommandWithoutResponseAtOnce)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_QUIET);
+
+    bus.Client.SendCommand(bus.SLAVE_ADDRESS, &command);
+    bus.Client.Poll();
+
+    CHECK(bus.Client.IsIdle());
+
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(1, bus.Listener.HandledCount);
+}
+
+
+TEST(ClientRejectsOversizedCommand)
+{
+    TestBus<> bus;
+    byte frame[COMMANDBUS_COMMAND_SIZE + 1] = { COMMANDBUS_COMMAND_SIZE + 1, TestListener::CMD_TEST_OK };
+
+    CHECK(!bus.Send((const CommandMessage*)frame));
+}
+
+
+TEST(ClientReadsShortResponseInFirstWindow)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    auto transactionCount = TwoWire::TransactionCount;
+    auto bytesRead = TwoWire::BytesRead;
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    // One write, then reads of TX_FIRST_WINDOW bytes until the response is ready
+    long readCount = TwoWire::TransactionCount - transactionCount - 1;
+
+    CHECK(readCount >= 1);
+    CHECK_EQUAL(readCount * CommandClient::TX_FIRST_WINDOW, TwoWire::BytesRead - bytesRead);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+}
+
+
+TEST(ClientReadsLongResponseAcrossWindows)
+{
+    TestBus<> bus;
+    auto command = CommandEcho("0123456789abcdefghij");
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    auto pResponse = (const CommandResponseEcho*)bus.LastResponse();
+
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK_EQUAL(21, pResponse->Length - pResponse->HeaderLength());
+    CHECK(memcmp(pResponse->EchoData, "0123456789abcdefghij", 21) == 0);
+}
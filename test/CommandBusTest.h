@@ -0,0 +1,221 @@
+/*******************************************************************************
+ CommandBusTest.h
+
+ A minimal test framework for running the command bus library on the host,
+ and the fixtures the tests share: a test listener with its own command table,
+ connected by an I2C transport to a loopback bus with a CommandClient as the
+ bus master.
+*******************************************************************************/
+#ifndef _CommandBusTest_h_
+#define _CommandBusTest_h_
+
+#include <stdio.h>
+#include <Arduino.h>
+#include <RTL_Debug.h>
+#include <Wire.h>
+#include "../CommandListener.h"
+#include "../CommandClient.h"
+#include "../I2CCommandTransport.h"
+
+
+//****************************************************************************
+// Test registration and checks
+//
+//     TEST(ListenerAnswersQueryID)
+//     {
+//         ...
+//         CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+//     }
+//
+// A failed check reports its file and line and ends the test.
+//****************************************************************************
+typedef void (*TestFunction)();
+
+struct TestCase
+{
+    const char* Name;
+    TestFunction Function;
+    TestCase* pNext;
+
+    TestCase(const char* name, TestFunction function);
+};
+
+extern bool TestFailed;
+
+void TestFail(const char* file, int line, const char* expression, long expected=0, long actual=0, bool showValues=false);
+
+#define TEST(name) \
+    static void name(); \
+    static TestCase name##_testCase(#name, &name); \
+    static void name()
+
+#define CHECK(condition) \
+    do { if (!(condition)) { TestFail(__FILE__, __LINE__, #condition); return; } } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+    do { long _e = (long)(expected), _a = (long)(actual); if (_e != _a) { TestFail(__FILE__, __LINE__, #actual, _e, _a, true); return; } } while (0)
+
+
+//****************************************************************************
+/// A listener with a few application commands for the tests to send
+//****************************************************************************
+class TestListener : public CommandListener
+{
+    public: static const byte CMD_TEST_OK    = 0x20;    // Responds with CMD_RESPONSE_OK
+    public: static const byte CMD_TEST_DEFER = 0x21;    // Defers its response
+    public: static const byte CMD_TEST_QUIET = 0x22;    // Posts no response
+
+    public: static const CommandHandlerEntry CommandTable[];
+
+    public: static const byte CommandTableSize;
+
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: TestListener(byte deviceID=0x42) : CommandListener(deviceID, CommandTable, CommandTableSize) { };
+
+    protected: TestListener(byte deviceID, const CommandHandlerEntry* pCommandTable, byte commandTableSize) : 
+        CommandListener(deviceID, pCommandTable, commandTableSize) 
+    { 
+    };
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void HandleOK(const CommandMessage* pCommand) { HandledCount++; BeginResponse<CommandResponse>(CMD_RESPONSE_OK); CommitResponse(); };
+    public: void HandleDefer(const CommandMessage* pCommand) { HandledCount++; DeferredID = DeferResponse(pCommand); };
+    public: void HandleQuiet(const CommandMessage* pCommand) { HandledCount++; };
+
+    /// Completes the last deferred command
+    public: bool CompleteDeferred(byte responseCode=CMD_RESPONSE_OK)
+    {
+        auto response = CommandResponse(responseCode, DeferredID);
+
+        return PostDeferredResponse(&response);
+    };
+
+    public: int HandledCount = 0;
+
+    public: byte DeferredID = 0;
+
+    /***************************************************************************
+    Shared implementation
+    ***************************************************************************/
+    protected: bool IsResponseExpected(const CommandMessage* pCommand) { return pCommand->CommandCode != CMD_RESET_DEVICE; };
+};
+
+
+//****************************************************************************
+/// A slave device (a TestListener on an I2C transport) and a bus master (a
+/// CommandClient), on the loopback bus. Run() moves simulated time along,
+/// polling both ends as the main loops of the two devices would.
+//****************************************************************************
+template <class LISTENER = TestListener> struct TestBus
+{
+    static const byte SLAVE_ADDRESS = 0x10;
+
+    TwoWire SlaveWire;
+    TwoWire MasterWire;
+    LISTENER Listener;
+    I2CCommandTransport Transport;
+    CommandClient Client;
+
+    // The last response passed to the client's response handler
+    byte Response[COMMANDBUS_MAX_RESPONSE_SIZE];
+    int ResponseCount = 0;
+
+    TestBus() : Transport(Listener, SLAVE_ADDRESS, SlaveWire), Client(MasterWire)
+    {
+        TwoWire::ResetBus();
+        MockSetMicros(1000);
+        MasterWire.begin();
+        Transport.Begin();
+        Listener.Begin();
+        memset(Response, 0, sizeof(Response));
+    };
+
+    static void OnResponse(CommandClient& client, byte slaveAddress, const CommandResponse* pResponse, void* pContext)
+    {
+        auto pBus = (TestBus*)pContext;
+
+        memcpy(pBus->Response, pResponse, (pResponse->Length < sizeof(pBus->Response)) ? pResponse->Length : sizeof(pBus->Response));
+        pBus->ResponseCount++;
+    };
+
+    bool Send(const CommandMessage* pCommand) { return Client.SendCommand(SLAVE_ADDRESS, pCommand, &OnResponse, this); };
+
+    const CommandResponse* LastResponse() const { return (const CommandResponse*)Response; };
+
+    /// Polls both ends every step microseconds for the given time, or until the client is idle
+    void Run(unsigned long duration, unsigned long step=100)
+    {
+        for (unsigned long elapsed = 0; elapsed < duration; elapsed += step)
+        {
+            Client.Poll();
+            Listener.Poll();
+
+            if (Client.IsIdle()) return;
+
+            MockAdvanceMicros(step);
+        }
+    };
+
+    /// Writes a raw frame to the slave device, as the master's Wire library would
+    byte Write(const void* pFrame, byte length)
+    {
+        MasterWire.beginTransmission(SLAVE_ADDRESS);
+        MasterWire.write((const byte*)pFrame, length);
+
+        return MasterWire.endTransmission();
+    };
+
+    /// Writes a command to the slave device (with its CRC byte, if enabled)
+    byte Write(const CommandMessage* pCommand)
+    {
+        byte frame[COMMANDBUS_COMMAND_SIZE + COMMANDBUS_CRC_SIZE];
+
+        memcpy(frame, pCommand, pCommand->Length);
+#if COMMANDBUS_CRC
+        frame[pCommand->Length] = CRC8(frame, pCommand->Length);
+#endif
+
+        return Write(frame, pCommand->Length + COMMANDBUS_CRC_SIZE);
+    };
+
+    /// Reads the pending response frame from the slave device (checking its CRC byte, if enabled)
+    const CommandResponse* Read()
+    {
+        static byte frame[COMMANDBUS_MAX_RESPONSE_SIZE + COMMANDBUS_CRC_SIZE];
+        byte window = COMMANDBUS_TX_FIRST_WINDOW;
+
+        if (MasterWire.requestFrom(SLAVE_ADDRESS, window) != window) return NULL;
+
+        byte received = 0;
+
+        while (MasterWire.available() && received < window) frame[received++] = MasterWire.read();
+
+        byte frameLength = frame[0] + COMMANDBUS_CRC_SIZE;
+
+        // Padding after a short frame isn't part of it
+        if (received > frameLength) received = frameLength;
+
+        window = COMMANDBUS_TX_WINDOW;
+
+        while (received < frameLength)
+        {
+            byte count = (frameLength - received < window) ? frameLength - received : window;
+
+            MasterWire.requestFrom(SLAVE_ADDRESS, count);
+
+            while (MasterWire.available() && received < frameLength) frame[received++] = MasterWire.read();
+        }
+
+#if COMMANDBUS_CRC
+        if (CRC8(frame, frameLength) != 0) return NULL;
+#endif
+
+        return (const CommandResponse*)frame;
+    };
+};
+
+#endif
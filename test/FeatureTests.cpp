@@ -0,0 +1,467 @@
+/*******************************************************************************
+ FeatureTests.cpp
+
+ Tests of the optional features of the command bus library. Each group of
+ tests is only built when its feature is configured on (see the Makefile's
+ features build).
+*******************************************************************************/
+#include "CommandBusTest.h"
+#include "TraceReplay.h"
+
+
+#if COMMANDBUS_CRC
+TEST(CRCRejectsCorruptedCommand)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte frame[sizeof(command) + 1];
+
+    memcpy(frame, &command, sizeof(command));
+    frame[sizeof(command)] = CRC8(frame, sizeof(command)) ^ 0x01;
+
+    bus.Write(frame, sizeof(frame));
+
+    CHECK_EQUAL(CMD_RESPONSE_CORRUPT, bus.Read()->ResponseCode);
+
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(0, bus.Listener.HandledCount);
+}
+
+
+TEST(CRCClientResendsCorruptedCommand)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+
+    // Warms up the client's flow control credits, so the next transaction
+    // on the bus is the command itself
+    bus.Send(&command);
+    bus.Run(100000);
+
+    TwoWire::CorruptNextWrite = 1;
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(2, bus.Listener.HandledCount);
+}
+
+
+TEST(CRCClientDoesNotResendOnCorruptedResponse)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    // The reply to the next read is corrupted, after the command was handled
+    TwoWire::CorruptNextRead = 1;
+
+    bus.Send(&command);
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_CORRUPT, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(2, bus.Listener.HandledCount);
+}
+
+
+#if COMMANDBUS_DMA
+TEST(CRCFrameFitsDMAReceiveBuffer)
+{
+    TestBus<> bus;
+    auto batch = CommandBatch();
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    byte capacity = 0;
+
+    while (batch.Add(&ok)) { };
+
+    auto pFrame = bus.Listener.AcquireReceiveFrame(capacity);
+
+    CHECK_EQUAL(COMMANDBUS_COMMAND_SIZE + 1, capacity);
+
+    memcpy(pFrame, &batch, batch.Length);
+    pFrame[batch.Length] = CRC8(pFrame, batch.Length);
+    bus.Listener.CommitReceiveFrame(batch.Length + 1);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(15, bus.Listener.HandledCount);
+}
+
+
+//****************************************************************************
+// Fills both command queues of a TestBus's listener, with commands that post
+// no response
+//****************************************************************************
+static void FillCommandQueues(TestBus<>& bus)
+{
+    auto quiet = CommandMessage(TestListener::CMD_TEST_QUIET);
+    auto priorityQuiet = CommandMessage(TestListener::CMD_TEST_QUIET + 1);
+
+    bus.Listener.SetCommandPriority(priorityQuiet.CommandCode);
+
+    for (byte i = 0; i < CommandListener::COMMAND_QUEUE_SIZE; i++) bus.Write(&quiet);
+    for (byte i = 0; i < CommandListener::PRIORITY_QUEUE_SIZE; i++) bus.Write(&priorityQuiet);
+}
+
+
+TEST(DMAReceivesWholeFrameWhenQueuesAreFull)
+{
+    TestBus<> bus;
+    auto echo = CommandEcho("0123456789abcdef");
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    byte capacity = 0;
+
+    FillCommandQueues(bus);
+
+    // An immediate (inline) command is answered from the whole frame
+    auto pFrame = bus.Listener.AcquireReceiveFrame(capacity);
+
+    CHECK_EQUAL(COMMANDBUS_COMMAND_SIZE + 1, capacity);
+
+    memcpy(pFrame, &echo, echo.Length);
+    pFrame[echo.Length] = CRC8(pFrame, echo.Length);
+    bus.Listener.CommitReceiveFrame(echo.Length + 1);
+
+    auto pResponse = (const CommandResponseEcho*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK(memcmp(pResponse->EchoData, "0123456789abcdef", 17) == 0);
+
+    // A queued command is moved to a slot that came free before it was committed
+    pFrame = bus.Listener.AcquireReceiveFrame(capacity);
+
+    memcpy(pFrame, &ok, ok.Length);
+    pFrame[ok.Length] = CRC8(pFrame, ok.Length);
+    bus.Listener.Poll();
+    bus.Listener.CommitReceiveFrame(ok.Length + 1);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CommandListener::COMMAND_QUEUE_SIZE + 1, bus.Listener.HandledCount);
+}
+
+
+#if COMMANDBUS_STATS
+TEST(DMADropsFrameLongerThanBuffer)
+{
+    TestBus<> bus;
+    auto query = CommandMessage(CMD_QUERY_STATS);
+    byte capacity = 0;
+
+    FillCommandQueues(bus);
+
+    auto pFrame = bus.Listener.AcquireReceiveFrame(capacity);
+
+    pFrame[0] = capacity + 1;
+    pFrame[1] = TestListener::CMD_TEST_OK;
+    bus.Listener.CommitReceiveFrame(capacity + 2);
+
+    // It is dropped like a runt frame, rather than answered as corrupted
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, bus.Read()->ResponseCode);
+
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CommandListener::COMMAND_QUEUE_SIZE, bus.Listener.HandledCount);
+
+    bus.Write(&query);
+    bus.Listener.Poll();
+
+    auto pStats = (const CommandResponseStats*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pStats->ResponseCode);
+    CHECK_EQUAL(1, pStats->CommandsDropped.Get());
+}
+#endif
+
+
+TEST(DMATransmitsResponseInWindows)
+{
+    TestBus<> bus;
+    auto command = CommandEcho("0123456789");
+    byte frame[COMMANDBUS_MAX_RESPONSE_SIZE + 1];
+    byte frameLength = 0;
+    byte length = 0;
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    // The first read gets TX_FIRST_WINDOW bytes, and the next one the rest
+    auto pFrame = bus.Listener.AcquireTransmitFrame(length);
+
+    CHECK_EQUAL(CommandListener::TX_FIRST_WINDOW, length);
+
+    memcpy(frame, pFrame, length);
+    frameLength = length;
+    bus.Listener.ReleaseTransmitFrame();
+
+    pFrame = bus.Listener.AcquireTransmitFrame(length);
+
+    CHECK_EQUAL(frame[0] + 1 - CommandListener::TX_FIRST_WINDOW, length);
+
+    memcpy(frame + frameLength, pFrame, length);
+    frameLength += length;
+    bus.Listener.ReleaseTransmitFrame();
+
+    CHECK_EQUAL(0, CRC8(frame, frameLength));
+    CHECK_EQUAL(CMD_RESPONSE_OK, ((const CommandResponse*)frame)->ResponseCode);
+
+    // The response has been released
+    pFrame = bus.Listener.AcquireTransmitFrame(length);
+
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, ((const CommandResponse*)pFrame)->ResponseCode);
+}
+#endif
+#endif
+
+
+#if COMMANDBUS_STATS
+TEST(StatsCountCommands)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    auto query = CommandMessage(CMD_QUERY_STATS);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+    bus.Read();
+    bus.Write(&query);
+    bus.Listener.Poll();
+
+    auto pStats = (const CommandResponseStats*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pStats->ResponseCode);
+    CHECK_EQUAL(2, pStats->CommandsReceived.Get());
+    CHECK_EQUAL(0, pStats->CommandsDropped.Get());
+}
+#endif
+
+
+#if COMMANDBUS_PIPELINE
+TEST(PipelinedCommandsAreCollected)
+{
+    TestBus<> bus;
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    auto defer = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    CHECK(bus.Client.SendPipelinedCommand(bus.SLAVE_ADDRESS, &defer, &TestBus<>::OnResponse, &bus));
+    CHECK(bus.Client.SendPipelinedCommand(bus.SLAVE_ADDRESS, &ok, &TestBus<>::OnResponse, &bus));
+
+    bus.Run(20000);
+
+    CHECK_EQUAL(1, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+    CHECK(bus.Listener.CompleteDeferred(CMD_RESPONSE_ERROR));
+
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, bus.LastResponse()->ResponseCode);
+}
+#endif
+
+
+#if COMMANDBUS_FLOW_CONTROL
+TEST(FlowControlReportsFreeSlots)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    auto query = CommandMessage(CMD_QUERY_STATUS);
+
+    bus.Write(&command);
+    bus.Write(&query);
+
+    auto pStatus = (const CommandResponseStatus*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pStatus->ResponseCode);
+    CHECK_EQUAL(CommandListener::COMMAND_QUEUE_SIZE - 1, pStatus->FreeCommandSlots);
+    CHECK_EQUAL(COMMANDBUS_DEFERRED_SIZE, pStatus->FreeDeferredSlots);
+}
+
+
+TEST(FlowControlHoldsCommandsBack)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_QUIET);
+
+    // More commands than the slave device has room for, with no responses
+    // read to slow the client down
+    for (byte i = 0; i < CommandListener::COMMAND_QUEUE_SIZE + 2; i++) bus.Client.SendCommand(bus.SLAVE_ADDRESS, &command);
+
+    bus.Client.Poll();
+
+    CHECK_EQUAL(2, bus.Client.PendingCount());
+
+    bus.Listener.Poll();
+    bus.Run(100000);
+
+    CHECK(bus.Client.IsIdle());
+    CHECK_EQUAL(CommandListener::COMMAND_QUEUE_SIZE + 2, bus.Listener.HandledCount);
+}
+#endif
+
+
+#if COMMANDBUS_TRACE_SIZE > 0
+TEST(TraceRecordsFrames)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    auto query = CommandQueryTrace(0);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+    bus.Read();
+    bus.Write(&query);
+    bus.Listener.Poll();
+
+    auto pTrace = (const CommandResponseTrace*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pTrace->ResponseCode);
+    CHECK_EQUAL(3, pTrace->Count);
+    CHECK_EQUAL(TRACE_DIRECTION_RX | TRACE_QUEUED, pTrace->Records[0].Event);
+    CHECK_EQUAL(TestListener::CMD_TEST_OK, pTrace->Records[0].Code);
+    CHECK_EQUAL(TRACE_DIRECTION_RX | TRACE_HANDLED, pTrace->Records[1].Event);
+    CHECK_EQUAL(TRACE_DIRECTION_TX | TRACE_RESPONSE, pTrace->Records[2].Event);
+}
+
+
+TEST(TraceDecodesHexDump)
+{
+    static TraceLog log;
+
+    CHECK(log.AddHex("16 00 00 04 00 07 00 02  0x10,0x27,0x00,0x00 01 20 02   0x15 0x27 0x00 0x00 02 20 02"));
+    CHECK_EQUAL(2, log.Count());
+    CHECK_EQUAL(6, log.NextSequence());
+    CHECK_EQUAL(10000, log[0].Time.Get());
+    CHECK_EQUAL(TRACE_DIRECTION_RX | TRACE_HANDLED, log[1].Event);
+
+    // Records already in the log are skipped
+    CHECK(log.AddHex("16 00 00 04 00 07 00 02  10 27 00 00 01 20 02  15 27 00 00 02 20 02"));
+    CHECK_EQUAL(2, log.Count());
+    CHECK(!log.AddHex("03 04 00"));
+}
+
+
+TEST(TraceReplayReproducesTraffic)
+{
+    static TraceLog recorded;
+    static TraceLog replayed;
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    byte runt[] = { 5, TestListener::CMD_TEST_OK };
+
+    recorded.Clear();
+    replayed.Clear();
+
+    {
+        TestBus<> bus;
+
+        // A burst that overflows the queue, then a runt frame, then the queue drains
+        for (byte i = 0; i <= CommandListener::COMMAND_QUEUE_SIZE; i++)
+        {
+            bus.Write(&ok);
+            MockAdvanceMicros(50);
+        }
+
+        bus.Read();
+        bus.Write(runt, sizeof(runt));
+        MockAdvanceMicros(200);
+        bus.Listener.Poll();
+        MockAdvanceMicros(300);
+        bus.Read();
+
+        CHECK(recorded.Download(bus) > 0);
+    }
+
+    {
+        TestBus<> bus;
+
+        recorded.Replay(bus);
+        replayed.Download(bus);
+    }
+
+    CHECK_EQUAL(recorded.Count(), replayed.Count());
+
+    for (int i = 0; i < recorded.Count(); i++)
+    {
+        CHECK_EQUAL(recorded[i].Event, replayed[i].Event);
+        CHECK_EQUAL(recorded[i].Code, replayed[i].Code);
+        CHECK_EQUAL(recorded[i].Time.Get() - recorded[0].Time.Get(), replayed[i].Time.Get() - replayed[0].Time.Get());
+    }
+}
+#endif
+
+
+#if COMMANDBUS_HISTOGRAM_CODES > 0
+TEST(HistogramCountsHandlerTimes)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    auto query = CommandQueryHistogram(0);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+    bus.Read();
+    bus.Write(&query);
+    bus.Listener.Poll();
+
+    auto pHistogram = (const CommandResponseHistogram*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pHistogram->ResponseCode);
+    CHECK(pHistogram->PageCount >= 1);
+    CHECK_EQUAL(TestListener::CMD_TEST_OK, pHistogram->CommandCode);
+
+    // The mock clock stands still while the handler runs
+    CHECK_EQUAL(1, pHistogram->Counts[0].Get());
+}
+#endif
+
+
+#if COMMANDBUS_TIMING_CODES > 0
+TEST(TimingHintsCountDownLearnedTime)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    // The first deferral teaches the listener that the command takes 10ms
+    bus.Write(&command);
+    bus.Listener.Poll();
+    bus.Read();
+    MockAdvanceMicros(10000);
+    CHECK(bus.Listener.CompleteDeferred());
+
+    auto query = CommandQueryResponseReady(bus.Listener.DeferredID);
+
+    bus.Write(&query);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.Read()->ResponseCode);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    auto pDeferred = (const CommandResponseDeferred*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_DEFERRED, pDeferred->ResponseCode);
+    CHECK_EQUAL(10, pDeferred->ReadyInMs.Get());
+
+    // 4000us is 3 units of 1024us, leaving 7ms of the estimate
+    query = CommandQueryResponseReady(bus.Listener.DeferredID);
+    MockAdvanceMicros(4000);
+    bus.Write(&query);
+
+    auto pNotReady = (const CommandResponseNotReady*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, pNotReady->ResponseCode);
+    CHECK_EQUAL(7, pNotReady->RetryAfterMs.Get());
+
+    // Once the estimate has run out, a quarter of it again (rounded up)
+    MockAdvanceMicros(8000);
+    bus.Write(&query);
+
+    pNotReady = (const CommandResponseNotReady*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, pNotReady->ResponseCode);
+    CHECK_EQUAL(3, pNotReady->RetryAfterMs.Get());
+}
+#endif
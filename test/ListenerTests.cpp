@@ -0,0 +1,526 @@
+/*******************************************************************************
+ ListenerTests.cpp
+
+ Tests of CommandListener, driven through its I2C transport by writing
+ command frames and reading response frames on the loopback bus.
+*******************************************************************************/
+#include "CommandBusTest.h"
+
+
+//****************************************************************************
+/// A listener that handles CMD_QUERY_ID itself, overriding the built-in one
+//****************************************************************************
+class QueryIDListener : public TestListener
+{
+    public: static const CommandHandlerEntry CommandTable[1];
+
+    public: QueryIDListener() : TestListener(0x42, CommandTable, COMMAND_TABLE_SIZE(CommandTable)) { };
+
+    public: void HandleQueryID(const CommandMessage* pCommand) { HandledCount++; BeginResponse<CommandResponseQueryID>(0x99); CommitResponse(); };
+};
+
+const CommandHandlerEntry QueryIDListener::CommandTable[] PROGMEM =
+{
+    COMMAND_HANDLER(CMD_QUERY_ID, QueryIDListener, HandleQueryID),
+};
+
+
+//****************************************************************************
+/// A listener that handles CMD_RESET_DEVICE in OnCommand(), without a
+/// dispatch table entry for it
+//****************************************************************************
+class OnCommandListener : public TestListener
+{
+    protected: void OnCommand(const CommandMessage* pCommand)
+    {
+        if (pCommand->CommandCode != CMD_RESET_DEVICE)
+        {
+            DefaultCommandHandler(pCommand);
+            return;
+        }
+
+        HandledCount++;
+        BeginResponse<CommandResponse>(CMD_RESPONSE_OK);
+        CommitResponse();
+    };
+};
+
+
+TEST(ListenerAnswersQueryIDImmediately)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(CMD_QUERY_ID);
+
+    CHECK_EQUAL(0, bus.Write(&command));
+
+    auto pResponse = (const CommandResponseQueryID*)bus.Read();
+
+    CHECK(pResponse != NULL);
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK_EQUAL(0x42, pResponse->ID);
+}
+
+
+TEST(ListenerQueuesCommandUntilPoll)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+
+    bus.Write(&command);
+
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, bus.Read()->ResponseCode);
+    CHECK_EQUAL(0, bus.Listener.HandledCount);
+
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(1, bus.Listener.HandledCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.Read()->ResponseCode);
+
+    // The response is only sent once
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerRejectsUnknownCommand)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(0x7F);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CMD_RESPONSE_UNKNOWN, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerEchoesData)
+{
+    TestBus<> bus;
+    auto command = CommandEcho("hello");
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    auto pResponse = (const CommandResponseEcho*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK_EQUAL(6, pResponse->Length - pResponse->HeaderLength());
+    CHECK(memcmp(pResponse->EchoData, "hello", 6) == 0);
+}
+
+
+TEST(ListenerAnswersBusyWhenQueueIsFull)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+
+    for (byte i = 0; i < CommandListener::COMMAND_QUEUE_SIZE; i++) bus.Write(&command);
+
+    bus.Write(&command);
+
+    CHECK_EQUAL(CMD_RESPONSE_BUSY, bus.Read()->ResponseCode);
+
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CommandListener::COMMAND_QUEUE_SIZE, bus.Listener.HandledCount);
+}
+
+
+TEST(ListenerDropsUnreadBusyResponse)
+{
+    TestBus<> bus;
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    auto quiet = CommandMessage(TestListener::CMD_TEST_QUIET);
+
+    // Warms up the client, so the next transaction on the bus is the command itself
+    bus.Send(&ok);
+    bus.Run(100000);
+
+    // The master doesn't read the BUSY response to a command sent to a full queue
+    for (byte i = 0; i <= CommandListener::COMMAND_QUEUE_SIZE; i++) bus.Write(&quiet);
+
+    bus.Listener.Poll();
+
+    bus.Send(&ok);
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(CommandListener::COMMAND_QUEUE_SIZE + 2, bus.Listener.HandledCount);
+}
+
+
+TEST(ListenerDropsUnreadCachedResponse)
+{
+    TestBus<> bus;
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    auto queryID = CommandMessage(CMD_QUERY_ID);
+
+    bus.Send(&ok);
+    bus.Run(100000);
+
+    // The master doesn't read the cached CMD_QUERY_ID response
+    bus.Write(&queryID);
+
+    bus.Send(&ok);
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(sizeof(CommandResponse), bus.LastResponse()->Length);
+    CHECK_EQUAL(2, bus.Listener.HandledCount);
+}
+
+
+#if COMMANDBUS_CRC
+TEST(ListenerDropsUnreadCorruptResponse)
+{
+    TestBus<> bus;
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    auto quiet = CommandMessage(TestListener::CMD_TEST_QUIET);
+    byte frame[sizeof(quiet) + COMMANDBUS_CRC_SIZE];
+
+    bus.Send(&ok);
+    bus.Run(100000);
+
+    // The master doesn't read the CORRUPT response to a command that expects no response
+    memcpy(frame, &quiet, sizeof(quiet));
+    frame[sizeof(quiet)] = CRC8(frame, sizeof(quiet)) ^ 0x01;
+
+    bus.Write(frame, sizeof(frame));
+
+    bus.Send(&ok);
+    bus.Run(100000);
+
+    CHECK_EQUAL(2, bus.ResponseCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.LastResponse()->ResponseCode);
+    CHECK_EQUAL(2, bus.Listener.HandledCount);
+}
+#endif
+
+
+TEST(ListenerHandlesPriorityCommandFirst)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    auto reset = CommandMessage(CMD_RESET_DEVICE);
+
+    for (byte i = 0; i < CommandListener::COMMAND_QUEUE_SIZE; i++) bus.Write(&command);
+
+    // The normal queue is full, but the priority lane still has room
+    bus.Write(&reset);
+    bus.Listener.SetPollBudget(1, 0);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(0, bus.Listener.HandledCount);
+}
+
+
+TEST(ListenerDefersResponse)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    auto pDeferred = (const CommandResponseDeferred*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_DEFERRED, pDeferred->ResponseCode);
+
+    byte responseID = pDeferred->ResponseID;
+
+    CHECK(responseID != 0);
+    CHECK_EQUAL(responseID, bus.Listener.DeferredID);
+
+    auto query = CommandQueryResponseReady(responseID, TestListener::CMD_TEST_DEFER);
+
+    bus.Write(&query);
+
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, bus.Read()->ResponseCode);
+    CHECK(bus.Listener.CompleteDeferred(CMD_RESPONSE_OK));
+
+    bus.Write(&query);
+
+    auto pResponse = bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK_EQUAL(responseID, pResponse->ResponseID);
+
+    // The slot is freed once the response has been sent
+    bus.Write(&query);
+
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerRejectsStaleResponseID)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+    bus.Read();
+
+    auto query = CommandQueryResponseReady(bus.Listener.DeferredID + COMMANDBUS_DEFERRED_SIZE);
+
+    bus.Write(&query);
+
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerRunsOutOfDeferredSlots)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    for (byte i = 0; i < COMMANDBUS_DEFERRED_SIZE; i++)
+    {
+        bus.Write(&command);
+        bus.Listener.Poll();
+
+        CHECK_EQUAL(CMD_RESPONSE_DEFERRED, bus.Read()->ResponseCode);
+    }
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CMD_RESPONSE_BUSY, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerResetFreesDeferredSlots)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+    auto reset = CommandMessage(CMD_RESET_DEVICE);
+
+    for (byte i = 0; i < COMMANDBUS_DEFERRED_SIZE; i++)
+    {
+        bus.Write(&command);
+        bus.Listener.Poll();
+        bus.Read();
+    }
+
+    bus.Write(&reset);
+    bus.Listener.Poll();
+    bus.Write(&command);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CMD_RESPONSE_DEFERRED, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerResetKeepsResponseBeingQueried)
+{
+    TestBus<> bus;
+    auto command = CommandMessage(TestListener::CMD_TEST_DEFER);
+    auto reset = CommandMessage(CMD_RESET_DEVICE);
+
+    bus.Write(&command);
+    bus.Listener.Poll();
+    bus.Read();
+    bus.Listener.CompleteDeferred(CMD_RESPONSE_ERROR);
+
+    // A reset is waiting to be handled when the query hands the response to
+    // the interrupt handler
+    auto query = CommandQueryResponseReady(bus.Listener.DeferredID);
+
+    bus.Write(&reset);
+    bus.Write(&query);
+    bus.Listener.Poll();
+
+    auto pResponse = bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, pResponse->ResponseCode);
+    CHECK_EQUAL(bus.Listener.DeferredID, pResponse->ResponseID);
+}
+
+
+TEST(ListenerBatchesCommands)
+{
+    TestBus<> bus;
+    auto batch = CommandBatch();
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+    auto unknown = CommandMessage(0x7F);
+    auto nested = CommandBatch();
+
+    CHECK(batch.Add(&ok));
+    CHECK(batch.Add(&unknown));
+    CHECK(batch.Add(&ok));
+    CHECK(batch.Add(&nested));
+
+    bus.Write(&batch);
+    bus.Listener.Poll();
+
+    auto pResponse = (const CommandResponseBatch*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK_EQUAL(4, pResponse->Count);
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCodes[0]);
+    CHECK_EQUAL(CMD_RESPONSE_UNKNOWN, pResponse->ResponseCodes[1]);
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCodes[2]);
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, pResponse->ResponseCodes[3]);
+    CHECK_EQUAL(2, bus.Listener.HandledCount);
+}
+
+
+TEST(ListenerLearnsMasterAddress)
+{
+    TestBus<> bus;
+    auto command = CommandMasterAddress(0x08);
+
+    bus.Write(&command);
+
+    CHECK_EQUAL(0x08, bus.Listener.GetMasterAddress());
+}
+
+
+TEST(ListenerDropsRuntFrame)
+{
+    TestBus<> bus;
+    byte frame[] = { 1 };
+
+    bus.Write(frame, sizeof(frame));
+    bus.Listener.Poll();
+
+    CHECK(!bus.Listener.IsCommandPending());
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerRejectsDeferralInBatch)
+{
+    TestBus<> bus;
+    auto batch = CommandBatch();
+    auto defer = CommandMessage(TestListener::CMD_TEST_DEFER);
+
+    batch.Add(&defer);
+
+    // More batches than there are deferred slots, none of which may leak one
+    for (byte i = 0; i <= COMMANDBUS_DEFERRED_SIZE; i++)
+    {
+        bus.Write(&batch);
+        bus.Listener.Poll();
+
+        auto pResponse = (const CommandResponseBatch*)bus.Read();
+
+        CHECK_EQUAL(1, pResponse->Count);
+        CHECK_EQUAL(CMD_RESPONSE_ERROR, pResponse->ResponseCodes[0]);
+    }
+
+    bus.Write(&defer);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CMD_RESPONSE_DEFERRED, bus.Read()->ResponseCode);
+}
+
+
+TEST(ListenerHandlesImmediateCommandsInBatch)
+{
+    TestBus<> bus;
+    auto batch = CommandBatch();
+    auto master = CommandMasterAddress(0x08);
+    auto query = CommandQueryResponseReady(1);
+
+    batch.Add(&master);
+    batch.Add(&query);
+
+    bus.Write(&batch);
+    bus.Listener.Poll();
+
+    auto pResponse = (const CommandResponseBatch*)bus.Read();
+
+    CHECK_EQUAL(2, pResponse->Count);
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCodes[0]);
+    CHECK_EQUAL(CMD_RESPONSE_ERROR, pResponse->ResponseCodes[1]);
+    CHECK_EQUAL(0x08, bus.Listener.GetMasterAddress());
+}
+
+
+TEST(ListenerReceivesFullSizeCommand)
+{
+    TestBus<> bus;
+    auto batch = CommandBatch();
+    auto ok = CommandMessage(TestListener::CMD_TEST_OK);
+
+    while (batch.Add(&ok)) { };
+
+    CHECK_EQUAL(COMMANDBUS_COMMAND_SIZE, batch.Length);
+
+    // The frame is a byte longer than the command with CRC framing
+    bus.Write(&batch);
+    bus.Listener.Poll();
+
+    auto pResponse = (const CommandResponseBatch*)bus.Read();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, pResponse->ResponseCode);
+    CHECK_EQUAL(15, pResponse->Count);
+    CHECK_EQUAL(15, bus.Listener.HandledCount);
+}
+
+
+TEST(ListenerSubclassOverridesQueryID)
+{
+    TestBus<QueryIDListener> bus;
+    auto command = CommandMessage(CMD_QUERY_ID);
+
+    bus.Write(&command);
+
+    // Not answered from the response cache, but by the subclass's handler
+    CHECK_EQUAL(CMD_RESPONSE_NOTREADY, bus.Read()->ResponseCode);
+
+    bus.Listener.Poll();
+
+    auto pResponse = (const CommandResponseQueryID*)bus.Read();
+
+    CHECK_EQUAL(1, bus.Listener.HandledCount);
+    CHECK_EQUAL(0x99, pResponse->ID);
+}
+
+
+//****************************************************************************
+/// A listener that overrides the TwoWire version of SendResponse()
+//****************************************************************************
+class SendResponseListener : public TestListener
+{
+    public: void SendResponse(TwoWire& twi) { SendCount++; CommandListener::SendResponse(twi); };
+
+    public: int SendCount = 0;
+};
+
+
+TEST(ListenerCallsTwoWireSendResponseOverride)
+{
+    TestBus<SendResponseListener> bus;
+    auto command = CommandMessage(CMD_QUERY_ID);
+
+    bus.Write(&command);
+
+    auto pResponse = (const CommandResponseQueryID*)bus.Read();
+
+    CHECK_EQUAL(1, bus.Listener.SendCount);
+    CHECK_EQUAL(0x42, pResponse->ID);
+}
+
+
+TEST(ListenerSubclassOverridesBuiltinInOnCommand)
+{
+    TestBus<OnCommandListener> bus;
+    auto reset = CommandMessage(CMD_RESET_DEVICE);
+    auto echo = CommandEcho("ab");
+
+    bus.Write(&reset);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(1, bus.Listener.HandledCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.Read()->ResponseCode);
+
+    // The other built-in commands still reach the default handler
+    bus.Write(&echo);
+    bus.Listener.Poll();
+
+    CHECK_EQUAL(CMD_RESPONSE_OK, bus.Read()->ResponseCode);
+}
@@ -0,0 +1,17 @@
+/*******************************************************************************
+ TestListener.cpp
+
+ The command table of the listener the tests (and the trace tool) send
+ commands to.
+*******************************************************************************/
+#include "CommandBusTest.h"
+
+
+const CommandHandlerEntry TestListener::CommandTable[] PROGMEM =
+{
+    COMMAND_HANDLER(CMD_TEST_OK,    TestListener, HandleOK),
+    COMMAND_HANDLER(CMD_TEST_DEFER, TestListener, HandleDefer),
+    COMMAND_HANDLER(CMD_TEST_QUIET, TestListener, HandleQuiet),
+};
+
+const byte TestListener::CommandTableSize = COMMAND_TABLE_SIZE(TestListener::CommandTable);
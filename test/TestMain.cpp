@@ -0,0 +1,72 @@
+/*******************************************************************************
+ TestMain.cpp
+
+ Runs the registered tests (or only those whose names contain the first
+ command line argument) and reports the failures.
+*******************************************************************************/
+#include <string.h>
+#include "CommandBusTest.h"
+
+
+static TestCase* pFirstTestCase = NULL;
+
+static TestCase* pLastTestCase = NULL;
+
+bool TestFailed = false;
+
+
+TestCase::TestCase(const char* name, TestFunction function) : Name(name), Function(function), pNext(NULL)
+{
+    // Tests run in the order they appear in each file
+    if (pLastTestCase != NULL)
+        pLastTestCase->pNext = this;
+    else
+        pFirstTestCase = this;
+
+    pLastTestCase = this;
+}
+
+
+void TestFail(const char* file, int line, const char* expression, long expected, long actual, bool showValues)
+{
+    TestFailed = true;
+
+    if (showValues)
+        printf("\n    %s:%d: %s is %ld, expected %ld", file, line, expression, actual, expected);
+    else
+        printf("\n    %s:%d: CHECK(%s) failed", file, line, expression);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* filter = (argc > 1) ? argv[1] : NULL;
+    int run = 0;
+    int failed = 0;
+
+    for (auto pTestCase = pFirstTestCase; pTestCase != NULL; pTestCase = pTestCase->pNext)
+    {
+        if (filter != NULL && strstr(pTestCase->Name, filter) == NULL) continue;
+
+        printf("%s ...", pTestCase->Name);
+        fflush(stdout);
+
+        TestFailed = false;
+        pTestCase->Function();
+        run++;
+
+        if (TestFailed)
+        {
+            failed++;
+            printf("\nFAILED\n");
+        }
+        else
+        {
+            printf(" ok\n");
+        }
+    }
+
+    printf("%d tests, %d failed\n", run, failed);
+
+    return (failed == 0) ? 0 : 1;
+}
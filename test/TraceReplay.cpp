@@ -0,0 +1,229 @@
+/*******************************************************************************
+ TraceReplay.cpp
+
+ Implementation of the bus trace decoder and replayer.
+*******************************************************************************/
+#include <stdlib.h>
+#include <ctype.h>
+#include "TraceReplay.h"
+
+
+//****************************************************************************
+// Appends the records of a CMD_QUERY_TRACE response. Records already added
+// (by sequence number) are skipped, so overlapping responses can be added.
+// Returns false if the response is malformed or the log is full.
+//****************************************************************************
+bool TraceLog::Add(const CommandResponseTrace* pResponse)
+{
+    if (pResponse->ResponseCode != CMD_RESPONSE_OK || pResponse->Length < pResponse->HeaderLength() ||
+        pResponse->Count > (pResponse->Length - pResponse->HeaderLength()) / sizeof(CommandTraceRecord)) return false;
+
+    uint16_t sequence = pResponse->Sequence.Get();
+
+    for (byte i = 0; i < pResponse->Count; i++, sequence++)
+    {
+        if (_count > 0 && (int16_t)(sequence - _nextSequence) < 0) continue;
+
+        if (_count >= MAX_RECORDS) return false;
+
+        _records[_count++] = pResponse->Records[i];
+        _nextSequence = sequence + 1;
+    }
+
+    return true;
+}
+
+
+//****************************************************************************
+// Appends the records of a CMD_QUERY_TRACE response given as a line of hex
+// bytes (e.g. "1D 00 00 00 ..."; spaces, commas and "0x" prefixes are
+// ignored). Returns false if the line isn't a trace response.
+//****************************************************************************
+bool TraceLog::AddHex(const char* pLine)
+{
+    byte frame[sizeof(CommandResponseTrace)];
+    byte count = 0;
+
+    while (*pLine != '\0')
+    {
+        if (pLine[0] == '0' && (pLine[1] == 'x' || pLine[1] == 'X')) pLine += 2;
+
+        if (!isxdigit((unsigned char)pLine[0]))
+        {
+            pLine++;
+            continue;
+        }
+
+        char* pEnd;
+        long value = strtol(pLine, &pEnd, 16);
+
+        if (pEnd - pLine > 2 || count >= sizeof(frame)) return false;
+
+        frame[count++] = (byte)value;
+        pLine = pEnd;
+    }
+
+    auto pResponse = (const CommandResponseTrace*)frame;
+
+    return count >= pResponse->HeaderLength() && pResponse->Length <= count && Add(pResponse);
+}
+
+
+//****************************************************************************
+// Reads the trace of the listener on a bus with CMD_QUERY_TRACE, from the
+// record after the last one added. The queries are traced as well, so only
+// the records from before the first query are read.
+// Returns the number of records added.
+//****************************************************************************
+int TraceLog::Download(TestBus<>& bus)
+{
+    int start = _count;
+    int head = -1;
+
+    for (;;)
+    {
+        auto query = CommandQueryTrace(_nextSequence);
+
+        bus.Write(&query);
+        bus.Listener.Poll();
+
+        auto pResponse = (const CommandResponseTrace*)bus.Read();
+
+        if (pResponse == NULL || pResponse->ResponseCode != CMD_RESPONSE_OK) break;
+
+        if (head < 0) head = pResponse->Head.Get();
+
+        // Only the records before the first query are wanted
+        auto response = *pResponse;
+        byte wanted = (byte)(uint16_t)(head - response.Sequence.Get());
+
+        if (response.Count > wanted)
+        {
+            response.Count   = wanted;
+            response.Length = response.HeaderLength() + wanted * sizeof(CommandTraceRecord);
+        }
+
+        int count = _count;
+
+        if (response.Count == 0 || !Add(&response) || _count == count || _nextSequence == (uint16_t)head) break;
+    }
+
+    // The first query was traced when it was queued, and any commands queued
+    // ahead of it were handled by the same Poll(), so those records are the
+    // download's own and come off the end
+    int end = _count;
+
+    while (end > start && _records[end - 1].Event == (TRACE_DIRECTION_RX | TRACE_HANDLED)) end--;
+
+    if (end > start && _records[end - 1].Event == (TRACE_DIRECTION_RX | TRACE_QUEUED) && _records[end - 1].Code == CMD_QUERY_TRACE) _count = end - 1;
+
+    return _count - start;
+}
+
+
+//****************************************************************************
+// Replays the first count records (or all of them) into the listener on a
+// bus, keeping the time between them
+//****************************************************************************
+void TraceLog::Replay(TestBus<>& bus, int count) const
+{
+    if (count < 0 || count > _count) count = _count;
+
+    if (count == 0) return;
+
+    unsigned long startTime = micros();
+    uint32_t firstTime = _records[0].Time.Get();
+
+    for (int i = 0; i < count; i++)
+    {
+        auto& record = _records[i];
+
+        MockSetMicros(startTime + (record.Time.Get() - firstTime));
+
+        if ((record.Event & TRACE_DIRECTION_TX) != 0)
+        {
+            bus.Read();
+            continue;
+        }
+
+        byte outcome = record.Event & TRACE_OUTCOME_MASK;
+
+        if (outcome == TRACE_HANDLED)
+        {
+            // One command per pass, so each is handled at its own time
+            bus.Listener.SetPollBudget(1, 0);
+            bus.Listener.Poll();
+            continue;
+        }
+
+        byte frame[BUFFER_LENGTH];
+        byte length = (record.Length < BUFFER_LENGTH - COMMANDBUS_CRC_SIZE) ? record.Length : BUFFER_LENGTH - COMMANDBUS_CRC_SIZE;
+
+        memset(frame, 0, sizeof(frame));
+        frame[1] = record.Code;
+
+        // A dropped frame's length is the number of bytes received, and it
+        // is replayed as a frame that claims to be longer than that
+        if (outcome == TRACE_DROPPED)
+        {
+            frame[0] = length + 1;
+            bus.Write(frame, length);
+            continue;
+        }
+
+        frame[0] = (length >= sizeof(CommandMessage)) ? length : sizeof(CommandMessage);
+
+        auto pCommand = (const CommandMessage*)frame;
+
+#if COMMANDBUS_CRC
+        if (outcome == TRACE_CORRUPT)
+        {
+            frame[pCommand->Length] = CRC8(frame, pCommand->Length) ^ 0x01;
+            bus.Write(frame, pCommand->Length + COMMANDBUS_CRC_SIZE);
+            continue;
+        }
+#endif
+
+        bus.Write(pCommand);
+    }
+
+    bus.Listener.SetPollBudget(COMMANDBUS_POLL_MAX_COMMANDS, COMMANDBUS_POLL_MAX_MICROS);
+}
+
+
+const char* TraceLog::EventName(byte event)
+{
+    switch (event & TRACE_OUTCOME_MASK)
+    {
+        case TRACE_QUEUED:      return "queued";
+        case TRACE_HANDLED:     return "handled";
+        case TRACE_IMMEDIATE:   return "immediate";
+        case TRACE_BUSY:        return "busy";
+        case TRACE_DROPPED:     return "dropped";
+        case TRACE_CORRUPT:     return "corrupt";
+        case TRACE_RESPONSE:    return "response";
+        case TRACE_NOTREADY:    return "not ready";
+        default:                return "?";
+    }
+}
+
+
+//****************************************************************************
+// Prints the first count records (or all of them), one per line, with the
+// time since the first record
+//****************************************************************************
+void TraceLog::Print(FILE* pFile, int count) const
+{
+    if (count < 0 || count > _count) count = _count;
+
+    uint32_t firstTime = (count > 0) ? _records[0].Time.Get() : 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        auto& record = _records[i];
+
+        fprintf(pFile, "%10lu us  %s  %-9s  %s 0x%02X  length %u\n", (unsigned long)(record.Time.Get() - firstTime), 
+                ((record.Event & TRACE_DIRECTION_TX) != 0) ? "TX" : "RX", EventName(record.Event),
+                ((record.Event & TRACE_DIRECTION_TX) != 0) ? "response" : "command ", record.Code, record.Length);
+    }
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+ TraceReplay.h
+
+ Host-side decoding and replay of the bus traces that slave devices record 
+ (see COMMANDBUS_TRACE_SIZE and CMD_QUERY_TRACE).
+
+ A TraceLog is filled from CMD_QUERY_TRACE responses, either read straight
+ from a listener on the loopback bus or parsed from hex dumps of responses
+ captured on a real bus. It can print the records, and replay them into a
+ listener: each received frame is sent again at its recorded time, each
+ command handled becomes a pass of Poll(), and each response sent becomes a
+ read by the master. The trace only records each frame's command code and
+ length, so the replayed frames carry zeroed data: a replay reproduces the
+ timing and mix of the traffic (and so the queueing, BUSY responses and
+ drops it caused), not what the commands did.
+*******************************************************************************/
+#ifndef _TraceReplay_h_
+#define _TraceReplay_h_
+
+#include <stdio.h>
+#include "CommandBusTest.h"
+
+
+class TraceLog
+{
+    public: static const int MAX_RECORDS = 512;
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: bool Add(const CommandResponseTrace* pResponse);
+    public: bool AddHex(const char* pLine);
+    public: int Download(TestBus<>& bus);
+    public: void Replay(TestBus<>& bus, int count=-1) const;
+    public: void Print(FILE* pFile, int count=-1) const;
+    public: void Clear() { _count = 0; _nextSequence = 0; };
+
+    public: int Count() const { return _count; };
+    public: const CommandTraceRecord& operator[](int index) const { return _records[index]; };
+    public: uint16_t NextSequence() const { return _nextSequence; };
+
+    public: static const char* EventName(byte event);
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: CommandTraceRecord _records[MAX_RECORDS];
+
+    private: int _count = 0;
+
+    private: uint16_t _nextSequence = 0;        // The sequence number after the last record added
+};
+
+#endif
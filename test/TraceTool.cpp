@@ -0,0 +1,77 @@
+/*******************************************************************************
+ TraceTool.cpp
+
+ Decodes the bus traces recorded by slave devices, and replays them on the
+ host.
+
+     tracetool [-r] [file]
+
+ Reads CMD_QUERY_TRACE responses captured from a slave device, one response
+ frame per line as hex bytes, from the file (or standard input), and prints
+ the trace records. With -r the trace is also replayed into a TestListener
+ on the loopback bus, and the trace the replay recorded is printed after it.
+*******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "TraceReplay.h"
+
+
+static TraceLog recordedTrace;
+
+static TraceLog replayedTrace;
+
+
+int main(int argc, char* argv[])
+{
+    bool replay = false;
+    const char* pFileName = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0)
+            replay = true;
+        else
+            pFileName = argv[i];
+    }
+
+    FILE* pFile = (pFileName != NULL) ? fopen(pFileName, "r") : stdin;
+
+    if (pFile == NULL)
+    {
+        fprintf(stderr, "tracetool: can't open %s\n", pFileName);
+        return 2;
+    }
+
+    char line[256];
+    int lineNumber = 0;
+
+    while (fgets(line, sizeof(line), pFile) != NULL)
+    {
+        lineNumber++;
+
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) continue;
+
+        if (!recordedTrace.AddHex(line)) fprintf(stderr, "tracetool: line %d is not a CMD_QUERY_TRACE response\n", lineNumber);
+    }
+
+    if (pFile != stdin) fclose(pFile);
+
+    printf("Recorded trace (%d records)\n", recordedTrace.Count());
+    recordedTrace.Print(stdout);
+
+    if (!replay) return 0;
+
+#if COMMANDBUS_TRACE_SIZE > 0
+    TestBus<> bus;
+
+    recordedTrace.Replay(bus);
+    replayedTrace.Download(bus);
+
+    printf("\nReplayed trace (%d records)\n", replayedTrace.Count());
+    replayedTrace.Print(stdout);
+#else
+    fprintf(stderr, "tracetool: built without COMMANDBUS_TRACE_SIZE, so a replay can't be traced\n");
+#endif
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*******************************************************************************
+ TransportTests.cpp
+
+ Tests of the serial and SPI transports, driven byte by byte the way their
+ links would drive them.
+*******************************************************************************/
+#include "CommandBusTest.h"
+#include "../SerialCommandTransport.h"
+#include "../SPICommandTransport.h"
+
+
+//****************************************************************************
+/// A serial link: the bytes written to it by the master, to be read by the
+/// transport, and the bytes the transport has written back
+//****************************************************************************
+class TestStream : public Stream
+{
+    public: static const byte BUFFER_SIZE = 64;
+
+    public: void Feed(const void* pData, byte count)
+    {
+        memcpy(_input + _inputCount, pData, count);
+        _inputCount += count;
+    };
+
+    public: void Feed(byte data) { Feed(&data, 1); };
+
+    public: int available() { return _inputCount - _inputCursor; };
+    public: int read() { return (_inputCursor < _inputCount) ? _input[_inputCursor++] : -1; };
+    public: size_t write(uint8_t data) { if (OutputCount < BUFFER_SIZE) Output[OutputCount++] = data; return 1; };
+
+    public: byte Output[BUFFER_SIZE];
+
+    public: byte OutputCount = 0;
+
+    private: byte _input[BUFFER_SIZE];
+
+    private: byte _inputCount = 0;
+
+    private: byte _inputCursor = 0;
+};
+
+
+//****************************************************************************
+// Copies a command to a frame buffer with its CRC byte (if enabled), and
+// returns the frame's length
+//****************************************************************************
+static byte MakeFrame(const CommandMessage& command, byte* pFrame)
+{
+    memcpy(pFrame, &command, command.Length);
+#if COMMANDBUS_CRC
+    pFrame[command.Length] = CRC8(pFrame, command.Length);
+#endif
+
+    return command.Length + COMMANDBUS_CRC_SIZE;
+}
+
+
+TEST(SerialRoundTrip)
+{
+    TestListener listener;
+    TestStream stream;
+    SerialCommandTransport transport(listener, 0x10, stream);
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte frame[sizeof(command) + COMMANDBUS_CRC_SIZE];
+    byte length = MakeFrame(command, frame);
+
+    MockSetMicros(1000);
+    transport.Begin();
+    listener.Begin();
+
+    stream.Feed(0x10 << 1);
+    stream.Feed(frame, length);
+    transport.Poll();
+    listener.Poll();
+
+    CHECK_EQUAL(1, listener.HandledCount);
+
+    stream.Feed((0x10 << 1) | 1);
+    stream.Feed(SerialCommandTransport::TX_WINDOW);
+    transport.Poll();
+
+    CHECK_EQUAL(SerialCommandTransport::TX_WINDOW, stream.OutputCount);
+    CHECK_EQUAL(sizeof(CommandResponse), stream.Output[0]);
+    CHECK_EQUAL(CMD_RESPONSE_OK, stream.Output[1]);
+    CHECK_EQUAL(0xFF, stream.Output[sizeof(CommandResponse) + COMMANDBUS_CRC_SIZE]);
+#if COMMANDBUS_CRC
+    CHECK_EQUAL(0, CRC8(stream.Output, sizeof(CommandResponse) + COMMANDBUS_CRC_SIZE));
+#endif
+}
+
+
+TEST(SerialSkipsOtherDevices)
+{
+    TestListener listener;
+    TestStream stream;
+    SerialCommandTransport transport(listener, 0x10, stream);
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte frame[sizeof(command) + COMMANDBUS_CRC_SIZE];
+    byte length = MakeFrame(command, frame);
+
+    MockSetMicros(1000);
+    transport.Begin();
+    listener.Begin();
+
+    // The command code byte of a command to another device is this device's
+    // address byte, so it is only skipped over if the framing is followed
+    static_assert(TestListener::CMD_TEST_OK == (0x10 << 1), "The command code should look like the address byte");
+
+    stream.Feed(0x11 << 1);
+    stream.Feed(frame, length);
+    stream.Feed((0x11 << 1) | 1);
+    stream.Feed(4);
+    stream.Feed("\x20\x20\x20\x20", 4);
+    transport.Poll();
+    listener.Poll();
+
+    CHECK_EQUAL(0, listener.HandledCount);
+    CHECK_EQUAL(0, stream.OutputCount);
+
+    stream.Feed(0x10 << 1);
+    stream.Feed(frame, length);
+    transport.Poll();
+    listener.Poll();
+
+    CHECK_EQUAL(1, listener.HandledCount);
+}
+
+
+TEST(SerialAbandonsStalledTransaction)
+{
+    TestListener listener;
+    TestStream stream;
+    SerialCommandTransport transport(listener, 0x10, stream);
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte frame[sizeof(command) + COMMANDBUS_CRC_SIZE];
+    byte length = MakeFrame(command, frame);
+
+    MockSetMicros(1000);
+    transport.Begin();
+    listener.Begin();
+
+    stream.Feed(0x10 << 1);
+    stream.Feed(frame, 1);
+    transport.Poll();
+
+    MockAdvanceMicros(COMMANDBUS_SERIAL_FRAME_TIMEOUT + 1);
+
+    stream.Feed(0x10 << 1);
+    stream.Feed(frame, length);
+    transport.Poll();
+    listener.Poll();
+
+    CHECK_EQUAL(1, listener.HandledCount);
+}
+
+
+//****************************************************************************
+// Clocks a command through an SPI transport, then clocks its response frame
+// out into pResponse. Each byte the transport returns is the one the master
+// receives in the next transfer, so reading an n byte frame takes the mode
+// byte's transfer and n more.
+//****************************************************************************
+static void SPITransaction(SPICommandTransport& transport, TestListener& listener, const CommandMessage& command, byte* pResponse)
+{
+    byte frame[COMMANDBUS_COMMAND_SIZE + COMMANDBUS_CRC_SIZE];
+    byte length = MakeFrame(command, frame);
+
+    transport.OnTransfer(SPICommandTransport::SPI_WRITE_COMMAND);
+
+    for (byte i = 0; i < length; i++) transport.OnTransfer(frame[i]);
+
+    listener.Poll();
+
+    pResponse[0] = transport.OnTransfer(SPICommandTransport::SPI_READ_RESPONSE);
+
+    byte frameLength = pResponse[0] + COMMANDBUS_CRC_SIZE;
+
+    for (byte i = 1; i < frameLength; i++) pResponse[i] = transport.OnTransfer(SPICommandTransport::SPI_IDLE_BYTE);
+
+    // The master's byte in the transfer that clocks out the last response byte
+    transport.OnTransfer(SPICommandTransport::SPI_IDLE_BYTE);
+}
+
+
+TEST(SPIRoundTrip)
+{
+    TestListener listener;
+    SPICommandTransport transport(listener);
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte response[COMMANDBUS_MAX_RESPONSE_SIZE + COMMANDBUS_CRC_SIZE];
+
+    transport.Begin();
+    listener.Begin();
+
+    SPITransaction(transport, listener, command, response);
+
+    CHECK_EQUAL(1, listener.HandledCount);
+    CHECK_EQUAL(sizeof(CommandResponse), response[0]);
+    CHECK_EQUAL(CMD_RESPONSE_OK, response[1]);
+#if COMMANDBUS_CRC
+    CHECK_EQUAL(0, CRC8(response, sizeof(CommandResponse) + COMMANDBUS_CRC_SIZE));
+#endif
+}
+
+
+TEST(SPIRunsTransactionsWithoutDeselect)
+{
+    TestListener listener;
+    SPICommandTransport transport(listener);
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte response[COMMANDBUS_MAX_RESPONSE_SIZE + COMMANDBUS_CRC_SIZE];
+
+    transport.Begin();
+    listener.Begin();
+
+    // The sketch doesn't forward slave select, so OnDeselect() is never called
+    for (byte i = 1; i <= 3; i++)
+    {
+        memset(response, 0, sizeof(response));
+        SPITransaction(transport, listener, command, response);
+
+        CHECK_EQUAL(i, listener.HandledCount);
+        CHECK_EQUAL(CMD_RESPONSE_OK, response[1]);
+    }
+}
+
+
+TEST(SPIDeselectDropsPartialCommand)
+{
+    TestListener listener;
+    SPICommandTransport transport(listener);
+    auto command = CommandMessage(TestListener::CMD_TEST_OK);
+    byte response[COMMANDBUS_MAX_RESPONSE_SIZE + COMMANDBUS_CRC_SIZE];
+
+    transport.Begin();
+    listener.Begin();
+
+    transport.OnTransfer(SPICommandTransport::SPI_WRITE_COMMAND);
+    transport.OnTransfer(sizeof(CommandMessage));
+    transport.OnDeselect();
+    listener.Poll();
+
+    CHECK_EQUAL(0, listener.HandledCount);
+
+    SPITransaction(transport, listener, command, response);
+
+    CHECK_EQUAL(1, listener.HandledCount);
+    CHECK_EQUAL(CMD_RESPONSE_OK, response[1]);
+}
@@ -0,0 +1,75 @@
+/*******************************************************************************
+ Arduino.h (host mock)
+
+ The parts of the Arduino core the command bus library uses, for building and
+ testing it on the host. Time comes from a simulated microsecond clock that
+ the tests advance, or from the host's clock for the benchmark. The simulated
+ interrupt handlers (the mock TwoWire's slave callbacks) and noInterrupts()
+ sections hold the same lock, so a main loop on one thread and a bus master
+ on another are serialized the way interrupts are on a single-core device.
+*******************************************************************************/
+#ifndef _MockArduino_h_
+#define _MockArduino_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define pgm_read_byte(p)    (*(const uint8_t*)(p))
+#define pgm_read_ptr(p)     (*(void* const*)(p))
+#define _BV(bit)            (1 << (bit))
+
+#define LOW     0
+#define HIGH    1
+#define INPUT   0
+#define OUTPUT  1
+#define MISO    12
+
+unsigned long micros();
+unsigned long millis();
+
+void noInterrupts();
+void interrupts();
+
+inline void pinMode(int pin, int mode) { };
+inline void digitalWrite(int pin, int value) { };
+
+
+//****************************************************************************
+/// A byte stream, like the Arduino core's Stream (and Print) classes
+//****************************************************************************
+class Stream
+{
+    public: virtual ~Stream() { };
+
+    public: virtual int available() = 0;
+    public: virtual int read() = 0;
+    public: virtual size_t write(uint8_t data) = 0;
+    public: virtual size_t write(const uint8_t* pBuffer, size_t count)
+    {
+        size_t written = 0;
+
+        while (count-- > 0) written += write(*pBuffer++);
+
+        return written;
+    };
+    public: virtual void flush() { };
+};
+
+
+//****************************************************************************
+// Mock controls
+//****************************************************************************
+void MockSetMicros(unsigned long now);
+void MockAdvanceMicros(unsigned long elapsed);
+void MockUseHostClock(bool enable);
+bool MockInterruptsEnabled();
+
+/// Runs the code between them as an interrupt handler
+void MockBeginInterrupt();
+void MockEndInterrupt();
+
+#endif
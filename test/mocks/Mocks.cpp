@@ -0,0 +1,265 @@
+/*******************************************************************************
+ Mocks.cpp
+
+ Implementation of the host mocks of the Arduino core and Wire library.
+*******************************************************************************/
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <Arduino.h>
+#include <Wire.h>
+
+
+static unsigned long mockMicros = 0;
+
+static bool mockHostClock = false;
+
+static std::chrono::steady_clock::time_point mockHostEpoch;
+
+// The lock held while interrupts are disabled, and this thread's view of it
+static std::mutex mockInterruptLock;
+
+static thread_local bool mockInterruptsDisabled = false;
+
+static thread_local bool mockInInterrupt = false;
+
+static thread_local bool mockDisabledBeforeInterrupt = false;
+
+
+unsigned long micros()
+{
+    if (!mockHostClock) return mockMicros;
+
+    auto elapsed = std::chrono::steady_clock::now() - mockHostEpoch;
+
+    return mockMicros + std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+unsigned long millis() { return micros() / 1000; }
+
+void MockSetMicros(unsigned long now) { mockMicros = now; }
+
+void MockAdvanceMicros(unsigned long elapsed) { mockMicros += elapsed; }
+
+//****************************************************************************
+// Switches micros() to the host's clock (counting on from the simulated time)
+// or back to the simulated clock
+//****************************************************************************
+void MockUseHostClock(bool enable)
+{
+    if (enable) mockHostEpoch = std::chrono::steady_clock::now();
+    else mockMicros = micros();
+
+    mockHostClock = enable;
+}
+
+
+//****************************************************************************
+// Interrupts
+// An interrupt handler runs with interrupts disabled, so the noInterrupts()
+// and interrupts() calls it makes are ignored, as on an AVR.
+//****************************************************************************
+void noInterrupts()
+{
+    if (mockInterruptsDisabled) return;
+
+    mockInterruptLock.lock();
+    mockInterruptsDisabled = true;
+}
+
+void interrupts()
+{
+    if (!mockInterruptsDisabled || mockInInterrupt) return;
+
+    mockInterruptsDisabled = false;
+    mockInterruptLock.unlock();
+}
+
+bool MockInterruptsEnabled() { return !mockInterruptsDisabled; }
+
+void MockBeginInterrupt()
+{
+    mockDisabledBeforeInterrupt = mockInterruptsDisabled;
+    noInterrupts();
+    mockInInterrupt = true;
+}
+
+void MockEndInterrupt()
+{
+    mockInInterrupt = false;
+
+    if (!mockDisabledBeforeInterrupt) interrupts();
+}
+
+
+TwoWire Wire;
+
+TwoWire* TwoWire::_slaves[128];
+
+int TwoWire::CorruptNextRead = -1;
+
+int TwoWire::CorruptNextWrite = -1;
+
+unsigned long TwoWire::TransactionCount = 0;
+unsigned long TwoWire::BytesRead = 0;
+
+void (*TwoWire::OnTransaction)(int address, bool isRead, const uint8_t* pData, int count) = NULL;
+
+
+TwoWire::~TwoWire()
+{
+    if (_address >= 0 && _slaves[_address] == this) _slaves[_address] = NULL;
+}
+
+
+void TwoWire::ResetBus()
+{
+    memset(_slaves, 0, sizeof(_slaves));
+    CorruptNextRead  = -1;
+    CorruptNextWrite = -1;
+    TransactionCount = 0;
+    BytesRead = 0;
+    OnTransaction = NULL;
+}
+
+
+void TwoWire::begin(uint8_t address)
+{
+    _address = address & 0x7F;
+    _slaves[_address] = this;
+}
+
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+    _txAddress = address & 0x7F;
+    _txCount = 0;
+}
+
+
+//****************************************************************************
+// Holds the bus for the time it takes to clock the given number of bits (on
+// the host's clock, yielding to the other threads meanwhile, or by moving the
+// simulated clock on)
+//****************************************************************************
+void TwoWire::WaitBusTime(int bits)
+{
+    if (_clock == 0) return;
+
+    unsigned long duration = (bits * 1000000UL) / _clock;
+
+    if (!mockHostClock)
+    {
+        MockAdvanceMicros(duration);
+        return;
+    }
+
+    unsigned long startTime = micros();
+
+    while (micros() - startTime < duration) std::this_thread::yield();
+}
+
+
+size_t TwoWire::write(uint8_t data)
+{
+    if (_txCount >= BUFFER_LENGTH) return 0;
+
+    _txBuffer[_txCount++] = data;
+
+    return 1;
+}
+
+
+//****************************************************************************
+// Delivers the transmission to the slave device, by calling its receive
+// callback (its "interrupt handler") with the bytes waiting to be read.
+// Returns 2 (address NACK) if there is no slave device at the address.
+//****************************************************************************
+uint8_t TwoWire::endTransmission()
+{
+    TransactionCount++;
+
+    auto pSlave = _slaves[_txAddress];
+
+    if (pSlave == NULL)
+    {
+        WaitBusTime(10);
+        return 2;
+    }
+
+    // The start condition, the address and data bytes (each with its ACK
+    // bit), and the stop condition
+    WaitBusTime(2 + 9 * (_txCount + 1));
+
+    memcpy(pSlave->_rxBuffer, _txBuffer, _txCount);
+
+    if (CorruptNextWrite >= 0 && CorruptNextWrite < _txCount)
+    {
+        pSlave->_rxBuffer[CorruptNextWrite] ^= 0x01;
+        CorruptNextWrite = -1;
+    }
+
+    pSlave->_rxCount  = _txCount;
+    pSlave->_rxCursor = 0;
+
+    if (pSlave->_onReceive != NULL)
+    {
+        MockBeginInterrupt();
+        pSlave->_onReceive(_txCount);
+        MockEndInterrupt();
+    }
+
+    if (OnTransaction != NULL) OnTransaction(_txAddress, false, pSlave->_rxBuffer, _txCount);
+
+    return 0;
+}
+
+
+//****************************************************************************
+// Reads count bytes from a slave device, by calling its request callback
+// (its "interrupt handler") and padding what it wrote with 0xFF.
+// Returns 0 if there is no slave device at the address.
+//****************************************************************************
+uint8_t TwoWire::requestFrom(int address, int count)
+{
+    TransactionCount++;
+
+    auto pSlave = _slaves[address & 0x7F];
+
+    if (pSlave == NULL || count > BUFFER_LENGTH)
+    {
+        WaitBusTime(10);
+        return 0;
+    }
+
+    pSlave->_txCount = 0;
+
+    // The start condition and the address byte, before the slave's request
+    // callback, then the data bytes and the stop condition
+    WaitBusTime(10);
+
+    if (pSlave->_onRequest != NULL)
+    {
+        MockBeginInterrupt();
+        pSlave->_onRequest();
+        MockEndInterrupt();
+    }
+
+    WaitBusTime(9 * count + 1);
+
+    for (int i = 0; i < count; i++) _rxBuffer[i] = (i < pSlave->_txCount) ? pSlave->_txBuffer[i] : 0xFF;
+
+    if (CorruptNextRead >= 0 && CorruptNextRead < count)
+    {
+        _rxBuffer[CorruptNextRead] ^= 0x01;
+        CorruptNextRead = -1;
+    }
+
+    _rxCount  = count;
+    _rxCursor = 0;
+    BytesRead += count;
+
+    if (OnTransaction != NULL) OnTransaction(address & 0x7F, true, _rxBuffer, count);
+
+    return count;
+}
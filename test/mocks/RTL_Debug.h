@@ -0,0 +1,13 @@
+/*******************************************************************************
+ RTL_Debug.h (host mock)
+
+ The debug tracing macros compile to nothing on the host.
+*******************************************************************************/
+#ifndef _MockRTL_Debug_h_
+#define _MockRTL_Debug_h_
+
+#define DECLARE_CLASSNAME       static const char* _classname_
+#define DEFINE_CLASSNAME(name)  const char* name::_classname_ = #name
+#define TRACE(x)
+
+#endif
@@ -0,0 +1,9 @@
+/*******************************************************************************
+ RTL_I2C.h (host mock)
+*******************************************************************************/
+#ifndef _MockRTL_I2C_h_
+#define _MockRTL_I2C_h_
+
+#include <Wire.h>
+
+#endif
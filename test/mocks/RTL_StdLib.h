@@ -0,0 +1,9 @@
+/*******************************************************************************
+ RTL_StdLib.h (host mock)
+*******************************************************************************/
+#ifndef _MockRTL_StdLib_h_
+#define _MockRTL_StdLib_h_
+
+#include <Arduino.h>
+
+#endif
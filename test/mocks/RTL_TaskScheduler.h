@@ -0,0 +1,40 @@
+/*******************************************************************************
+ RTL_TaskScheduler.h (host mock)
+
+ The event framework types the command bus library uses. Events are passed
+ to IEventListener::OnEvent() directly by the tests.
+*******************************************************************************/
+#ifndef _MockRTL_TaskScheduler_h_
+#define _MockRTL_TaskScheduler_h_
+
+#include <Arduino.h>
+
+typedef uint16_t EVENT_ID;
+
+namespace EventSourceID { const EVENT_ID Task = 0x0100; }
+
+namespace EventCode { const EVENT_ID Response = 0x0001; }
+
+struct Event
+{
+    EVENT_ID EventID;
+    union
+    {
+        void* Pointer;
+        long Long;
+    } Data;
+};
+
+class EventSource
+{
+    public: virtual ~EventSource() { };
+    public: virtual void Poll() { };
+};
+
+class IEventListener
+{
+    public: virtual ~IEventListener() { };
+    public: virtual void OnEvent(const Event* pEvent) = 0;
+};
+
+#endif
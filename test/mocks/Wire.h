@@ -0,0 +1,104 @@
+/*******************************************************************************
+ Wire.h (host mock)
+
+ A loopback I2C bus. Each TwoWire started with begin(address) is a slave
+ device on the bus; a TwoWire used as a master delivers its transmissions to
+ the slave's receive callback, and calls the slave's request callback for
+ each requestFrom(), just as the interrupt handlers of a real slave would be.
+ Short replies are padded with 0xFF, like an idle bus. A master given a clock
+ with setClock() holds each transaction for as long as it would take to
+ clock its bytes over the bus.
+*******************************************************************************/
+#ifndef _MockWire_h_
+#define _MockWire_h_
+
+#include <Arduino.h>
+
+#ifndef BUFFER_LENGTH
+#define BUFFER_LENGTH 64
+#endif
+
+
+class TwoWire : public Stream
+{
+    /***************************************************************************
+    Constructors / Destructors
+    ***************************************************************************/
+    public: TwoWire() { };
+    public: ~TwoWire();
+
+    /***************************************************************************
+    Public implementation
+    ***************************************************************************/
+    public: void begin() { };
+    public: void begin(uint8_t address);
+    public: void setClock(uint32_t clock) { _clock = clock; };
+    public: void onReceive(void (*handler)(int)) { _onReceive = handler; };
+    public: void onRequest(void (*handler)()) { _onRequest = handler; };
+
+    public: void beginTransmission(uint8_t address);
+    public: uint8_t endTransmission();
+    public: uint8_t requestFrom(int address, int count);
+
+    public: int available() { return _rxCount - _rxCursor; };
+    public: int read() { return (_rxCursor < _rxCount) ? _rxBuffer[_rxCursor++] : -1; };
+    public: size_t write(uint8_t data);
+    using Stream::write;
+
+    /***************************************************************************
+    Mock controls
+    ***************************************************************************/
+    /// Flips a bit in byte index of the next reply read from a slave (-1 for none)
+    public: static int CorruptNextRead;
+
+    /// Flips a bit in byte index of the next transmission to a slave (-1 for none)
+    public: static int CorruptNextWrite;
+
+    /// Forgets every slave device on the bus
+    public: static void ResetBus();
+
+    /// The number of transactions on the bus so far
+    public: static unsigned long TransactionCount;
+
+    /// The number of bytes read from slave devices so far
+    public: static unsigned long BytesRead;
+
+    /// If set, called after each transaction with the slave's address,
+    /// whether it was a read, and the bytes transferred
+    public: static void (*OnTransaction)(int address, bool isRead, const uint8_t* pData, int count);
+
+    /***************************************************************************
+    Internal implementation
+    ***************************************************************************/
+    private: void WaitBusTime(int bits);
+
+    /***************************************************************************
+    Internal state
+    ***************************************************************************/
+    private: static TwoWire* _slaves[128];
+
+    private: int _address = -1;                 // Slave address (-1 if not a slave)
+
+    private: void (*_onReceive)(int) = NULL;
+
+    private: void (*_onRequest)() = NULL;
+
+    private: uint32_t _clock = 0;               // Bus clock (0 for transactions that take no time)
+
+
+    private: int _txAddress = 0;
+
+    private: uint8_t _txBuffer[BUFFER_LENGTH];
+
+    private: int _txCount = 0;
+
+    private: uint8_t _rxBuffer[BUFFER_LENGTH];
+
+    private: int _rxCount = 0;
+
+    private: int _rxCursor = 0;
+};
+
+extern TwoWire Wire;
+
+#endif